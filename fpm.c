@@ -0,0 +1,2261 @@
+/*
+ * Copyright (C) 2017-2018 bouncyball
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "mlv.h"
+#include "fpm.h"
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/* 'count' pixels from column 'x' on every 'step' columns */
+struct map_run
+{
+    uint32_t x;
+    uint32_t step;
+    uint32_t count;
+};
+
+/* focus pixels of one row of a pass: stride runs in ascending order while pixels are added
+   behind the last one, a bitset of 'bit_words' words once one is not */
+struct map_row
+{
+    uint32_t count;
+    uint32_t run_count;
+    uint32_t run_capacity;      /* 1 while only 'first' is used */
+    uint32_t bit_words;
+    struct map_run first;
+    struct map_run * runs;
+    uint64_t * bits;
+};
+
+/* rows indexed by y */
+struct map_pass
+{
+    uint32_t count;
+    uint32_t row_count;
+    struct map_row * rows;
+};
+
+struct fpm_map
+{
+    fpm_allocator_t allocator;
+    fpm_info_t info;            /* width and height also size bitsets and rows allocated up front, both grow if needed */
+    int count;                  /* pixels of all passes */
+    int pass_count;
+    struct map_pass * passes;
+};
+
+struct fpm_context
+{
+    fpm_allocator_t allocator;
+    fpm_camera_t * cameras;     /* added at run time, searched before the built-in ones */
+    int camera_count;
+    fpm_pattern_t * patterns;
+    int pattern_count;
+};
+
+/* allocator ************************************************************************************************************/
+
+static void * default_alloc(void * opaque, size_t size)
+{
+    return malloc(size);
+}
+
+static void * default_realloc(void * opaque, void * ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void default_free(void * opaque, void * ptr)
+{
+    free(ptr);
+}
+
+static void * mem_alloc(const fpm_allocator_t * allocator, size_t size)
+{
+    return allocator->alloc(allocator->opaque, size);
+}
+
+static void * mem_zalloc(const fpm_allocator_t * allocator, size_t size)
+{
+    void * ptr = allocator->alloc(allocator->opaque, size);
+    if(ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+static void * mem_realloc(const fpm_allocator_t * allocator, void * ptr, size_t size)
+{
+    return (ptr) ? allocator->realloc(allocator->opaque, ptr, size) : allocator->alloc(allocator->opaque, size);
+}
+
+static void mem_free(const fpm_allocator_t * allocator, void * ptr)
+{
+    if(ptr) allocator->free(allocator->opaque, ptr);
+}
+
+/* focus pixel pattern tables ****************************************************************************************/
+
+/* row phases and column shifts shared by several modes */
+#define PHASES_MV720        4, { { 3, 7 }, { 4, 6 }, { 9, 3 }, { 10, 2 } }
+#define PHASES_MV1080       4, { { 0, 0 }, { 1, 1 }, { 5, 5 }, { 6, 4 } }
+#define PHASES_A_CROP       12, { { 7, 19 }, { 11, 13 }, { 12, 18 }, { 14, 12 }, { 26, 0 }, { 29, 1 }, { 37, 7 }, { 41, 13 }, { 42, 6 }, { 44, 12 }, { 56, 0 }, { 59, 1 } }
+#define PHASES_A_CROP_U     12, { { 7, 3 }, { 11, 5 }, { 12, 2 }, { 14, 4 }, { 26, 0 }, { 29, 1 }, { 37, 7 }, { 41, 5 }, { 42, 6 }, { 44, 4 }, { 56, 0 }, { 59, 1 } }
+#define PHASES_A_CROP_U_S   12, { { 7, 2 }, { 11, 4 }, { 12, 1 }, { 14, 3 }, { 26, 7 }, { 29, 0 }, { 37, 6 }, { 41, 4 }, { 42, 5 }, { 44, 3 }, { 56, 7 }, { 59, 0 } }
+#define PHASES_A_ZOOM_U     1, { { 14, 4 } }
+#define PHASES_B_CROP       4, { { 2, 0 }, { 5, 1 }, { 6, 6 }, { 7, 7 } }
+#define PHASES_B_CROP_U_S   4, { { 2, 11 }, { 5, 0 }, { 6, 5 }, { 7, 6 } }
+#define PHASES_B_ZOOM_U     4, { { 2, 4 }, { 5, 5 }, { 6, 10 }, { 7, 11 } }
+
+#define SWEEP(start, end, x_rep, y_rep, phases) { start, end, 72, x_rep, y_rep, phases }
+#define PASS1(sweep) { 1, { sweep } }
+
+#define MODEL_EOSM  0x80000331
+#define MODEL_650D  0x80000301
+#define MODEL_700D  0x80000326
+#define MODEL_100D  0x80000346
+
+static const fpm_camera_t builtin_cameras[] =
+{
+    { "EOSM", "Canon EOS M", MODEL_EOSM },
+    { "100D", "Canon EOS 100D", MODEL_100D },
+    { "650D", "Canon EOS 650D", MODEL_650D },
+    { "700D", "Canon EOS 700D", MODEL_700D },
+};
+
+/* Pattern A: EOSM, 650D, 700D, Pattern B: 100D */
+static const fpm_pattern_t builtin_patterns[] =
+{
+    { FPM_MV_720, 1, { MODEL_100D }, 1, { PASS1(SWEEP(86, 669, 8, 12, PHASES_MV720)) } },
+    { FPM_MV_720, 0, { 0 }, 1, { PASS1(SWEEP(290, 465, 8, 12, PHASES_MV720)) } },
+
+    { FPM_MV_1080, 1, { MODEL_100D }, 1, { PASS1(SWEEP(119, 1095, 8, 10, PHASES_MV1080)) } },
+    { FPM_MV_1080, 0, { 0 }, 1, { PASS1(SWEEP(459, 755, 8, 10, PHASES_MV1080)) } },
+
+    { FPM_MV_1080CROP, 1, { MODEL_100D }, 1, { PASS1(SWEEP(29, 1057, 12, 6, PHASES_B_CROP)) } },
+    { FPM_MV_1080CROP, 0, { 0 }, 1, { PASS1(SWEEP(121, 1013, 24, 60, PHASES_A_CROP)) } },
+
+    { FPM_MV_ZOOM, 1, { MODEL_100D }, 1, { PASS1(SWEEP(28, FPM_LAST_ROW, 12, 6, PHASES_B_CROP)) } },
+    { FPM_MV_ZOOM, 0, { 0 }, 1, { PASS1(SWEEP(31, FPM_LAST_ROW, 24, 60, PHASES_A_CROP)) } },
+
+    /* first pass like mv720, second like mv1080 with other rows, 700D needs no first pass */
+    { FPM_MV_CROPREC, 1, { MODEL_100D }, 2, { PASS1(SWEEP(86, 669, 8, 12, PHASES_MV720)), PASS1(SWEEP(28, 724, 8, 10, PHASES_MV1080)) } },
+    { FPM_MV_CROPREC, 1, { MODEL_700D }, 1, { PASS1(SWEEP(219, 515, 8, 10, PHASES_MV1080)) } },
+    { FPM_MV_CROPREC, 0, { 0 }, 2, { PASS1(SWEEP(290, 465, 8, 12, PHASES_MV720)), PASS1(SWEEP(219, 515, 8, 10, PHASES_MV1080)) } },
+
+    { FPM_MV_720_U, 0, { 0 }, 1, { PASS1(SWEEP(28, 726, 8, 12, PHASES_MV720)) } },
+
+    { FPM_MV_1080_U, 0, { 0 }, 1, { PASS1(SWEEP(28, 1189, 8, 10, PHASES_MV1080)) } },
+
+    /* second pass shifted, 100D zoom draws its two sweeps as passes of their own */
+    { FPM_MV_1080CROP_U, 1, { MODEL_100D }, 2, { PASS1(SWEEP(28, 1058, 12, 6, PHASES_B_CROP)), PASS1(SWEEP(28, 1058, 12, 6, PHASES_B_CROP_U_S)) } },
+    { FPM_MV_1080CROP_U, 0, { 0 }, 2, { PASS1(SWEEP(28, 1058, 8, 60, PHASES_A_CROP_U)), PASS1(SWEEP(28, 1058, 8, 60, PHASES_A_CROP_U_S)) } },
+
+    { FPM_MV_ZOOM_U, 1, { MODEL_100D }, 2, { PASS1(SWEEP(28, FPM_LAST_ROW, 12, 6, PHASES_B_CROP)), PASS1(SWEEP(28, FPM_LAST_ROW, 12, 6, PHASES_B_ZOOM_U)) } },
+    { FPM_MV_ZOOM_U, 0, { 0 }, 1, { { 2, { SWEEP(28, FPM_LAST_ROW, 8, 60, PHASES_A_CROP_U), SWEEP(28, FPM_LAST_ROW, 8, 60, PHASES_A_ZOOM_U) } } } },
+
+    { FPM_MV_CROPREC_U, 0, { 0 }, 2, { PASS1(SWEEP(28, 726, 8, 12, PHASES_MV720)), PASS1(SWEEP(28, 726, 8, 10, PHASES_MV1080)) } },
+};
+
+static const char * video_mode_names[] = { "mv720", "mv1080", "mv1080crop", "zoom", "croprec" };
+
+fpm_context_t * fpm_context_new(const fpm_allocator_t * allocator)
+{
+    static const fpm_allocator_t default_allocator = { default_alloc, default_realloc, default_free, NULL };
+    if(!allocator) allocator = &default_allocator;
+
+    fpm_context_t * ctx = mem_zalloc(allocator, sizeof(fpm_context_t));
+    if(ctx) ctx->allocator = *allocator;
+    return ctx;
+}
+
+void fpm_context_free(fpm_context_t * ctx)
+{
+    if(!ctx) return;
+    fpm_allocator_t allocator = ctx->allocator;
+    mem_free(&allocator, ctx->cameras);
+    mem_free(&allocator, ctx->patterns);
+    mem_free(&allocator, ctx);
+}
+
+int fpm_add_camera(fpm_context_t * ctx, const fpm_camera_t * camera)
+{
+    fpm_camera_t * cameras = mem_realloc(&ctx->allocator, ctx->cameras, sizeof(fpm_camera_t) * (ctx->camera_count + 1));
+    if(!cameras) return FPM_ERR_MEMORY;
+    ctx->cameras = cameras;
+    ctx->cameras[ctx->camera_count++] = *camera;
+    return 0;
+}
+
+int fpm_add_pattern(fpm_context_t * ctx, const fpm_pattern_t * pattern)
+{
+    fpm_pattern_t * patterns = mem_realloc(&ctx->allocator, ctx->patterns, sizeof(fpm_pattern_t) * (ctx->pattern_count + 1));
+    if(!patterns) return FPM_ERR_MEMORY;
+    ctx->patterns = patterns;
+    ctx->patterns[ctx->pattern_count++] = *pattern;
+    return 0;
+}
+
+const fpm_camera_t * fpm_find_camera_by_name(const fpm_context_t * ctx, const char * name)
+{
+    for(int i = 0; i < ctx->camera_count; i++)
+    {
+        if(!strcasecmp(ctx->cameras[i].name, name)) return &ctx->cameras[i];
+    }
+    for(int i = 0; i < sizeof(builtin_cameras) / sizeof(builtin_cameras[0]); i++)
+    {
+        if(!strcasecmp(builtin_cameras[i].name, name)) return &builtin_cameras[i];
+    }
+    return NULL;
+}
+
+const fpm_camera_t * fpm_find_camera_by_model(const fpm_context_t * ctx, uint32_t model)
+{
+    for(int i = 0; i < ctx->camera_count; i++)
+    {
+        if(ctx->cameras[i].model == model) return &ctx->cameras[i];
+    }
+    for(int i = 0; i < sizeof(builtin_cameras) / sizeof(builtin_cameras[0]); i++)
+    {
+        if(builtin_cameras[i].model == model) return &builtin_cameras[i];
+    }
+    return NULL;
+}
+
+static int pattern_matches(const fpm_pattern_t * pattern, int video_mode, uint32_t camera_model)
+{
+    if(pattern->video_mode != video_mode) return 0;
+    if(!pattern->camera_count) return 1;
+    for(int i = 0; i < pattern->camera_count; i++)
+    {
+        if(pattern->cameras[i] == camera_model) return 1;
+    }
+    return 0;
+}
+
+/* first pattern for video mode and camera, added before built-in */
+const fpm_pattern_t * fpm_find_pattern(const fpm_context_t * ctx, int video_mode, uint32_t camera_model)
+{
+    for(int i = 0; i < ctx->pattern_count; i++)
+    {
+        if(pattern_matches(&ctx->patterns[i], video_mode, camera_model)) return &ctx->patterns[i];
+    }
+    for(int i = 0; i < sizeof(builtin_patterns) / sizeof(builtin_patterns[0]); i++)
+    {
+        if(pattern_matches(&builtin_patterns[i], video_mode, camera_model)) return &builtin_patterns[i];
+    }
+    return NULL;
+}
+
+/* name of a video mode, the same for its unified mode */
+const char * fpm_video_mode_name(int video_mode)
+{
+    if(video_mode == FPM_MV_SENSOR) return "sensor";
+    if(video_mode < FPM_MV_720 || video_mode > FPM_MV_CROPREC_U) return "none";
+    return video_mode_names[(video_mode - FPM_MV_720) % FPM_UNIFIED];
+}
+
+/* read pattern file, see README.md for the format. On a syntax error '*line_No' is the line */
+int fpm_load_patterns(fpm_context_t * ctx, FILE * file, int * line_No)
+{
+    char line[1024];
+    fpm_pattern_t * pattern = NULL;
+    *line_No = 0;
+    while(fgets(line, sizeof(line), file))
+    {
+        (*line_No)++;
+        char * comment = strchr(line, '#');
+        if(comment) *comment = 0;
+
+        char * key = strtok(line, " \t\r\n");
+        if(!key) continue;
+
+        if(!strcasecmp(key, "camera"))
+        {
+            char * name = strtok(NULL, " \t\r\n");
+            char * model = strtok(NULL, " \t\r\n");
+            char * full_name = strtok(NULL, "\r\n");
+            fpm_camera_t camera;
+            if(!name || !model || strlen(name) >= sizeof(camera.name)) return FPM_ERR_FORMAT;
+
+            memset(&camera, 0, sizeof(fpm_camera_t));
+            strcpy(camera.name, name);
+            camera.model = strtoul(model, NULL, 16);
+            while(full_name && (*full_name == ' ' || *full_name == '\t')) full_name++;
+            if(!full_name || !*full_name) full_name = name;
+            memcpy(camera.full_name, full_name, MIN(strlen(full_name), sizeof(camera.full_name) - 1));
+            if(fpm_add_camera(ctx, &camera)) return FPM_ERR_MEMORY;
+        }
+        else if(!strcasecmp(key, "pattern"))
+        {
+            char * mode = strtok(NULL, " \t\r\n");
+            int video_mode = FPM_MV_NONE;
+            for(int i = 0; mode && i < sizeof(video_mode_names) / sizeof(video_mode_names[0]); i++)
+            {
+                if(!strcasecmp(mode, video_mode_names[i])) video_mode = FPM_MV_720 + i;
+            }
+            if(mode && !strcasecmp(mode, "sensor")) video_mode = FPM_MV_SENSOR;
+            if(!video_mode) return FPM_ERR_FORMAT;
+
+            fpm_pattern_t new_pattern;
+            memset(&new_pattern, 0, sizeof(fpm_pattern_t));
+            new_pattern.video_mode = video_mode;
+            if(fpm_add_pattern(ctx, &new_pattern)) return FPM_ERR_MEMORY;
+            pattern = &ctx->patterns[ctx->pattern_count - 1];
+
+            char * token;
+            while((token = strtok(NULL, " \t\r\n")))
+            {
+                const fpm_camera_t * camera = fpm_find_camera_by_name(ctx, token);
+                if(!strcasecmp(token, "unified") && video_mode == FPM_MV_SENSOR) return FPM_ERR_FORMAT;
+                else if(!strcasecmp(token, "unified")) pattern->video_mode = video_mode + FPM_UNIFIED;
+                else if(!camera || pattern->camera_count >= FPM_MAX_CAMERAS) return FPM_ERR_FORMAT;
+                else pattern->cameras[pattern->camera_count++] = camera->model;
+            }
+        }
+        else if(!strcasecmp(key, "pass"))
+        {
+            if(!pattern || pattern->pass_count >= FPM_MAX_PASSES) return FPM_ERR_FORMAT;
+            pattern->pass_count++;
+        }
+        else if(!strcasecmp(key, "sweep"))
+        {
+            if(!pattern || !pattern->pass_count) return FPM_ERR_FORMAT;
+            fpm_pass_t * pass = &pattern->passes[pattern->pass_count - 1];
+            if(pass->sweep_count >= FPM_MAX_SWEEPS) return FPM_ERR_FORMAT;
+
+            fpm_sweep_t * sweep = &pass->sweeps[pass->sweep_count++];
+            char * token[5];
+            for(int i = 0; i < 5; i++)
+            {
+                token[i] = strtok(NULL, " \t\r\n");
+                if(!token[i]) return FPM_ERR_FORMAT;
+            }
+            sweep->fp_start = atoi(token[0]);
+            sweep->fp_end = (!strcasecmp(token[1], "last")) ? FPM_LAST_ROW : atoi(token[1]);
+            sweep->x_start = atoi(token[2]);
+            sweep->x_rep = atoi(token[3]);
+            sweep->y_rep = atoi(token[4]);
+            if(sweep->fp_start < 0 || sweep->x_start < 0 || sweep->x_rep <= 0 || sweep->y_rep <= 0) return FPM_ERR_FORMAT;
+
+            char * phase;
+            while((phase = strtok(NULL, " \t\r\n")))
+            {
+                fpm_phase_t * p = &sweep->phases[sweep->phase_count];
+                if(sweep->phase_count >= FPM_MAX_PHASES || sscanf(phase, "%d:%d", &p->phase, &p->shift) != 2) return FPM_ERR_FORMAT;
+                sweep->phase_count++;
+            }
+            if(!sweep->phase_count) return FPM_ERR_FORMAT;
+        }
+        else
+        {
+            return FPM_ERR_FORMAT;
+        }
+    }
+
+    return (ferror(file)) ? FPM_ERR_READ : 0;
+}
+
+/* pixel map ********************************************************************************************************/
+
+static struct map_run * row_runs(struct map_row * row)
+{
+    return (row->run_capacity > 1) ? row->runs : &row->first;
+}
+
+static void row_free(const fpm_allocator_t * allocator, struct map_row * row)
+{
+    if(row->run_capacity > 1) mem_free(allocator, row->runs);
+    mem_free(allocator, row->bits);
+}
+
+fpm_map_t * fpm_map_new(fpm_context_t * ctx, const fpm_info_t * info)
+{
+    fpm_map_t * map = mem_zalloc(&ctx->allocator, sizeof(fpm_map_t));
+    if(!map) return NULL;
+    map->allocator = ctx->allocator;
+    if(info) map->info = *info;
+    return map;
+}
+
+void fpm_map_free(fpm_map_t * map)
+{
+    if(!map) return;
+    for(int i = 0; i < map->pass_count; i++)
+    {
+        for(uint32_t y = 0; y < map->passes[i].row_count; y++) row_free(&map->allocator, &map->passes[i].rows[y]);
+        mem_free(&map->allocator, map->passes[i].rows);
+    }
+    mem_free(&map->allocator, map->passes);
+    fpm_allocator_t allocator = map->allocator;
+    mem_free(&allocator, map);
+}
+
+const fpm_info_t * fpm_map_info(const fpm_map_t * map)
+{
+    return &map->info;
+}
+
+void fpm_map_set_info(fpm_map_t * map, const fpm_info_t * info)
+{
+    map->info = *info;
+}
+
+int fpm_map_pass_count(const fpm_map_t * map)
+{
+    return map->pass_count;
+}
+
+/* pixels of a pass, of all passes if 'pass' is -1 */
+uint32_t fpm_map_pixel_count(const fpm_map_t * map, int pass)
+{
+    if(pass < 0) return map->count;
+    return (pass < map->pass_count) ? map->passes[pass].count : 0;
+}
+
+uint32_t fpm_map_row_count(const fpm_map_t * map, int pass)
+{
+    return (pass >= 0 && pass < map->pass_count) ? map->passes[pass].row_count : 0;
+}
+
+/* row 'y' of a pass or NULL if it has no pixels */
+static const struct map_row * get_map_row(const fpm_map_t * map, int pass, uint32_t y)
+{
+    if(pass < 0 || pass >= map->pass_count) return NULL;
+    const struct map_pass * map_pass = &map->passes[pass];
+    if(y >= map_pass->row_count || !map_pass->rows[y].count) return NULL;
+    return &map_pass->rows[y];
+}
+
+static void row_iter_init(fpm_row_iter_t * iter, const struct map_row * row)
+{
+    memset(iter, 0, sizeof(fpm_row_iter_t));
+    iter->row = row;
+    if(row && row->bits) iter->bits = row->bits[0];
+}
+
+uint32_t fpm_row_iter_init(fpm_row_iter_t * iter, const fpm_map_t * map, int pass, uint32_t y)
+{
+    const struct map_row * row = get_map_row(map, pass, y);
+    row_iter_init(iter, row);
+    return (row) ? row->count : 0;
+}
+
+/* next pixel column of the row, returns 0 at its end */
+int fpm_row_iter_next(fpm_row_iter_t * iter, uint32_t * x)
+{
+    const struct map_row * row = iter->row;
+    if(!row) return 0;
+
+    if(row->bits)
+    {
+        while(!iter->bits)
+        {
+            if(++iter->word >= row->bit_words) return 0;
+            iter->bits = row->bits[iter->word];
+        }
+        *x = iter->word * 64 + __builtin_ctzll(iter->bits);
+        iter->bits &= iter->bits - 1;
+        return 1;
+    }
+
+    const struct map_run * runs = (row->run_capacity > 1) ? row->runs : &row->first;
+    if(iter->run >= row->run_count) return 0;
+    *x = runs[iter->run].x + iter->index * runs[iter->run].step;
+    if(++iter->index >= runs[iter->run].count)
+    {
+        iter->run++;
+        iter->index = 0;
+    }
+    return 1;
+}
+
+void fpm_map_iter_init(fpm_map_iter_t * iter, const fpm_map_t * map, int pass)
+{
+    memset(iter, 0, sizeof(fpm_map_iter_t));
+    iter->map = map;
+    iter->pass = (pass < 0) ? 0 : pass;
+    iter->pass_end = (pass < 0) ? map->pass_count : MIN(pass + 1, map->pass_count);
+    fpm_row_iter_init(&iter->row, map, iter->pass, 0);
+}
+
+/* next pixel of the passes in row order, 'iter->pass' is the pass it belongs to, returns 0 at the end */
+int fpm_map_iter_next(fpm_map_iter_t * iter, uint32_t * x, uint32_t * y)
+{
+    while(iter->pass < iter->pass_end)
+    {
+        if(fpm_row_iter_next(&iter->row, x))
+        {
+            *y = iter->y;
+            return 1;
+        }
+        if(++iter->y >= iter->map->passes[iter->pass].row_count)
+        {
+            iter->y = 0;
+            iter->pass++;
+        }
+        fpm_row_iter_init(&iter->row, iter->map, iter->pass, iter->y);
+    }
+    return 0;
+}
+
+/* start the next pass with 'rows' rows allocated */
+static int add_pass_to_map(fpm_map_t * map, uint32_t rows)
+{
+    struct map_pass * passes = mem_realloc(&map->allocator, map->passes, sizeof(struct map_pass) * (map->pass_count + 1));
+    if(!passes) return FPM_ERR_MEMORY;
+    map->passes = passes;
+
+    struct map_pass * pass = &map->passes[map->pass_count++];
+    memset(pass, 0, sizeof(struct map_pass));
+    if(rows > 0)
+    {
+        pass->rows = mem_zalloc(&map->allocator, sizeof(struct map_row) * rows);
+        if(!pass->rows) return FPM_ERR_MEMORY;
+        pass->row_count = rows;
+    }
+    return 0;
+}
+
+/* start the next pass, pixels are always added to the last one */
+int fpm_map_add_pass(fpm_map_t * map)
+{
+    return add_pass_to_map(map, map->info.height);
+}
+
+/* switch a row from runs to a bitset holding at least column 'x' */
+static int row_to_bits(const fpm_allocator_t * allocator, struct map_row * row, uint32_t x, uint32_t width)
+{
+    uint32_t words = ((x + 1 > width) ? x + 1 : width) / 64 + 1;
+    if(row->bits && words <= row->bit_words) return 1;
+
+    uint64_t * bits = mem_realloc(allocator, row->bits, sizeof(uint64_t) * words);
+    if(!bits) return 0;
+    memset(bits + row->bit_words, 0, sizeof(uint64_t) * (words - row->bit_words));
+    int was_bits = (row->bits != NULL);
+    row->bits = bits;
+    row->bit_words = words;
+    if(was_bits) return 1;
+
+    struct map_run * runs = row_runs(row);
+    for(uint32_t i = 0; i < row->run_count; i++)
+    {
+        for(uint32_t k = 0; k < runs[i].count; k++)
+        {
+            uint32_t rx = runs[i].x + k * runs[i].step;
+            bits[rx / 64] |= (uint64_t)1 << (rx % 64);
+        }
+    }
+    if(row->run_capacity > 1) mem_free(allocator, row->runs);
+    row->runs = NULL;
+    row->run_count = 0;
+    row->run_capacity = 0;
+    return 1;
+}
+
+/* add 'count' pixels from column 'x' on every 'step' columns to row 'y' of the last pass, pixels already in the map are not added again */
+int fpm_map_add_run(fpm_map_t * map, uint32_t x, uint32_t y, uint32_t step, uint32_t count)
+{
+    if(x > INT32_MAX || y > INT32_MAX || !count) return 0;
+    if(count > 1 && !step) step = 1;
+    if(!map->pass_count && fpm_map_add_pass(map)) return FPM_ERR_MEMORY;
+
+    const fpm_allocator_t * allocator = &map->allocator;
+    struct map_pass * pass = &map->passes[map->pass_count - 1];
+    if(y >= pass->row_count)
+    {
+        uint32_t rows = (pass->row_count) ? pass->row_count : 64;
+        while(rows <= y) rows *= 2;
+        struct map_row * new_rows = mem_realloc(allocator, pass->rows, sizeof(struct map_row) * rows);
+        if(!new_rows) return FPM_ERR_MEMORY;
+        memset(new_rows + pass->row_count, 0, sizeof(struct map_row) * (rows - pass->row_count));
+        pass->rows = new_rows;
+        pass->row_count = rows;
+    }
+
+    struct map_row * row = &pass->rows[y];
+    uint32_t added = 0;
+    if(!row->bits)
+    {
+        struct map_run * runs = row_runs(row);
+        struct map_run * last = (row->run_count) ? &runs[row->run_count - 1] : NULL;
+        uint32_t last_x = (last) ? last->x + (last->count - 1) * last->step : 0;
+
+        if(!last || x > last_x)
+        {
+            if(last && count == 1 && last->count == 1)
+            {
+                last->step = x - last->x;
+                last->count = 2;
+            }
+            else if(last && count == 1 && x == last_x + last->step)
+            {
+                last->count++;
+            }
+            else
+            {
+                if(row->run_count && row->run_count == row->run_capacity)
+                {
+                    uint32_t capacity = (row->run_capacity > 1) ? row->run_capacity * 2 : 4;
+                    struct map_run * new_runs = mem_realloc(allocator, (row->run_capacity > 1) ? row->runs : NULL, sizeof(struct map_run) * capacity);
+                    if(!new_runs) return FPM_ERR_MEMORY;
+                    if(row->run_capacity <= 1) new_runs[0] = row->first;
+                    row->runs = new_runs;
+                    row->run_capacity = capacity;
+                }
+                if(!row->run_capacity) row->run_capacity = 1;
+                runs = row_runs(row);
+                runs[row->run_count].x = x;
+                runs[row->run_count].step = (count > 1) ? step : 0;
+                runs[row->run_count].count = count;
+                row->run_count++;
+            }
+            added = count;
+        }
+        else if(!row_to_bits(allocator, row, x + (count - 1) * step, map->info.width))
+        {
+            return FPM_ERR_MEMORY;
+        }
+    }
+
+    if(row->bits)
+    {
+        if(!row_to_bits(allocator, row, x + (count - 1) * step, map->info.width)) return FPM_ERR_MEMORY;
+        for(uint32_t k = 0; k < count; k++)
+        {
+            uint32_t bx = x + k * step;
+            uint64_t bit = (uint64_t)1 << (bx % 64);
+            if(!(row->bits[bx / 64] & bit))
+            {
+                row->bits[bx / 64] |= bit;
+                added++;
+            }
+        }
+    }
+
+    row->count += added;
+    pass->count += added;
+    map->count += added;
+    return 0;
+}
+
+int fpm_map_add_pixel(fpm_map_t * map, uint32_t x, uint32_t y)
+{
+    return fpm_map_add_run(map, x, y, 0, 1);
+}
+
+int fpm_map_append(fpm_map_t * map, fpm_map_t * other)
+{
+    struct map_pass * passes = mem_realloc(&map->allocator, map->passes, sizeof(struct map_pass) * (map->pass_count + other->pass_count));
+    if(!passes) return FPM_ERR_MEMORY;
+    map->passes = passes;
+
+    memcpy(map->passes + map->pass_count, other->passes, sizeof(struct map_pass) * other->pass_count);
+    map->pass_count += other->pass_count;
+    map->count += other->count;
+    other->pass_count = 0;
+    fpm_map_free(other);
+    return 0;
+}
+
+/* focus pixel generator **********************************************************************************************/
+
+/* rows of one sweep period holding focus pixels: 'shift' per row residue y % y_rep, the first phase wins,
+   returns the residues with pixels in ascending order */
+static int sweep_residues(const fpm_sweep_t * sweep, int * residues, int * shifts)
+{
+    int count = 0;
+    for(int i = 0; i < sweep->phase_count; i++)
+    {
+        int residue = ((-sweep->phases[i].phase) % sweep->y_rep + sweep->y_rep) % sweep->y_rep;
+        int j = count;
+        while(j > 0 && residues[j - 1] > residue) j--;
+        if(j > 0 && residues[j - 1] == residue) continue;
+
+        memmove(&residues[j + 1], &residues[j], sizeof(int) * (count - j));
+        memmove(&shifts[j + 1], &shifts[j], sizeof(int) * (count - j));
+        residues[j] = residue;
+        shifts[j] = sweep->phases[i].shift;
+        count++;
+    }
+    return count;
+}
+
+/* first column >= x_start with (x + shift) % x_rep == 0 */
+static int sweep_first_column(const fpm_sweep_t * sweep, int shift)
+{
+    int rest = (sweep->x_start + shift) % sweep->x_rep;
+    if(rest < 0) rest += sweep->x_rep;
+    return sweep->x_start + (rest ? sweep->x_rep - rest : 0);
+}
+
+static int sweep_last_row(const fpm_sweep_t * sweep, int height)
+{
+    return (sweep->fp_end == FPM_LAST_ROW) ? height - 1 : sweep->fp_end;
+}
+
+/* number of pixels a sweep emits, closed form */
+static int64_t sweep_count(const fpm_sweep_t * sweep, int width, int height)
+{
+    int residues[FPM_MAX_PHASES], shifts[FPM_MAX_PHASES];
+    int count = sweep_residues(sweep, residues, shifts);
+    int fp_end = sweep_last_row(sweep, height);
+    int64_t pixels = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        int first_row = sweep->fp_start + ((residues[i] - sweep->fp_start % sweep->y_rep) % sweep->y_rep + sweep->y_rep) % sweep->y_rep;
+        int first_column = sweep_first_column(sweep, shifts[i]);
+        if(first_row > fp_end || first_column >= width) continue;
+
+        int64_t rows = (fp_end - first_row) / sweep->y_rep + 1;
+        int64_t columns = (width - 1 - first_column) / sweep->x_rep + 1;
+        pixels += rows * columns;
+    }
+    return pixels;
+}
+
+/* emit the pixels of a sweep as one stride run per row, stepping directly from row to row */
+static int sweep_emit(fpm_map_t * map, const fpm_sweep_t * sweep, int width, int height)
+{
+    int residues[FPM_MAX_PHASES], shifts[FPM_MAX_PHASES];
+    int count = sweep_residues(sweep, residues, shifts);
+    int fp_end = sweep_last_row(sweep, height);
+
+    for(int base = sweep->fp_start - sweep->fp_start % sweep->y_rep; base <= fp_end; base += sweep->y_rep)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            int y = base + residues[i];
+            if(y < sweep->fp_start) continue;
+            if(y > fp_end) break;
+
+            int first_column = sweep_first_column(sweep, shifts[i]);
+            if(first_column >= width) continue;
+            int ret = fpm_map_add_run(map, first_column, y, sweep->x_rep, (width - 1 - first_column) / sweep->x_rep + 1);
+            if(ret) return ret;
+        }
+    }
+    return 0;
+}
+
+/* draw all passes of a pattern into a new map, the closed form pixel count bounds the map before anything is allocated */
+int fpm_generate_pattern(fpm_context_t * ctx, fpm_map_t ** map, const fpm_pattern_t * pattern, const fpm_info_t * info)
+{
+    int width = info->width;
+    int height = info->height;
+    int64_t count = 0;
+    *map = NULL;
+
+    if(info->width > INT32_MAX || info->height > INT32_MAX) return FPM_ERR_TOO_LARGE;
+    for(int i = 0; i < pattern->pass_count; i++)
+    {
+        for(int j = 0; j < pattern->passes[i].sweep_count; j++)
+        {
+            count += sweep_count(&pattern->passes[i].sweeps[j], width, height);
+        }
+    }
+    if(count > INT32_MAX) return FPM_ERR_TOO_LARGE;
+
+    /* rows of each pass are allocated once for the whole frame */
+    fpm_map_t * new_map = fpm_map_new(ctx, info);
+    if(!new_map) return FPM_ERR_MEMORY;
+    for(int i = 0; i < pattern->pass_count; i++)
+    {
+        int ret = fpm_map_add_pass(new_map);
+        for(int j = 0; !ret && j < pattern->passes[i].sweep_count; j++)
+        {
+            ret = sweep_emit(new_map, &pattern->passes[i].sweeps[j], width, height);
+        }
+        if(ret)
+        {
+            fpm_map_free(new_map);
+            return ret;
+        }
+    }
+
+    *map = new_map;
+    return 0;
+}
+
+/* map of the built-in or added pattern for camera and video mode */
+int fpm_generate(fpm_context_t * ctx, fpm_map_t ** map, uint32_t camera_model, int video_mode, uint32_t width, uint32_t height, uint32_t crop, int unified)
+{
+    if(unified && video_mode >= FPM_MV_720 && video_mode <= FPM_MV_CROPREC) video_mode += FPM_UNIFIED;
+
+    const fpm_pattern_t * pattern = fpm_find_pattern(ctx, video_mode, camera_model);
+    if(!pattern)
+    {
+        *map = NULL;
+        return FPM_ERR_NO_PATTERN;
+    }
+
+    fpm_info_t info = { camera_model, width, height, crop };
+    return fpm_generate_pattern(ctx, map, pattern, &info);
+}
+
+/* sensor projection **************************************************************************************************/
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static int64_t ceil_div(int64_t a, int64_t b)
+{
+    return -floor_div(-a, b);
+}
+
+static int64_t positive_mod(int64_t a, int64_t m)
+{
+    int64_t rest = a % m;
+    return (rest < 0) ? rest + m : rest;
+}
+
+static int64_t gcd(int64_t a, int64_t b)
+{
+    while(b)
+    {
+        int64_t rest = a % b;
+        a = b;
+        b = rest;
+    }
+    return a;
+}
+
+/* inverse of 'a' modulo 'm', both coprime */
+static int64_t mod_inverse(int64_t a, int64_t m)
+{
+    int64_t r0 = m, r1 = positive_mod(a, m), t0 = 0, t1 = 1;
+    while(r1)
+    {
+        int64_t q = r0 / r1;
+        int64_t r = r0 - q * r1, t = t0 - q * t1;
+        r0 = r1;
+        r1 = r;
+        t0 = t1;
+        t1 = t;
+    }
+    return positive_mod(t0, m);
+}
+
+static int geometry_valid(const fpm_geometry_t * g)
+{
+    return g->sampling_x % 2 && g->sampling_y % 2 && g->binning_x >= 1 && g->binning_y >= 1 && g->binning_x <= g->sampling_x && g->binning_y <= g->sampling_y &&
+           g->sampling_x <= INT16_MAX && g->sampling_y <= INT16_MAX;
+}
+
+/*
+  Frame columns whose sensor column offset_x + sampling_x * x + 2 * i is a focus column solve the congruence
+  sampling_x * x = -(offset_x + 2 * i + shift) modulo x_rep, which is one stride run per row or none at all.
+*/
+static int sweep_project(fpm_map_t * map, const fpm_sweep_t * sweep, const fpm_geometry_t * g, int width, int height)
+{
+    int residues[FPM_MAX_PHASES], shifts[FPM_MAX_PHASES];
+    int count = sweep_residues(sweep, residues, shifts);
+    int64_t sampling_x = g->sampling_x, sampling_y = g->sampling_y;
+    int64_t divisor = gcd(sampling_x, sweep->x_rep);
+    int64_t step = sweep->x_rep / divisor;
+    int64_t inverse = mod_inverse(sampling_x / divisor, step);
+
+    /* frame rows with a sensor row in the sweep */
+    int64_t first_y = ceil_div(sweep->fp_start - g->offset_y - 2 * ((int64_t)g->binning_y - 1), sampling_y);
+    int64_t last_y = height - 1;
+    if(sweep->fp_end != FPM_LAST_ROW && floor_div(sweep->fp_end - g->offset_y, sampling_y) < last_y) last_y = floor_div(sweep->fp_end - g->offset_y, sampling_y);
+
+    for(int64_t y = (first_y > 0) ? first_y : 0; y <= last_y; y++)
+    {
+        for(int64_t j = 0; j < g->binning_y; j++)
+        {
+            int64_t row = g->offset_y + sampling_y * y + 2 * j;
+            if(row < sweep->fp_start || (sweep->fp_end != FPM_LAST_ROW && row > sweep->fp_end)) continue;
+
+            int64_t residue = positive_mod(row, sweep->y_rep);
+            int phase = 0;
+            while(phase < count && residues[phase] != residue) phase++;
+            if(phase == count) continue;
+
+            for(int64_t i = 0; i < g->binning_x; i++)
+            {
+                int64_t column = g->offset_x + 2 * i;
+                int64_t rest = positive_mod(-(column + shifts[phase]), sweep->x_rep);
+                if(rest % divisor) continue;
+
+                int64_t x0 = positive_mod(rest / divisor * inverse, step);
+                int64_t min_x = ceil_div(sweep->x_start - column, sampling_x);
+                if(min_x < 0) min_x = 0;
+                int64_t first = min_x + positive_mod(x0 - min_x, step);
+                if(first >= width) continue;
+
+                int ret = fpm_map_add_run(map, first, y, step, (width - 1 - first) / step + 1);
+                if(ret) return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/* project all passes of a sensor pattern into a new map, a pass never holds more than the frame */
+int fpm_project_pattern(fpm_context_t * ctx, fpm_map_t ** map, const fpm_pattern_t * pattern, const fpm_geometry_t * geometry, const fpm_info_t * info)
+{
+    *map = NULL;
+    if(!geometry_valid(geometry)) return FPM_ERR_FORMAT;
+    if((int64_t)info->width * info->height * (pattern->pass_count ? pattern->pass_count : 1) > INT32_MAX) return FPM_ERR_TOO_LARGE;
+
+    fpm_map_t * new_map = fpm_map_new(ctx, info);
+    if(!new_map) return FPM_ERR_MEMORY;
+    for(int i = 0; i < pattern->pass_count; i++)
+    {
+        int ret = fpm_map_add_pass(new_map);
+        for(int j = 0; !ret && j < pattern->passes[i].sweep_count; j++)
+        {
+            ret = sweep_project(new_map, &pattern->passes[i].sweeps[j], geometry, info->width, info->height);
+        }
+        if(ret)
+        {
+            fpm_map_free(new_map);
+            return ret;
+        }
+    }
+
+    *map = new_map;
+    return 0;
+}
+
+/* move the sweeps by the offsets, rows above the sensor are cut and sweeps left without rows dropped */
+int fpm_lift_pattern(const fpm_pattern_t * pattern, const fpm_geometry_t * geometry, fpm_pattern_t * sensor)
+{
+    if(geometry->sampling_x != 1 || geometry->sampling_y != 1 || geometry->binning_x != 1 || geometry->binning_y != 1) return FPM_ERR_FORMAT;
+
+    *sensor = *pattern;
+    sensor->video_mode = FPM_MV_SENSOR;
+    for(int i = 0; i < sensor->pass_count; i++)
+    {
+        fpm_pass_t * pass = &sensor->passes[i];
+        int kept = 0;
+        for(int j = 0; j < pass->sweep_count; j++)
+        {
+            fpm_sweep_t sweep = pass->sweeps[j];
+            if(sweep.fp_end != FPM_LAST_ROW)
+            {
+                sweep.fp_end += geometry->offset_y;
+                if(sweep.fp_end < 0) continue;
+            }
+            sweep.fp_start += geometry->offset_y;
+            sweep.x_start += geometry->offset_x;
+            if(sweep.fp_start < 0) sweep.fp_start = 0;
+            if(sweep.x_start < 0) sweep.x_start = 0;
+            for(int k = 0; k < sweep.phase_count; k++)
+            {
+                sweep.phases[k].phase = positive_mod((int64_t)sweep.phases[k].phase - geometry->offset_y, sweep.y_rep);
+                sweep.phases[k].shift = positive_mod((int64_t)sweep.phases[k].shift - geometry->offset_x, sweep.x_rep);
+            }
+            pass->sweeps[kept++] = sweep;
+        }
+        pass->sweep_count = kept;
+    }
+    return 0;
+}
+
+/* text .fpm ************************************************************************************************************/
+
+static int is_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* unsigned decimal at 'pos', returns position behind it or NULL if there is none */
+static const uint8_t * parse_uint(const uint8_t * pos, const uint8_t * end, uint32_t * value)
+{
+    uint32_t result = 0;
+    const uint8_t * start = pos;
+    while(pos < end && *pos >= '0' && *pos <= '9') result = result * 10 + (*pos++ - '0');
+    if(pos == start) return NULL;
+    *value = result;
+    return pos;
+}
+
+/* 'x y' lines parsed in place, a new pass starts where y goes back. Lines that are no 'x y' pair are skipped,
+   the '#FPM' header line if there is one sets the map info */
+int fpm_read_text(fpm_map_t * map, const uint8_t * data, size_t size, int * header_found)
+{
+    const uint8_t * pos = data;
+    const uint8_t * end = data + size;
+
+    *header_found = 0;
+    if(size >= 4 && !memcmp(pos, "#FPM", 4))
+    {
+        char line[256] = { 0 };
+        const uint8_t * eol = memchr(pos, '\n', size);
+        if(!eol) eol = end;
+        memcpy(line, pos, MIN((size_t)(eol - pos), sizeof(line) - 1));
+
+        fpm_info_t info;
+        if(sscanf(line, "#FPM%*[ ]%X%*[ ]%u%*[ ]%u%*[ ]%u", &info.camera_model, &info.width, &info.height, &info.crop) == 4)
+        {
+            map->info = info;
+            *header_found = 1;
+        }
+        pos = eol;
+    }
+
+    int ret = fpm_map_add_pass(map);
+    if(ret) return ret;
+
+    uint32_t x, y, prev_y = 0;
+    while(pos < end)
+    {
+        while(pos < end && is_space(*pos)) pos++;
+        if(pos == end) break;
+
+        /* 'x', at least one space or tab, 'y', anything up to the end of line */
+        const uint8_t * next = parse_uint(pos, end, &x);
+        if(next && next < end && (*next == ' ' || *next == '\t'))
+        {
+            while(next < end && is_space(*next)) next++;
+            next = parse_uint(next, end, &y);
+        }
+        else
+        {
+            next = NULL;
+        }
+        while(pos < end && *pos != '\n') pos++;
+        if(!next) continue;
+
+        if(y < prev_y) // detect next pass start
+        {
+            if((ret = fpm_map_add_pass(map))) return ret;
+        }
+        prev_y = y;
+
+        if((ret = fpm_map_add_pixel(map, x, y))) return ret;
+    }
+    return 0;
+}
+
+/* decimal digits of 'value' written backwards from 'end', returns the first one */
+static char * format_uint(char * end, uint32_t value)
+{
+    do
+    {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    return end;
+}
+
+/* 'x \t y' lines formatted into a large buffer instead of one fprintf() per pixel */
+int fpm_write_text(const fpm_map_t * map, FILE * file, const char * comment)
+{
+    const fpm_info_t * info = &map->info;
+    if(comment && fprintf(file, "#FPM %X %u %u %u %u -- %s\n", info->camera_model, info->width, info->height, info->crop, map->pass_count, comment) < 0) return FPM_ERR_WRITE;
+
+    /* a line is at most two 10 digit numbers, " \t " and newline */
+    size_t buf_size = 64 * 1024, len = 0;
+    char * buf = mem_alloc(&map->allocator, buf_size);
+    if(!buf) return FPM_ERR_MEMORY;
+
+    for (int pass = 0; pass < map->pass_count; ++pass)
+    {
+        for (uint32_t y = 0; y < map->passes[pass].row_count; ++y)
+        {
+            const struct map_row * row = get_map_row(map, pass, y);
+            if(!row) continue;
+
+            /* y part of the line is the same for the whole row */
+            char y_buf[16];
+            char * y_str = format_uint(y_buf + sizeof(y_buf) - 1, y);
+            y_buf[sizeof(y_buf) - 1] = '\n';
+            size_t y_len = y_buf + sizeof(y_buf) - y_str;
+
+            fpm_row_iter_t iter;
+            uint32_t x;
+            row_iter_init(&iter, row);
+            while(fpm_row_iter_next(&iter, &x))
+            {
+                if(len + 32 > buf_size)
+                {
+                    if(fwrite(buf, len, 1, file) != 1) goto write_error;
+                    len = 0;
+                }
+                char x_buf[16];
+                char * x_str = format_uint(x_buf + sizeof(x_buf), x);
+                size_t x_len = x_buf + sizeof(x_buf) - x_str;
+                memcpy(buf + len, x_str, x_len);
+                memcpy(buf + len + x_len, " \t ", 3);
+                memcpy(buf + len + x_len + 3, y_str, y_len);
+                len += x_len + 3 + y_len;
+            }
+        }
+    }
+    if(len && fwrite(buf, len, 1, file) != 1) goto write_error;
+    mem_free(&map->allocator, buf);
+    return 0;
+
+write_error:
+
+    mem_free(&map->allocator, buf);
+    return FPM_ERR_WRITE;
+}
+
+/* binary .fpm v2 *******************************************************************************************************/
+
+/*
+  Binary FPM v2, little endian and naturally aligned so it can be used memory mapped. The header is followed
+  by 'passCount' pass entries. Each pass has a row index of rowCount + 1 u32 offsets into its row data,
+  row y is the byte range [index[y], index[y + 1]). A row holds its pixel columns in ascending order as
+  LEB128 varints, the first one absolute and every other one as distance to the one before.
+*/
+#define FPM2_MAGIC      "FPM2"
+#define FPM2_VERSION    2
+
+typedef struct
+{
+    uint8_t     magic[4];           /* "FPM2" */
+    uint32_t    headerSize;
+    uint32_t    version;
+    uint32_t    cameraModel;
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    crop;
+    uint32_t    passCount;
+    uint64_t    pixelCount;
+    uint64_t    passTableOffset;
+} __attribute__((packed)) fpm2_hdr_t;
+
+typedef struct
+{
+    uint32_t    pixelCount;
+    uint32_t    rowCount;
+    uint64_t    rowIndexOffset;
+    uint64_t    rowDataOffset;
+    uint64_t    rowDataSize;
+} __attribute__((packed)) fpm2_pass_t;
+
+static int file_set_pos(FILE * stream, int64_t offset, int whence)
+{
+#if defined(__WIN32)
+    return fseeko64(stream, offset, whence);
+#else
+    return fseeko(stream, offset, whence);
+#endif
+}
+
+static size_t varint_put(uint8_t * buf, uint32_t value)
+{
+    size_t len = 0;
+    while(value >= 0x80)
+    {
+        buf[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[len++] = value;
+    return len;
+}
+
+/* returns bytes used or 0 if the value runs past 'end' */
+static size_t varint_get(const uint8_t * buf, const uint8_t * end, uint32_t * value)
+{
+    uint32_t result = 0;
+    for(size_t len = 0; buf + len < end && len < 5; len++)
+    {
+        result |= (uint32_t)(buf[len] & 0x7F) << (7 * len);
+        if(!(buf[len] & 0x80))
+        {
+            *value = result;
+            return len + 1;
+        }
+    }
+    return 0;
+}
+
+/* data starts with the binary FPM v2 magic */
+int fpm_is_binary(const uint8_t * data, size_t size)
+{
+    return (size >= 4 && !memcmp(data, FPM2_MAGIC, 4));
+}
+
+int fpm_read_binary(fpm_map_t * map, const uint8_t * data, size_t size)
+{
+    fpm2_hdr_t header;
+    if(size < sizeof(fpm2_hdr_t)) return FPM_ERR_FORMAT;
+    memcpy(&header, data, sizeof(fpm2_hdr_t));
+    if(memcmp(header.magic, FPM2_MAGIC, 4) || header.version != FPM2_VERSION || header.headerSize < sizeof(fpm2_hdr_t)) return FPM_ERR_FORMAT;
+    if(header.passTableOffset > size || (uint64_t)header.passCount * sizeof(fpm2_pass_t) > size - header.passTableOffset) return FPM_ERR_FORMAT;
+
+    map->info.camera_model = header.cameraModel;
+    map->info.width = header.width;
+    map->info.height = header.height;
+    map->info.crop = header.crop;
+
+    for(uint32_t pass = 0; pass < header.passCount; pass++)
+    {
+        fpm2_pass_t entry;
+        memcpy(&entry, data + header.passTableOffset + pass * sizeof(fpm2_pass_t), sizeof(fpm2_pass_t));
+        if(entry.rowIndexOffset > size || ((uint64_t)entry.rowCount + 1) * sizeof(uint32_t) > size - entry.rowIndexOffset) return FPM_ERR_FORMAT;
+        if(entry.rowDataOffset > size || entry.rowDataSize > size - entry.rowDataOffset) return FPM_ERR_FORMAT;
+        int ret = fpm_map_add_pass(map);
+        if(ret) return ret;
+
+        const uint8_t * row_data = data + entry.rowDataOffset;
+        for(uint32_t y = 0; y < entry.rowCount; y++)
+        {
+            uint32_t start, end;
+            memcpy(&start, data + entry.rowIndexOffset + y * sizeof(uint32_t), sizeof(uint32_t));
+            memcpy(&end, data + entry.rowIndexOffset + (y + 1) * sizeof(uint32_t), sizeof(uint32_t));
+            if(start > end || end > entry.rowDataSize) return FPM_ERR_FORMAT;
+
+            const uint8_t * pos = row_data + start;
+            uint32_t x = 0;
+            for(int first = 1; pos < row_data + end; first = 0)
+            {
+                uint32_t value;
+                size_t len = varint_get(pos, row_data + end, &value);
+                if(!len) return FPM_ERR_FORMAT;
+                pos += len;
+                x = (first) ? value : x + value;
+                if((ret = fpm_map_add_pixel(map, x, y))) return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/* passes are written one after another, each as row index and row data, header and pass table last */
+int fpm_write_binary(const fpm_map_t * map, FILE * file)
+{
+    const fpm_allocator_t * allocator = &map->allocator;
+    fpm2_hdr_t header;
+    fpm2_pass_t * passes = mem_zalloc(allocator, sizeof(fpm2_pass_t) * (map->pass_count ? map->pass_count : 1));
+    uint32_t * row_index = NULL;
+    uint8_t * row_data = NULL;
+    size_t row_data_cap = 0;
+    int ret = FPM_ERR_WRITE;
+    if(!passes) return FPM_ERR_MEMORY;
+
+    memset(&header, 0, sizeof(fpm2_hdr_t));
+    memcpy(header.magic, FPM2_MAGIC, 4);
+    header.headerSize = sizeof(fpm2_hdr_t);
+    header.version = FPM2_VERSION;
+    header.cameraModel = map->info.camera_model;
+    header.width = map->info.width;
+    header.height = map->info.height;
+    header.crop = map->info.crop;
+    header.passCount = map->pass_count;
+    header.pixelCount = map->count;
+    header.passTableOffset = sizeof(fpm2_hdr_t);
+
+    uint64_t offset = header.passTableOffset + (uint64_t)map->pass_count * sizeof(fpm2_pass_t);
+    if(file_set_pos(file, offset, SEEK_SET)) goto bailout;
+
+    for(int pass = 0; pass < map->pass_count; pass++)
+    {
+        /* last row with pixels, empty rows behind it are left out */
+        uint32_t rows = map->passes[pass].row_count;
+        while(rows && !map->passes[pass].rows[rows - 1].count) rows--;
+
+        mem_free(allocator, row_index);
+        row_index = mem_alloc(allocator, sizeof(uint32_t) * (rows + 1));
+        if(!row_index) goto malloc_error;
+
+        size_t len = 0;
+        for(uint32_t y = 0; y < rows; y++)
+        {
+            const struct map_row * row = get_map_row(map, pass, y);
+            size_t need = len + (size_t)((row) ? row->count : 0) * 5;
+            if(need > row_data_cap)
+            {
+                size_t cap = (row_data_cap) ? row_data_cap : 4096;
+                while(cap < need) cap *= 2;
+                uint8_t * new_data = mem_realloc(allocator, row_data, cap);
+                if(!new_data) goto malloc_error;
+                row_data = new_data;
+                row_data_cap = cap;
+            }
+
+            row_index[y] = len;
+            fpm_row_iter_t iter;
+            uint32_t x, prev_x = 0;
+            row_iter_init(&iter, row);
+            for(int first = 1; fpm_row_iter_next(&iter, &x); first = 0)
+            {
+                len += varint_put(row_data + len, (first) ? x : x - prev_x);
+                prev_x = x;
+            }
+        }
+        row_index[rows] = len;
+        if(len > UINT32_MAX)
+        {
+            ret = FPM_ERR_TOO_LARGE;
+            goto bailout;
+        }
+
+        passes[pass].pixelCount = map->passes[pass].count;
+        passes[pass].rowCount = rows;
+        passes[pass].rowIndexOffset = offset;
+        passes[pass].rowDataOffset = offset + sizeof(uint32_t) * (rows + 1);
+        passes[pass].rowDataSize = len;
+
+        /* next row index stays 4 byte aligned */
+        static const uint8_t padding[4] = { 0 };
+        size_t pad = (4 - len % 4) % 4;
+        if(fwrite(row_index, sizeof(uint32_t), rows + 1, file) != rows + 1) goto bailout;
+        if(len && fwrite(row_data, len, 1, file) != 1) goto bailout;
+        if(pad && fwrite(padding, pad, 1, file) != 1) goto bailout;
+        offset = passes[pass].rowDataOffset + len + pad;
+    }
+
+    if(file_set_pos(file, 0, SEEK_SET)) goto bailout;
+    if(fwrite(&header, sizeof(fpm2_hdr_t), 1, file) != 1) goto bailout;
+    if(map->pass_count && fwrite(passes, sizeof(fpm2_pass_t), map->pass_count, file) != map->pass_count) goto bailout;
+    ret = 0;
+    goto bailout;
+
+malloc_error:
+
+    ret = FPM_ERR_MEMORY;
+
+bailout:
+
+    mem_free(allocator, passes);
+    mem_free(allocator, row_index);
+    mem_free(allocator, row_data);
+    return ret;
+}
+
+/* PBM ******************************************************************************************************************/
+
+/* PBM rows hold pixel x at bit 7 - x % 8 of byte x / 8, map bitsets at bit x % 64 of word x / 64.
+   A word of 8 PBM bytes loaded little endian only needs the bits of each byte reversed */
+static uint64_t pbm_word_swap(uint64_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    word = (word >> 1 & 0x5555555555555555ULL) | (word & 0x5555555555555555ULL) << 1;
+    word = (word >> 2 & 0x3333333333333333ULL) | (word & 0x3333333333333333ULL) << 2;
+    word = (word >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (word & 0x0F0F0F0F0F0F0F0FULL) << 4;
+    return word;
+}
+
+/* P4 image data decoded word-wise into a new pass, rows with pixels get their bitset straight from the image */
+int fpm_read_pbm_raster(fpm_map_t * map, const uint8_t * data, size_t size, uint32_t width, uint32_t height)
+{
+    size_t pbm_row_bytes = width / 8 + (!!(width % 8));
+    if(height && pbm_row_bytes > size / height) return FPM_ERR_FORMAT;
+
+    /* bitset size as row_to_bits() would allocate it for this width */
+    uint32_t words = width / 64 + 1;
+    uint32_t row_words = (pbm_row_bytes + 7) / 8;
+
+    map->info.width = width;
+    map->info.height = height;
+    int ret = add_pass_to_map(map, height);
+    if(ret) return ret;
+    struct map_pass * pass = &map->passes[map->pass_count - 1];
+
+    /* pixels behind the width in the last byte are padding */
+    uint64_t last_mask = (width % 64) ? ((uint64_t)1 << width % 64) - 1 : ~(uint64_t)0;
+    for(uint32_t y = 0; y < height; ++y)
+    {
+        const uint8_t * src = data + y * pbm_row_bytes;
+        struct map_row * row = &pass->rows[y];
+        uint32_t count = 0;
+
+        for(uint32_t w = 0; w < row_words; ++w)
+        {
+            uint64_t word = 0;
+            memcpy(&word, src + w * 8, MIN(8, pbm_row_bytes - w * 8));
+            if(!word) continue;
+
+            word = pbm_word_swap(word);
+            if(w == row_words - 1) word &= last_mask;
+            if(!word) continue;
+
+            if(!row->bits)
+            {
+                row->bits = mem_zalloc(&map->allocator, sizeof(uint64_t) * words);
+                if(!row->bits) return FPM_ERR_MEMORY;
+                row->bit_words = words;
+            }
+            row->bits[w] = word;
+            count += __builtin_popcountll(word);
+        }
+
+        row->count = count;
+        pass->count += count;
+        map->count += count;
+    }
+    return 0;
+}
+
+/* next header token of a P4 file, '#' comments are skipped, the first one is returned in 'comment' */
+static const uint8_t * pbm_token(const uint8_t * pos, const uint8_t * end, const uint8_t ** comment)
+{
+    while(pos < end)
+    {
+        if(*pos == '#')
+        {
+            if(!*comment) *comment = pos;
+            while(pos < end && *pos != '\n') pos++;
+        }
+        else if(is_space(*pos)) pos++;
+        else break;
+    }
+    return pos;
+}
+
+/* P4 file, a '# <camera model> <crop>' comment as written by fpm_write_pbm() sets camera and crop */
+int fpm_read_pbm(fpm_map_t * map, const uint8_t * data, size_t size, int * info_found)
+{
+    const uint8_t * end = data + size;
+    const uint8_t * comment = NULL;
+    uint32_t width, height;
+
+    if(size < 2 || memcmp(data, "P4", 2)) return FPM_ERR_FORMAT;
+    const uint8_t * pos = pbm_token(data + 2, end, &comment);
+    if(!(pos = parse_uint(pos, end, &width))) return FPM_ERR_FORMAT;
+    pos = pbm_token(pos, end, &comment);
+    if(!(pos = parse_uint(pos, end, &height))) return FPM_ERR_FORMAT;
+    if(pos == end || !is_space(*pos)) return FPM_ERR_FORMAT;
+    pos++;
+
+    *info_found = 0;
+    if(comment)
+    {
+        char line[64] = { 0 };
+        const uint8_t * eol = memchr(comment, '\n', end - comment);
+        memcpy(line, comment, MIN((size_t)((eol) ? eol - comment : end - comment), sizeof(line) - 1));
+
+        uint32_t camera_model, crop;
+        if(sscanf(line, "#%*[ ]%X%*[ ]%u", &camera_model, &crop) == 2 && (camera_model & 0xFFFF0000) == 0x80000000)
+        {
+            map->info.camera_model = camera_model;
+            map->info.crop = crop;
+            *info_found = 1;
+        }
+    }
+    return fpm_read_pbm_raster(map, pos, end - pos, width, height);
+}
+
+/* P4 file of one pass or all passes merged if 'pass' is -1, rows are put together word-wise and swapped to PBM bit order */
+int fpm_write_pbm(const fpm_map_t * map, FILE * file, int pass, const char * comment)
+{
+    const fpm_info_t * info = &map->info;
+    int ret = (comment) ? fprintf(file, "P4\n# %X %u -- %s\n%u %u\n", info->camera_model, info->crop, comment, info->width, info->height)
+                        : fprintf(file, "P4\n%u %u\n", info->width, info->height);
+    if(ret < 0) return FPM_ERR_WRITE;
+
+    size_t pbm_row_bytes = info->width / 8 + (!!(info->width % 8));
+    size_t pbm_image_buf_size = pbm_row_bytes * info->height;
+    uint32_t row_words = (pbm_row_bytes + 7) / 8;
+    uint8_t * pbm_image_buf = mem_alloc(&map->allocator, pbm_image_buf_size + 1);
+    uint64_t * row_buf = mem_alloc(&map->allocator, sizeof(uint64_t) * (row_words + 1));
+    if(!pbm_image_buf || !row_buf)
+    {
+        mem_free(&map->allocator, pbm_image_buf);
+        mem_free(&map->allocator, row_buf);
+        return FPM_ERR_MEMORY;
+    }
+
+    int pass_start = (pass < 0) ? 0 : pass;
+    int pass_end = (pass < 0) ? map->pass_count : MIN(pass + 1, map->pass_count);
+    for (uint32_t y = 0; y < info->height; ++y)
+    {
+        memset(row_buf, 0, sizeof(uint64_t) * row_words);
+        for (int p = pass_start; p < pass_end; ++p)
+        {
+            const struct map_row * row = get_map_row(map, p, y);
+            if(!row) continue;
+
+            if(row->bits)
+            {
+                for(uint32_t w = 0; w < row->bit_words && w < row_words; ++w) row_buf[w] |= row->bits[w];
+                continue;
+            }
+
+            fpm_row_iter_t iter;
+            uint32_t x;
+            row_iter_init(&iter, row);
+            while(fpm_row_iter_next(&iter, &x) && x < row_words * 64)
+            {
+                row_buf[x / 64] |= (uint64_t)1 << (x % 64);
+            }
+        }
+
+        /* pixels behind the width, even padding bits of the last byte, are not set */
+        if(info->width % 64) row_buf[row_words - 1] &= ((uint64_t)1 << info->width % 64) - 1;
+
+        /* rows are not word aligned, the last word only has the bytes left in the row */
+        uint8_t * dst = pbm_image_buf + y * pbm_row_bytes;
+        for(uint32_t w = 0; w < row_words; ++w)
+        {
+            uint64_t word = pbm_word_swap(row_buf[w]);
+            memcpy(dst + w * 8, &word, MIN(8, pbm_row_bytes - w * 8));
+        }
+    }
+
+    ret = (pbm_image_buf_size && fwrite(pbm_image_buf, pbm_image_buf_size, 1, file) != 1) ? FPM_ERR_WRITE : 0;
+    mem_free(&map->allocator, pbm_image_buf);
+    mem_free(&map->allocator, row_buf);
+    return ret;
+}
+
+/* focus pixel fixing ***************************************************************************************************/
+
+/* frames are unpacked and packed by the raw kernels of libmlv */
+struct fpm_fixer
+{
+    fpm_allocator_t allocator;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits_per_pixel;
+    uint32_t black_level;
+    uint32_t white_level;
+    uint32_t count;
+    uint32_t * row_index;       /* columns of row y are columns[row_index[y]] .. columns[row_index[y + 1] - 1] */
+    uint32_t * columns;         /* ascending, passes merged */
+};
+
+/* rows of the frame kept unpacked while fixing, y - 2 .. y + 2 must fit */
+#define FIX_ROW_CACHE   8
+
+static int compare_columns(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* all passes of the map merged into one sorted column list per row, pixels outside the frame dropped */
+int fpm_fixer_new(fpm_context_t * ctx, fpm_fixer_t ** fixer, const fpm_map_t * map, uint32_t bits_per_pixel, uint32_t black_level, uint32_t white_level)
+{
+    const fpm_info_t * info = &map->info;
+    *fixer = NULL;
+    if(bits_per_pixel < 8 || bits_per_pixel > 16 || !info->width || !info->height) return FPM_ERR_FORMAT;
+
+    fpm_fixer_t * new_fixer = mem_zalloc(&ctx->allocator, sizeof(fpm_fixer_t));
+    if(!new_fixer) return FPM_ERR_MEMORY;
+    new_fixer->allocator = ctx->allocator;
+    new_fixer->width = info->width;
+    new_fixer->height = info->height;
+    new_fixer->bits_per_pixel = bits_per_pixel;
+    new_fixer->black_level = black_level;
+    new_fixer->white_level = (white_level && white_level < (1u << bits_per_pixel)) ? white_level : (1u << bits_per_pixel) - 1;
+    new_fixer->row_index = mem_zalloc(&ctx->allocator, sizeof(uint32_t) * (info->height + 1));
+    new_fixer->columns = mem_alloc(&ctx->allocator, sizeof(uint32_t) * (map->count ? map->count : 1));
+    if(!new_fixer->row_index || !new_fixer->columns)
+    {
+        fpm_fixer_free(new_fixer);
+        return FPM_ERR_MEMORY;
+    }
+
+    uint32_t count = 0;
+    for(uint32_t y = 0; y < info->height; y++)
+    {
+        uint32_t start = count;
+        for(int pass = 0; pass < map->pass_count; pass++)
+        {
+            fpm_row_iter_t iter;
+            uint32_t x;
+            row_iter_init(&iter, get_map_row(map, pass, y));
+            while(fpm_row_iter_next(&iter, &x) && x < info->width) new_fixer->columns[count++] = x;
+        }
+
+        /* passes may overlap */
+        if(map->pass_count > 1 && count - start > 1)
+        {
+            qsort(new_fixer->columns + start, count - start, sizeof(uint32_t), compare_columns);
+            uint32_t unique = start + 1;
+            for(uint32_t i = start + 1; i < count; i++)
+            {
+                if(new_fixer->columns[i] != new_fixer->columns[unique - 1]) new_fixer->columns[unique++] = new_fixer->columns[i];
+            }
+            count = unique;
+        }
+        new_fixer->row_index[y + 1] = count;
+    }
+    new_fixer->count = count;
+
+    *fixer = new_fixer;
+    return 0;
+}
+
+void fpm_fixer_free(fpm_fixer_t * fixer)
+{
+    if(!fixer) return;
+    fpm_allocator_t allocator = fixer->allocator;
+    mem_free(&allocator, fixer->row_index);
+    mem_free(&allocator, fixer->columns);
+    mem_free(&allocator, fixer);
+}
+
+/* pixels fixed in every frame */
+uint32_t fpm_fixer_pixel_count(const fpm_fixer_t * fixer)
+{
+    return fixer->count;
+}
+
+/* bytes of a packed frame, whole 16 bit words */
+size_t fpm_fixer_frame_size(const fpm_fixer_t * fixer)
+{
+    return mlv_raw_frame_size(fixer->width, fixer->height, fixer->bits_per_pixel);
+}
+
+static int is_fixed(const fpm_fixer_t * fixer, uint32_t y, uint32_t x)
+{
+    const uint32_t * first = fixer->columns + fixer->row_index[y];
+    const uint32_t * last = fixer->columns + fixer->row_index[y + 1];
+    while(first < last)
+    {
+        const uint32_t * middle = first + (last - first) / 2;
+        if(*middle < x) first = middle + 1;
+        else last = middle;
+    }
+    return (first < fixer->columns + fixer->row_index[y + 1] && *first == x);
+}
+
+/* row 'y' from the cache, unpacked on first use */
+static const uint16_t * fix_row(const fpm_fixer_t * fixer, const uint8_t * frame, uint16_t * cache, int32_t * cached, uint32_t y)
+{
+    uint16_t * row = cache + (size_t)(y % FIX_ROW_CACHE) * fixer->width;
+    if(cached[y % FIX_ROW_CACHE] != (int32_t)y)
+    {
+        mlv_raw_unpack(frame, (uint64_t)y * fixer->width, fixer->width, fixer->bits_per_pixel, row);
+        cached[y % FIX_ROW_CACHE] = y;
+    }
+    return row;
+}
+
+/* interpolate every mapped pixel from its same color neighbours two pixels away that are not mapped themselves.
+   With all four direct ones available the direction with the smaller gradient is used, diagonals only if there is
+   no direct one. Results stay within black and white level */
+int fpm_fix_frame(const fpm_fixer_t * fixer, uint8_t * frame, size_t size)
+{
+    if(size < fpm_fixer_frame_size(fixer)) return FPM_ERR_FORMAT;
+
+    uint16_t * cache = mem_alloc(&fixer->allocator, sizeof(uint16_t) * fixer->width * FIX_ROW_CACHE);
+    if(!cache) return FPM_ERR_MEMORY;
+    int32_t cached[FIX_ROW_CACHE];
+    for(int i = 0; i < FIX_ROW_CACHE; i++) cached[i] = -1;
+
+    uint32_t width = fixer->width, height = fixer->height;
+    for(uint32_t y = 0; y < height; y++)
+    {
+        uint32_t first = fixer->row_index[y], last = fixer->row_index[y + 1];
+        if(first == last) continue;
+
+        /* all three rows are unpacked before anything in row 'y' is written back */
+        const uint16_t * up = (y >= 2) ? fix_row(fixer, frame, cache, cached, y - 2) : NULL;
+        const uint16_t * row = fix_row(fixer, frame, cache, cached, y);
+        const uint16_t * down = (y + 2 < height) ? fix_row(fixer, frame, cache, cached, y + 2) : NULL;
+
+        for(uint32_t i = first; i < last; i++)
+        {
+            uint32_t x = fixer->columns[i];
+            int has_left = (x >= 2 && !(i > first && fixer->columns[i - 1] == x - 2) && !(i > first + 1 && fixer->columns[i - 2] == x - 2));
+            int has_right = (x + 2 < width && !(i + 1 < last && fixer->columns[i + 1] == x + 2) && !(i + 2 < last && fixer->columns[i + 2] == x + 2));
+            int has_up = (up && !is_fixed(fixer, y - 2, x));
+            int has_down = (down && !is_fixed(fixer, y + 2, x));
+
+            uint32_t sum = 0, n = 0;
+            if(has_left && has_right && has_up && has_down)
+            {
+                uint32_t dh = abs(row[x - 2] - row[x + 2]);
+                uint32_t dv = abs(up[x] - down[x]);
+                sum = (dh < dv) ? row[x - 2] + row[x + 2] : up[x] + down[x];
+                n = 2;
+            }
+            else
+            {
+                if(has_left) { sum += row[x - 2]; n++; }
+                if(has_right) { sum += row[x + 2]; n++; }
+                if(has_up) { sum += up[x]; n++; }
+                if(has_down) { sum += down[x]; n++; }
+            }
+
+            if(!n)
+            {
+                for(int dy = -2; dy <= 2; dy += 4)
+                {
+                    const uint16_t * diagonal = (dy < 0) ? up : down;
+                    if(!diagonal) continue;
+                    if(x >= 2 && !is_fixed(fixer, y + dy, x - 2)) { sum += diagonal[x - 2]; n++; }
+                    if(x + 2 < width && !is_fixed(fixer, y + dy, x + 2)) { sum += diagonal[x + 2]; n++; }
+                }
+            }
+            if(!n) continue;
+
+            uint32_t value = (sum + n / 2) / n;
+            if(value < fixer->black_level) value = fixer->black_level;
+            if(value > fixer->white_level) value = fixer->white_level;
+            uint16_t pixel = value;
+            mlv_raw_pack(frame, (uint64_t)y * width + x, 1, fixer->bits_per_pixel, &pixel);
+        }
+    }
+
+    mem_free(&fixer->allocator, cache);
+    return 0;
+}
+
+/* focus pixel detection ************************************************************************************************/
+
+/*
+  A pixel stands out in a frame if it is further from the middle of its four same color neighbours than they
+  are spread plus a noise floor. Noise and texture make any pixel stand out now and then, focus pixels do in
+  most frames. Only the hit count per pixel is kept, so memory does not grow with the footage.
+*/
+struct fpm_detector
+{
+    fpm_context_t * ctx;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits_per_pixel;
+    uint32_t floor;
+    uint32_t frames;            /* updated atomically like the hits */
+    uint32_t * hits;            /* frames every pixel stood out in */
+};
+
+int fpm_detector_new(fpm_context_t * ctx, fpm_detector_t ** detector, uint32_t width, uint32_t height, uint32_t bits_per_pixel)
+{
+    *detector = NULL;
+    if(bits_per_pixel < 10 || bits_per_pixel > 16 || width < 5 || height < 5) return FPM_ERR_FORMAT;
+    if((uint64_t)width * height > INT32_MAX) return FPM_ERR_TOO_LARGE;
+
+    fpm_detector_t * new_detector = mem_zalloc(&ctx->allocator, sizeof(fpm_detector_t));
+    if(!new_detector) return FPM_ERR_MEMORY;
+    new_detector->ctx = ctx;
+    new_detector->width = width;
+    new_detector->height = height;
+    new_detector->bits_per_pixel = bits_per_pixel;
+    new_detector->floor = 1 << (bits_per_pixel - 10);
+    new_detector->hits = mem_zalloc(&ctx->allocator, sizeof(uint32_t) * width * height);
+    if(!new_detector->hits)
+    {
+        fpm_detector_free(new_detector);
+        return FPM_ERR_MEMORY;
+    }
+
+    *detector = new_detector;
+    return 0;
+}
+
+void fpm_detector_free(fpm_detector_t * detector)
+{
+    if(!detector) return;
+    fpm_allocator_t allocator = detector->ctx->allocator;
+    mem_free(&allocator, detector->hits);
+    mem_free(&allocator, detector);
+}
+
+uint32_t fpm_detector_frame_count(const fpm_detector_t * detector)
+{
+    return __atomic_load_n(&detector->frames, __ATOMIC_RELAXED);
+}
+
+#define SORT2(a, b) if(a > b) { uint32_t t = a; a = b; b = t; }
+
+/* rows y - 2 .. y + 2 unpacked in a ring of 5, pixels closer than 2 to the border are not checked */
+int fpm_detect_frame(fpm_detector_t * detector, const uint8_t * frame, size_t size)
+{
+    uint32_t width = detector->width, height = detector->height;
+    if(size < mlv_raw_frame_size(width, height, detector->bits_per_pixel)) return FPM_ERR_FORMAT;
+
+    uint16_t * rows = mem_alloc(&detector->ctx->allocator, sizeof(uint16_t) * width * 5);
+    if(!rows) return FPM_ERR_MEMORY;
+    for(uint32_t y = 0; y < 4; y++) mlv_raw_unpack(frame, (uint64_t)y * width, width, detector->bits_per_pixel, rows + (size_t)y * width);
+
+    for(uint32_t y = 2; y + 2 < height; y++)
+    {
+        mlv_raw_unpack(frame, (uint64_t)(y + 2) * width, width, detector->bits_per_pixel, rows + (size_t)((y + 2) % 5) * width);
+        const uint16_t * up = rows + (size_t)((y - 2) % 5) * width;
+        const uint16_t * row = rows + (size_t)(y % 5) * width;
+        const uint16_t * down = rows + (size_t)((y + 2) % 5) * width;
+        uint32_t * hits = detector->hits + (size_t)y * width;
+
+        for(uint32_t x = 2; x + 2 < width; x++)
+        {
+            uint32_t a = row[x - 2], b = row[x + 2], c = up[x], d = down[x];
+            SORT2(a, b);
+            SORT2(c, d);
+            SORT2(a, c);
+            SORT2(b, d);
+            SORT2(b, c);
+            uint32_t middle = (b + c + 1) / 2;
+            uint32_t deviation = (row[x] > middle) ? row[x] - middle : middle - row[x];
+            if(deviation > d - a + detector->floor) __atomic_fetch_add(&hits[x], 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    mem_free(&detector->ctx->allocator, rows);
+    __atomic_fetch_add(&detector->frames, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* one pass map of the pixels standing out in at least 'fraction' of the frames, frame size of 'info' is ignored */
+int fpm_detector_map(const fpm_detector_t * detector, fpm_map_t ** map, double fraction, const fpm_info_t * info)
+{
+    fpm_info_t map_info = { 0 };
+    if(info) map_info = *info;
+    map_info.width = detector->width;
+    map_info.height = detector->height;
+    *map = NULL;
+
+    uint32_t frames = fpm_detector_frame_count(detector);
+    uint32_t min_hits = (uint32_t)(fraction * frames + 0.999999);
+    if(min_hits < 1) min_hits = 1;
+
+    fpm_map_t * new_map = fpm_map_new(detector->ctx, &map_info);
+    if(!new_map) return FPM_ERR_MEMORY;
+    int ret = fpm_map_add_pass(new_map);
+    for(uint32_t y = 0; !ret && y < detector->height; y++)
+    {
+        const uint32_t * hits = detector->hits + (size_t)y * detector->width;
+        for(uint32_t x = 0; !ret && x < detector->width; x++)
+        {
+            if(frames && __atomic_load_n(&hits[x], __ATOMIC_RELAXED) >= min_hits) ret = fpm_map_add_pixel(new_map, x, y);
+        }
+    }
+    if(ret)
+    {
+        fpm_map_free(new_map);
+        return ret;
+    }
+
+    *map = new_map;
+    return 0;
+}
+
+/* longest column and row period looked for */
+#define INFER_MAX_PERIOD    64
+
+static inline int bit_test(const uint8_t * bits, size_t i)
+{
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+/* smallest lag whose matches come close to the best one, 0 if nothing repeats */
+static int infer_period(const uint64_t * matches, int max_lag)
+{
+    uint64_t best = 0;
+    for(int lag = 1; lag <= max_lag; lag++) if(matches[lag] > best) best = matches[lag];
+    for(int lag = 1; best && lag <= max_lag; lag++) if(matches[lag] * 5 >= best * 4) return lag;
+    return 0;
+}
+
+/*
+  Periodic pattern of the pixels of a map, e.g. a detected one. Rows with at least a quarter of the pixels of
+  the fullest row are pattern rows, the rest is noise. Column and row periods are the shortest shifts mapping
+  the pixels onto each other, then every row residue with pixels in most of its rows becomes a phase, with the
+  most common column residue as shift. Rows with several column residues get further sweeps. Cameras and
+  video mode of 'pattern' are left to the caller.
+*/
+int fpm_infer_pattern(const fpm_map_t * map, fpm_pattern_t * pattern)
+{
+    uint32_t width = map->info.width, height = map->info.height;
+    int ret = FPM_ERR_NO_PATTERN;
+    memset(pattern, 0, sizeof(fpm_pattern_t));
+    if(!width || !height || !map->count) return ret;
+
+    uint8_t * bits = mem_zalloc(&map->allocator, ((size_t)width * height + 7) / 8);
+    uint32_t * row_count = mem_zalloc(&map->allocator, sizeof(uint32_t) * height);
+    if(!bits || !row_count)
+    {
+        ret = FPM_ERR_MEMORY;
+        goto bailout;
+    }
+
+    fpm_map_iter_t iter;
+    uint32_t x, y, max_count = 0;
+    fpm_map_iter_init(&iter, map, -1);
+    while(fpm_map_iter_next(&iter, &x, &y))
+    {
+        if(x >= width || y >= height || bit_test(bits, (size_t)y * width + x)) continue;
+        bits[((size_t)y * width + x) / 8] |= 1 << (((size_t)y * width + x) % 8);
+        if(++row_count[y] > max_count) max_count = row_count[y];
+    }
+
+    /* pattern rows */
+    uint32_t min_count = (max_count > 8) ? max_count / 4 : 2;
+    int fp_start = -1, fp_end = -1;
+    for(y = 0; y < height; y++)
+    {
+        if(row_count[y] < min_count) continue;
+        if(fp_start < 0) fp_start = y;
+        fp_end = y;
+    }
+    if(fp_start < 0) goto bailout;
+
+    /* pixels matched by a shift along the row and across rows */
+    uint64_t x_matches[INFER_MAX_PERIOD + 1] = { 0 }, y_matches[INFER_MAX_PERIOD + 1] = { 0 };
+    for(y = fp_start; y <= (uint32_t)fp_end; y++)
+    {
+        if(row_count[y] < min_count) continue;
+        for(x = 0; x < width; x++)
+        {
+            if(!bit_test(bits, (size_t)y * width + x)) continue;
+            for(int lag = 1; lag <= INFER_MAX_PERIOD; lag++)
+            {
+                if(x + lag < width && bit_test(bits, (size_t)y * width + x + lag)) x_matches[lag]++;
+                if(y + lag <= (uint32_t)fp_end && bit_test(bits, (size_t)(y + lag) * width + x)) y_matches[lag]++;
+            }
+        }
+    }
+    int x_rep = infer_period(x_matches, INFER_MAX_PERIOD);
+    int y_rep = infer_period(y_matches, MIN(INFER_MAX_PERIOD, (fp_end - fp_start) / 2));
+    if(!x_rep || !y_rep) goto bailout;
+
+    /* column residues of the pixels of each row residue */
+    uint32_t * classes = mem_zalloc(&map->allocator, sizeof(uint32_t) * y_rep * x_rep);
+    if(!classes)
+    {
+        ret = FPM_ERR_MEMORY;
+        goto bailout;
+    }
+
+    int rows_present[INFER_MAX_PERIOD] = { 0 }, rows_total[INFER_MAX_PERIOD] = { 0 };
+    for(y = fp_start; y <= (uint32_t)fp_end; y++)
+    {
+        int residue = y % y_rep;
+        rows_total[residue]++;
+        if(row_count[y] < min_count) continue;
+        rows_present[residue]++;
+        for(x = 0; x < width; x++)
+        {
+            if(!bit_test(bits, (size_t)y * width + x)) continue;
+            classes[residue * x_rep + x % x_rep]++;
+        }
+    }
+
+    pattern->pass_count = 1;
+    fpm_pass_t * pass = &pattern->passes[0];
+    for(int residue = 0; residue < y_rep; residue++)
+    {
+        if(rows_present[residue] * 2 <= rows_total[residue]) continue;
+
+        /* column residues with at least half the pixels of the most common one, most common first */
+        uint32_t * counts = classes + residue * x_rep;
+        uint32_t most = 0;
+        for(int c = 0; c < x_rep; c++) if(counts[c] > most) most = counts[c];
+        for(int sweep_No = 0; most && sweep_No < FPM_MAX_SWEEPS; sweep_No++)
+        {
+            int best = -1;
+            for(int c = 0; c < x_rep; c++)
+            {
+                if(counts[c] * 2 >= most && (best < 0 || counts[c] > counts[best])) best = c;
+            }
+            if(best < 0) break;
+
+            if(sweep_No == pass->sweep_count)
+            {
+                fpm_sweep_t * sweep = &pass->sweeps[pass->sweep_count++];
+                sweep->fp_start = fp_start;
+                sweep->fp_end = fp_end;
+                sweep->x_start = width;
+                sweep->x_rep = x_rep;
+                sweep->y_rep = y_rep;
+            }
+            fpm_sweep_t * sweep = &pass->sweeps[sweep_No];
+            if(sweep->phase_count >= FPM_MAX_PHASES) break;
+            sweep->phases[sweep->phase_count].phase = (y_rep - residue) % y_rep;
+            sweep->phases[sweep->phase_count].shift = (x_rep - best) % x_rep;
+            sweep->phase_count++;
+            /* first column set in most pattern rows of the residue, stray pixels left of it do not count */
+            for(x = best; x < (uint32_t)sweep->x_start; x += x_rep)
+            {
+                int rows = 0;
+                for(y = fp_start + (residue - fp_start % y_rep + y_rep) % y_rep; y <= (uint32_t)fp_end; y += y_rep)
+                {
+                    if(row_count[y] >= min_count && bit_test(bits, (size_t)y * width + x)) rows++;
+                }
+                if(rows * 2 > rows_present[residue])
+                {
+                    sweep->x_start = x;
+                    break;
+                }
+            }
+            counts[best] = 0;
+        }
+    }
+    mem_free(&map->allocator, classes);
+    ret = (pass->sweep_count) ? 0 : FPM_ERR_NO_PATTERN;
+
+bailout:
+
+    if(ret) memset(pattern, 0, sizeof(fpm_pattern_t));
+    mem_free(&map->allocator, bits);
+    mem_free(&map->allocator, row_count);
+    return ret;
+}
+
+/* master dark **********************************************************************************************************/
+
+/*
+  The mean and deviation of every pixel over lens cap frames. Threads sum the values and squares of their frames
+  in an accumulator of their own, 32 bits wide so that SSE2 adds 4 pixels at once, and add them to the 64 bit
+  totals of the dark before the squares can overflow. Totals are added atomically, accumulators flush at
+  different times and once more when freed.
+*/
+struct fpm_dark
+{
+    fpm_context_t * ctx;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits_per_pixel;
+    uint32_t frames;            /* flushed frames, updated atomically like the totals */
+    uint64_t * sum;
+    uint64_t * square_sum;
+};
+
+struct fpm_dark_acc
+{
+    fpm_dark_t * dark;
+    uint32_t flush_interval;    /* frames of full scale squares 32 bits hold */
+    uint32_t frames;            /* not flushed yet */
+    uint32_t * sum;
+    uint32_t * square_sum;
+    uint16_t * row;
+};
+
+int fpm_dark_new(fpm_context_t * ctx, fpm_dark_t ** dark, uint32_t width, uint32_t height, uint32_t bits_per_pixel)
+{
+    *dark = NULL;
+    if(bits_per_pixel < 10 || bits_per_pixel > 16 || !width || !height) return FPM_ERR_FORMAT;
+    if((uint64_t)width * height > INT32_MAX) return FPM_ERR_TOO_LARGE;
+
+    fpm_dark_t * new_dark = mem_zalloc(&ctx->allocator, sizeof(fpm_dark_t));
+    if(!new_dark) return FPM_ERR_MEMORY;
+    new_dark->ctx = ctx;
+    new_dark->width = width;
+    new_dark->height = height;
+    new_dark->bits_per_pixel = bits_per_pixel;
+    new_dark->sum = mem_zalloc(&ctx->allocator, sizeof(uint64_t) * width * height);
+    new_dark->square_sum = mem_zalloc(&ctx->allocator, sizeof(uint64_t) * width * height);
+    if(!new_dark->sum || !new_dark->square_sum)
+    {
+        fpm_dark_free(new_dark);
+        return FPM_ERR_MEMORY;
+    }
+
+    *dark = new_dark;
+    return 0;
+}
+
+void fpm_dark_free(fpm_dark_t * dark)
+{
+    if(!dark) return;
+    fpm_allocator_t allocator = dark->ctx->allocator;
+    mem_free(&allocator, dark->sum);
+    mem_free(&allocator, dark->square_sum);
+    mem_free(&allocator, dark);
+}
+
+uint32_t fpm_dark_frame_count(const fpm_dark_t * dark)
+{
+    return __atomic_load_n(&dark->frames, __ATOMIC_RELAXED);
+}
+
+int fpm_dark_acc_new(fpm_dark_t * dark, fpm_dark_acc_t ** acc)
+{
+    const fpm_allocator_t * allocator = &dark->ctx->allocator;
+    size_t pixel_count = (size_t)dark->width * dark->height;
+    uint64_t max_square = ((1ull << dark->bits_per_pixel) - 1) * ((1ull << dark->bits_per_pixel) - 1);
+    *acc = NULL;
+
+    fpm_dark_acc_t * new_acc = mem_zalloc(allocator, sizeof(fpm_dark_acc_t));
+    if(!new_acc) return FPM_ERR_MEMORY;
+    new_acc->dark = dark;
+    new_acc->flush_interval = (uint32_t)(UINT32_MAX / max_square);
+    new_acc->sum = mem_zalloc(allocator, sizeof(uint32_t) * pixel_count);
+    new_acc->square_sum = mem_zalloc(allocator, sizeof(uint32_t) * pixel_count);
+    new_acc->row = mem_alloc(allocator, sizeof(uint16_t) * dark->width);
+    if(!new_acc->sum || !new_acc->square_sum || !new_acc->row)
+    {
+        fpm_dark_acc_free(new_acc);
+        return FPM_ERR_MEMORY;
+    }
+
+    *acc = new_acc;
+    return 0;
+}
+
+static void dark_flush(fpm_dark_acc_t * acc)
+{
+    fpm_dark_t * dark = acc->dark;
+    size_t pixel_count = (size_t)dark->width * dark->height;
+    if(!acc->frames) return;
+
+    for(size_t i = 0; i < pixel_count; i++)
+    {
+        __atomic_fetch_add(&dark->sum[i], acc->sum[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dark->square_sum[i], acc->square_sum[i], __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&dark->frames, acc->frames, __ATOMIC_RELAXED);
+    memset(acc->sum, 0, sizeof(uint32_t) * pixel_count);
+    memset(acc->square_sum, 0, sizeof(uint32_t) * pixel_count);
+    acc->frames = 0;
+}
+
+void fpm_dark_acc_free(fpm_dark_acc_t * acc)
+{
+    if(!acc) return;
+    fpm_allocator_t allocator = acc->dark->ctx->allocator;
+    if(acc->sum && acc->square_sum) dark_flush(acc);
+    mem_free(&allocator, acc->sum);
+    mem_free(&allocator, acc->square_sum);
+    mem_free(&allocator, acc->row);
+    mem_free(&allocator, acc);
+}
+
+/* sums and squares widened from 16 to 32 bits, squares from the low and high halves of 16 bit products */
+static void dark_accumulate(uint32_t * sum, uint32_t * square_sum, const uint16_t * row, uint32_t count)
+{
+    uint32_t x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(; x + 8 <= count; x += 8)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i low = _mm_mullo_epi16(value, value);
+        __m128i high = _mm_mulhi_epu16(value, value);
+        __m128i * s = (__m128i *)(sum + x);
+        __m128i * q = (__m128i *)(square_sum + x);
+        _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(value, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(value, zero)));
+        _mm_storeu_si128(q, _mm_add_epi32(_mm_loadu_si128(q), _mm_unpacklo_epi16(low, high)));
+        _mm_storeu_si128(q + 1, _mm_add_epi32(_mm_loadu_si128(q + 1), _mm_unpackhi_epi16(low, high)));
+    }
+#endif
+    for(; x < count; x++)
+    {
+        sum[x] += row[x];
+        square_sum[x] += (uint32_t)row[x] * row[x];
+    }
+}
+
+int fpm_dark_add_frame(fpm_dark_acc_t * acc, const uint8_t * frame, size_t size)
+{
+    const fpm_dark_t * dark = acc->dark;
+    if(size < mlv_raw_frame_size(dark->width, dark->height, dark->bits_per_pixel)) return FPM_ERR_FORMAT;
+
+    for(uint32_t y = 0; y < dark->height; y++)
+    {
+        size_t offset = (size_t)y * dark->width;
+        mlv_raw_unpack(frame, offset, dark->width, dark->bits_per_pixel, acc->row);
+        dark_accumulate(acc->sum + offset, acc->square_sum + offset, acc->row, dark->width);
+    }
+    if(++acc->frames == acc->flush_interval) dark_flush(acc);
+    return 0;
+}
+
+/* per pixel of the flushed frames, either array may be NULL */
+int fpm_dark_master(const fpm_dark_t * dark, float * mean, float * deviation)
+{
+    uint32_t frames = fpm_dark_frame_count(dark);
+    if(!frames) return FPM_ERR_FORMAT;
+
+    for(size_t i = 0; i < (size_t)dark->width * dark->height; i++)
+    {
+        double m = (double)__atomic_load_n(&dark->sum[i], __ATOMIC_RELAXED) / frames;
+        double variance = (double)__atomic_load_n(&dark->square_sum[i], __ATOMIC_RELAXED) / frames - m * m;
+        if(mean) mean[i] = (float)m;
+        if(deviation) deviation[i] = (variance > 0) ? (float)sqrt(variance) : 0.0f;
+    }
+    return 0;
+}
+
+/* noise and stuck pixels need this many frames to be told apart */
+#define DARK_MIN_NOISE_FRAMES   16
+
+/* median of values binned 'scale' bins per unit, the last bin takes everything above */
+static double dark_median(const float * values, size_t count, double center, double scale, uint32_t * histogram, uint32_t bins)
+{
+    memset(histogram, 0, sizeof(uint32_t) * bins);
+    for(size_t i = 0; i < count; i++)
+    {
+        double bin = fabs(values[i] - center) * scale + 0.5;
+        histogram[(bin < bins - 1) ? (uint32_t)bin : bins - 1]++;
+    }
+    size_t seen = 0;
+    uint32_t bin = 0;
+    while(bin < bins - 1 && (seen += histogram[bin]) * 2 < count) bin++;
+    return bin / scale;
+}
+
+/*
+  One pass map of pixels whose mean is more than 'sigma' typical deviations off the median level (hot or dead), and
+  with enough frames also of pixels more than 'sigma' / 2 times as noisy as typical or not noisy at all (stuck).
+  The typical deviation is the median one, or the spread of the means if there are too few frames.
+*/
+int fpm_dark_map(const fpm_dark_t * dark, fpm_map_t ** map, double sigma, const fpm_info_t * info)
+{
+    size_t pixel_count = (size_t)dark->width * dark->height;
+    uint32_t frames = fpm_dark_frame_count(dark);
+    uint32_t bins = 1u << dark->bits_per_pixel;
+    const fpm_allocator_t * allocator = &dark->ctx->allocator;
+    fpm_map_t * new_map = NULL;
+    int ret = FPM_ERR_MEMORY;
+    *map = NULL;
+
+    float * mean = mem_alloc(allocator, sizeof(float) * pixel_count);
+    float * deviation = mem_alloc(allocator, sizeof(float) * pixel_count);
+    uint32_t * histogram = mem_alloc(allocator, sizeof(uint32_t) * bins);
+    if(!mean || !deviation || !histogram) goto bailout;
+    ret = fpm_dark_master(dark, mean, deviation);
+    if(ret) goto bailout;
+
+    int noise_checked = (frames >= DARK_MIN_NOISE_FRAMES);
+    double level = dark_median(mean, pixel_count, 0, 1, histogram, bins);
+    double noise = (noise_checked) ? dark_median(deviation, pixel_count, 0, 16, histogram, bins) : dark_median(mean, pixel_count, level, 16, histogram, bins) * 1.4826;
+    double limit = sigma * ((noise > 0.5) ? noise : 0.5);
+
+    fpm_info_t map_info = { 0 };
+    if(info) map_info = *info;
+    map_info.width = dark->width;
+    map_info.height = dark->height;
+    new_map = fpm_map_new(dark->ctx, &map_info);
+    ret = (new_map) ? fpm_map_add_pass(new_map) : FPM_ERR_MEMORY;
+    for(size_t i = 0; !ret && i < pixel_count; i++)
+    {
+        int defect = fabs(mean[i] - level) > limit;
+        if(noise_checked) defect |= (deviation[i] > limit / 2) || (deviation[i] == 0 && noise > 0.5);
+        if(defect) ret = fpm_map_add_pixel(new_map, i % dark->width, i / dark->width);
+    }
+
+bailout:
+
+    if(ret) fpm_map_free(new_map);
+    else *map = new_map;
+    mem_free(allocator, mean);
+    mem_free(allocator, deviation);
+    mem_free(allocator, histogram);
+    return ret;
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2017-2018 bouncyball
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _fpm_h_
+#define _fpm_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+  Focus pixel map library used by fpmutil. It has no global state: pattern tables loaded at run time
+  live in a context, maps are handles allocated through the allocator of the context they were made
+  with. A context may be shared by threads once its patterns are loaded, a map belongs to one thread.
+  Functions returning int return 0 on success and a negative fpm_error otherwise.
+*/
+
+enum fpm_video_mode { FPM_MV_NONE, FPM_MV_720,   FPM_MV_1080,   FPM_MV_1080CROP,   FPM_MV_ZOOM,   FPM_MV_CROPREC,
+                                   FPM_MV_720_U, FPM_MV_1080_U, FPM_MV_1080CROP_U, FPM_MV_ZOOM_U, FPM_MV_CROPREC_U,
+                                   FPM_MV_SENSOR };
+
+/* unified (lossless) mode of a video mode is 'video_mode + FPM_UNIFIED', the sensor mode has none */
+#define FPM_UNIFIED     (FPM_MV_720_U - FPM_MV_720)
+#define FPM_IS_UNIFIED(video_mode)  ((video_mode) >= FPM_MV_720_U && (video_mode) <= FPM_MV_CROPREC_U)
+
+enum fpm_error { FPM_ERR_MEMORY = -1, FPM_ERR_READ = -2, FPM_ERR_WRITE = -3, FPM_ERR_FORMAT = -4, FPM_ERR_NO_PATTERN = -5, FPM_ERR_TOO_LARGE = -6 };
+
+/* all memory of a context and its maps, 'opaque' is passed through. NULL selects malloc/realloc/free */
+typedef struct {
+    void *          (*alloc)(void *opaque, size_t size);
+    void *          (*realloc)(void *opaque, void *ptr, size_t size);
+    void            (*free)(void *opaque, void *ptr);
+    void            *opaque;
+} fpm_allocator_t;
+
+/*
+  A pattern lists the passes of one video mode, each pass one or more sweeps emitted in order. A sweep
+  covers rows fp_start..fp_end (FPM_LAST_ROW is the last row of the frame), a row gets focus pixels if
+  (y + phase) % y_rep == 0 for one of its phases, the first one wins, at every column x >= x_start
+  with (x + shift) % x_rep == 0. Patterns without cameras apply to every camera not listed before.
+*/
+#define FPM_LAST_ROW        -1
+#define FPM_MAX_PHASES      16
+#define FPM_MAX_SWEEPS      4
+#define FPM_MAX_PASSES      4
+#define FPM_MAX_CAMERAS     8
+
+typedef struct {
+    int             phase;
+    int             shift;
+} fpm_phase_t;
+
+typedef struct {
+    int             fp_start;
+    int             fp_end;
+    int             x_start;
+    int             x_rep;
+    int             y_rep;
+    int             phase_count;
+    fpm_phase_t     phases[FPM_MAX_PHASES];
+} fpm_sweep_t;
+
+typedef struct {
+    int             sweep_count;
+    fpm_sweep_t     sweeps[FPM_MAX_SWEEPS];
+} fpm_pass_t;
+
+typedef struct {
+    int             video_mode;
+    int             camera_count;
+    uint32_t        cameras[FPM_MAX_CAMERAS];
+    int             pass_count;
+    fpm_pass_t      passes[FPM_MAX_PASSES];
+} fpm_pattern_t;
+
+typedef struct {
+    char            name[16];
+    char            full_name[32];
+    uint32_t        model;
+} fpm_camera_t;
+
+/* camera and frame a map belongs to, written to file headers */
+typedef struct {
+    uint32_t        camera_model;
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        crop;
+} fpm_info_t;
+
+typedef struct fpm_context fpm_context_t;
+typedef struct fpm_map fpm_map_t;
+
+/* walks the pixels of a row in ascending order */
+typedef struct {
+    const void      *row;
+    uint32_t        run;
+    uint32_t        index;
+    uint32_t        word;
+    uint64_t        bits;
+} fpm_row_iter_t;
+
+/* walks the pixels of one or all passes row by row */
+typedef struct {
+    const fpm_map_t *map;
+    int             pass;
+    int             pass_end;
+    uint32_t        y;
+    fpm_row_iter_t  row;
+} fpm_map_iter_t;
+
+fpm_context_t *fpm_context_new(const fpm_allocator_t *allocator);
+void fpm_context_free(fpm_context_t *ctx);
+
+/* cameras and patterns added at run time are searched before the built-in ones */
+int fpm_add_camera(fpm_context_t *ctx, const fpm_camera_t *camera);
+int fpm_add_pattern(fpm_context_t *ctx, const fpm_pattern_t *pattern);
+int fpm_load_patterns(fpm_context_t *ctx, FILE *file, int *line_No);
+const fpm_camera_t *fpm_find_camera_by_name(const fpm_context_t *ctx, const char *name);
+const fpm_camera_t *fpm_find_camera_by_model(const fpm_context_t *ctx, uint32_t model);
+const fpm_pattern_t *fpm_find_pattern(const fpm_context_t *ctx, int video_mode, uint32_t camera_model);
+const char *fpm_video_mode_name(int video_mode);
+
+fpm_map_t *fpm_map_new(fpm_context_t *ctx, const fpm_info_t *info);
+void fpm_map_free(fpm_map_t *map);
+const fpm_info_t *fpm_map_info(const fpm_map_t *map);
+void fpm_map_set_info(fpm_map_t *map, const fpm_info_t *info);
+int fpm_map_pass_count(const fpm_map_t *map);
+uint32_t fpm_map_pixel_count(const fpm_map_t *map, int pass);
+uint32_t fpm_map_row_count(const fpm_map_t *map, int pass);
+
+/* pixels are added to the last pass, pixels already in it are not added again */
+int fpm_map_add_pass(fpm_map_t *map);
+int fpm_map_add_run(fpm_map_t *map, uint32_t x, uint32_t y, uint32_t step, uint32_t count);
+int fpm_map_add_pixel(fpm_map_t *map, uint32_t x, uint32_t y);
+/* moves the passes of 'other' behind the ones of 'map' and frees it, both from the same context */
+int fpm_map_append(fpm_map_t *map, fpm_map_t *other);
+
+/* returns the pixel count of the row */
+uint32_t fpm_row_iter_init(fpm_row_iter_t *iter, const fpm_map_t *map, int pass, uint32_t y);
+int fpm_row_iter_next(fpm_row_iter_t *iter, uint32_t *x);
+/* pass -1 walks all passes one after another */
+void fpm_map_iter_init(fpm_map_iter_t *iter, const fpm_map_t *map, int pass);
+int fpm_map_iter_next(fpm_map_iter_t *iter, uint32_t *x, uint32_t *y);
+
+int fpm_generate_pattern(fpm_context_t *ctx, fpm_map_t **map, const fpm_pattern_t *pattern, const fpm_info_t *info);
+int fpm_generate(fpm_context_t *ctx, fpm_map_t **map, uint32_t camera_model, int video_mode, uint32_t width, uint32_t height, uint32_t crop, int unified);
+
+/*
+  Patterns of mode FPM_MV_SENSOR place the focus pixels on the whole sensor, one per camera serves every recording
+  geometry. Frame pixel x of a recording sums the sensor pixels offset_x + sampling_x * x + 2 * i for i < binning_x,
+  skipping the rest, likewise for rows. Sampling has to be odd for the colors to keep alternating.
+*/
+typedef struct {
+    uint32_t        sampling_x;
+    uint32_t        sampling_y;
+    uint32_t        binning_x;
+    uint32_t        binning_y;
+    int32_t         offset_x;
+    int32_t         offset_y;
+} fpm_geometry_t;
+
+/* frame pixels with a focus pixel of 'pattern' among their sensor pixels, only the rows of the frame are visited */
+int fpm_project_pattern(fpm_context_t *ctx, fpm_map_t **map, const fpm_pattern_t *pattern, const fpm_geometry_t *geometry, const fpm_info_t *info);
+/* sensor pattern of a pattern found in 1:1 frames, FPM_ERR_FORMAT for binned or skipped geometries */
+int fpm_lift_pattern(const fpm_pattern_t *pattern, const fpm_geometry_t *geometry, fpm_pattern_t *sensor);
+
+/* readers add passes to 'map' and take over the camera and frame of file headers */
+int fpm_read_text(fpm_map_t *map, const uint8_t *data, size_t size, int *header_found);
+int fpm_is_binary(const uint8_t *data, size_t size);
+int fpm_read_binary(fpm_map_t *map, const uint8_t *data, size_t size);
+int fpm_read_pbm(fpm_map_t *map, const uint8_t *data, size_t size, int *info_found);
+int fpm_read_pbm_raster(fpm_map_t *map, const uint8_t *data, size_t size, uint32_t width, uint32_t height);
+
+/* writers take the frame from the map info, 'comment' goes to the header (text without header if NULL) */
+int fpm_write_text(const fpm_map_t *map, FILE *file, const char *comment);
+int fpm_write_binary(const fpm_map_t *map, FILE *file);
+int fpm_write_pbm(const fpm_map_t *map, FILE *file, int pass, const char *comment);
+
+/*
+  Interpolates the pixels of a map in raw frames packed like Magic Lantern raw buffers (16 bit little endian
+  words, pixels most significant bit first). A fixer is made once per clip and can be shared by threads.
+*/
+typedef struct fpm_fixer fpm_fixer_t;
+
+int fpm_fixer_new(fpm_context_t *ctx, fpm_fixer_t **fixer, const fpm_map_t *map, uint32_t bits_per_pixel, uint32_t black_level, uint32_t white_level);
+void fpm_fixer_free(fpm_fixer_t *fixer);
+uint32_t fpm_fixer_pixel_count(const fpm_fixer_t *fixer);
+size_t fpm_fixer_frame_size(const fpm_fixer_t *fixer);
+/* frame of map width x height pixels, fixed in place */
+int fpm_fix_frame(const fpm_fixer_t *fixer, uint8_t *frame, size_t size);
+
+/*
+  Finds focus pixels in footage of cameras without a pattern: frames of the same size are added from any number
+  of threads, per pixel only the number of frames it stood out from its neighbours in is kept.
+*/
+typedef struct fpm_detector fpm_detector_t;
+
+int fpm_detector_new(fpm_context_t *ctx, fpm_detector_t **detector, uint32_t width, uint32_t height, uint32_t bits_per_pixel);
+void fpm_detector_free(fpm_detector_t *detector);
+int fpm_detect_frame(fpm_detector_t *detector, const uint8_t *frame, size_t size);
+uint32_t fpm_detector_frame_count(const fpm_detector_t *detector);
+/* pixels standing out in at least 'fraction' of the frames, camera and crop taken from 'info' if given */
+int fpm_detector_map(const fpm_detector_t *detector, fpm_map_t **map, double fraction, const fpm_info_t *info);
+/* one pass pattern drawing the periodic part of the map, FPM_ERR_NO_PATTERN if there is none */
+int fpm_infer_pattern(const fpm_map_t *map, fpm_pattern_t *pattern);
+
+/*
+  Master dark of lens cap frames for hot, dead and stuck pixels. The dark is shared, every thread adds its frames
+  through an accumulator of its own, freeing the accumulator adds the rest of its frames to the dark.
+*/
+typedef struct fpm_dark fpm_dark_t;
+typedef struct fpm_dark_acc fpm_dark_acc_t;
+
+int fpm_dark_new(fpm_context_t *ctx, fpm_dark_t **dark, uint32_t width, uint32_t height, uint32_t bits_per_pixel);
+void fpm_dark_free(fpm_dark_t *dark);
+uint32_t fpm_dark_frame_count(const fpm_dark_t *dark);
+int fpm_dark_acc_new(fpm_dark_t *dark, fpm_dark_acc_t **acc);
+void fpm_dark_acc_free(fpm_dark_acc_t *acc);
+int fpm_dark_add_frame(fpm_dark_acc_t *acc, const uint8_t *frame, size_t size);
+/* mean and deviation of every pixel, width x height floats each, either may be NULL */
+int fpm_dark_master(const fpm_dark_t *dark, float *mean, float *deviation);
+/* pixels 'sigma' typical deviations off, camera and crop taken from 'info' if given */
+int fpm_dark_map(const fpm_dark_t *dark, fpm_map_t **map, double sigma, const fpm_info_t *info);
+
+#endif
@@ -18,6 +18,7 @@
  * Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,11 +26,26 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
 #include <strings.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#if defined(__WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "mlv.h"
+#include "fpm.h"
 
 #define MSG_INFO     0
 #define MSG_ERROR    1
-#define MLV_VIDEO_CLASS_FLAG_LJ92    0x20
 
 #if defined(__WIN32)
 #define SLASH   '\\'
@@ -48,113 +64,26 @@ int quiet_mode = 0;
 int no_header = 0;
 int unified_mode = 0;
 int one_pass_pbm = 0;
+int binary_fpm = 0;
+int fix_mode = 0;
+int detect_mode = 0;
+int transcode_mode = 0;
 
 char * vid_mode = NULL;
 char * cam_name = NULL;
+char * pattern_file = NULL;
+char * cache_dir = NULL;
+char * dark_file = NULL;
 
 enum ext_type { EXT_FPM, EXT_PBM };
 enum ext_type output_ext = EXT_FPM;
 
 enum get_mode { GET_NONE, GET_CLI, GET_MLV };
-enum pattern { PATTERN_NONE = 0,
-               PATTERN_EOSM = 331, // Pattern A
-               PATTERN_650D = 301, // Pattern A
-               PATTERN_700D = 326, // Pattern A
-               PATTERN_100D = 346  // Pattern B
-             };
-enum video_mode { MV_NONE, MV_720,   MV_1080,   MV_1080CROP,   MV_ZOOM,   MV_CROPREC, 
-                           MV_720_U, MV_1080_U, MV_1080CROP_U, MV_ZOOM_U, MV_CROPREC_U };
-
-typedef struct {
-    uint8_t     blockType[4];
-    uint32_t    blockSize;
-    uint64_t    timestamp;
-} mlv_hdr_t;
-
-typedef struct {
-    uint8_t     fileMagic[4];
-    uint32_t    blockSize;
-    uint8_t     versionString[8];
-    uint64_t    fileGuid;
-    uint16_t    fileNum;
-    uint16_t    fileCount;
-    uint32_t    fileFlags;
-    uint16_t    videoClass;
-    uint16_t    audioClass;
-    uint32_t    videoFrameCount;
-    uint32_t    audioFrameCount;
-    uint32_t    sourceFpsNom;
-    uint32_t    sourceFpsDenom;
-}  mlv_file_hdr_t;
-
-typedef struct {
-    uint8_t     blockType[4];
-    uint32_t    blockSize;
-    uint64_t    timestamp;
-    uint16_t    xRes;
-    uint16_t    yRes;
-    uint32_t    dummy;
-    uint32_t    crop;
-    uint32_t    height;
-    uint32_t    width;
-    uint32_t    pitch;
-    uint32_t    frame_size;
-    uint32_t    bits_per_pixel;
-    uint32_t    black_level;
-    uint32_t    white_level;  
-}  mlv_rawi_hdr_t;
-
-typedef struct {
-    uint8_t     blockType[4];
-    uint32_t    blockSize;
-    uint64_t    timestamp;
-    uint16_t    sensor_res_x;
-    uint16_t    sensor_res_y;
-    uint16_t    sensor_crop;
-    uint16_t    reserved;
-    uint8_t     binning_x;
-    uint8_t     skipping_x;
-    uint8_t     binning_y;
-    uint8_t     skipping_y;
-    int16_t     offset_x;
-    int16_t     offset_y;
-}  mlv_rawc_hdr_t;
-
-typedef struct {
-    uint8_t     blockType[4];
-    uint32_t    blockSize;
-    uint64_t    timestamp;
-    uint8_t     cameraName[32];
-    uint32_t    cameraModel;
-    uint8_t     cameraSerial[32];
-}  mlv_idnt_hdr_t;
-
-mlv_hdr_t mlv_hdr = { 0 };
+
 mlv_file_hdr_t file_hdr = { 0 };
 mlv_rawi_hdr_t rawi_hdr = { 0 };
 mlv_rawc_hdr_t rawc_hdr = { 0 };
 mlv_idnt_hdr_t idnt_hdr = { 0 };
-
-struct pass_info
-{
-    int count;
-    int range[10];
-};
-
-struct pixel_xy
-{
-    int x;
-    int y;
-};
-
-struct pixel_map
-{
-    int count;
-    int capacity;
-    struct pass_info pass;
-    struct pixel_xy * pixels;
-};
-
 char *strdup(const char *src)
 {
     size_t len = strlen(src) + 1;
@@ -164,15 +93,6 @@ char *strdup(const char *src)
     return (char *)memcpy(s, src, len);
 }
 
-static uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
-{
-#if defined(__WIN32)
-    return fseeko64(stream, offset, whence);
-#else
-    return fseek(stream, offset, whence);
-#endif
-}
-
 static uint32_t atoh(char * string)
 {
     register char *p;
@@ -223,111 +143,83 @@ static void print_msg(uint32_t type, const char* format, ... )
     va_end( args );
 }
 
-/* get all needed data from MLV info blocks */
-static int mlv_parse_file(char *mlv_name)
+/* cameras, patterns loaded by '-p <file>' and allocator of all maps */
+fpm_context_t * fpm_ctx = NULL;
+
+/* report a libfpm error, 'file_name' is the file read or written */
+static void print_fpm_error(int ret, const char * file_name)
 {
-    FILE* mlvf = fopen(mlv_name, "rb");
-    if(!mlvf)
+    switch(ret)
     {
-        print_msg(MSG_ERROR, "file '%s' not found\n", mlv_name);
-        return -1;
+        case FPM_ERR_MEMORY:
+            print_msg(MSG_ERROR, "could not allocate memory\n");
+            break;
+        case FPM_ERR_READ:
+            print_msg(MSG_ERROR, "could not read from '%s'\n", file_name);
+            break;
+        case FPM_ERR_WRITE:
+            print_msg(MSG_ERROR, "could not write to '%s'\n", file_name);
+            break;
+        case FPM_ERR_FORMAT:
+            print_msg(MSG_ERROR, "invalid focus pixel map '%s'\n", file_name);
+            break;
+        case FPM_ERR_NO_PATTERN:
+            print_msg(MSG_ERROR, "no focus pixel pattern for this camera and video mode\n");
+            break;
+        case FPM_ERR_TOO_LARGE:
+            print_msg(MSG_ERROR, "focus pixel map too large\n");
+            break;
     }
-    print_msg(MSG_INFO, "Parsing file '%s'\n", mlv_name);
+}
 
-    if(fread(&file_hdr, sizeof(mlv_file_hdr_t), 1, mlvf) != 1)
+/* read '-p' pattern file, see README.md for the format */
+static int load_patterns(char * file_name)
+{
+    FILE* f = fopen(file_name, "r");
+    if(!f)
     {
-        print_msg(MSG_ERROR, "could not read from '%s'\n", mlv_name);
-        return -1;   
+        print_msg(MSG_ERROR, "could not read from '%s'\n", file_name);
+        return 0;
     }
-    if(memcmp(file_hdr.fileMagic, "MLVI", 4) != 0 || file_hdr.blockSize != 52)
+
+    int line_No = 0;
+    int ret = fpm_load_patterns(fpm_ctx, f, &line_No);
+    fclose(f);
+    if(ret == FPM_ERR_FORMAT)
     {
-        print_msg(MSG_ERROR, "'%s' is not a valid MLV\n", mlv_name);
-        return -1;
+        print_msg(MSG_ERROR, "'%s' line %d: invalid focus pixel pattern\n", file_name, line_No);
+        return 0;
     }
+    print_fpm_error(ret, file_name);
+    return !ret;
+}
 
-    /* For safety analyze 32 blocks and search for RAWI blockname, then get values from the 
-       first matched, if all blocks matched return 1 otherwise 0, on file error return -1
-    */
-    int i = 0, rawif = 0, rawcf = 0, idntf = 0;
-    file_set_pos(mlvf, file_hdr.blockSize - sizeof(mlv_file_hdr_t), SEEK_CUR);
-    for (i = 0; i < 32; ++i)
+/* get all needed data from MLV info blocks */
+static int mlv_parse_file(char *mlv_name)
+{
+    mlv_info_t info;
+    int ret = mlv_parse_info(&info, mlv_name);
+    switch(ret)
     {
-        if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, mlvf) != 1)
-        {
+        case MLV_ERR_OPEN:
+            print_msg(MSG_ERROR, "file '%s' not found\n", mlv_name);
+            return -1;
+        case MLV_ERR_READ:
+            print_msg(MSG_INFO, "Parsing file '%s'\n", mlv_name);
             print_msg(MSG_ERROR, "could not read from '%s'\n", mlv_name);
             return -1;
-        }
-
-        if(!memcmp(mlv_hdr.blockType, "RAWI", 4))
-        {
-            if(!rawif)
-            {
-                file_set_pos(mlvf, -sizeof(mlv_hdr_t), SEEK_CUR);
-                if(fread(&rawi_hdr, sizeof(mlv_rawi_hdr_t), 1, mlvf) != 1)
-                {
-                    print_msg(MSG_ERROR, "could not read from '%s'\n", mlv_name);
-                    return -1;
-                }
-                file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_rawi_hdr_t), SEEK_CUR);
-                rawif = 1;
-            }
-            else
-            { 
-                file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_hdr_t), SEEK_CUR);
-            }
-        }
-        else if(!memcmp(mlv_hdr.blockType, "RAWC", 4))
-        {
-            if(!rawcf)
-            {
-                file_set_pos(mlvf, -sizeof(mlv_hdr_t), SEEK_CUR);
-                if(fread(&rawc_hdr, sizeof(mlv_rawc_hdr_t), 1, mlvf) != 1)
-                {
-                    print_msg(MSG_ERROR, "could not read from '%s'\n", mlv_name);
-                    return -1;
-                }
-                file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_rawc_hdr_t), SEEK_CUR);
-                rawcf = 1;
-            }
-            else
-            {
-                file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_hdr_t), SEEK_CUR);
-            }
-        }
-        else if(!memcmp(mlv_hdr.blockType, "IDNT", 4))
-        {
-            if(!idntf)
-            {
-                file_set_pos(mlvf, -sizeof(mlv_hdr_t), SEEK_CUR);
-                if(fread(&idnt_hdr, sizeof(mlv_idnt_hdr_t), 1, mlvf) != 1)
-                {
-                    print_msg(MSG_ERROR, "could not read from '%s'\n", mlv_name);
-                    return -1;
-                }
-                file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_idnt_hdr_t), SEEK_CUR);
-                idntf = 1;
-            }
-            else
-            {
-                file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_hdr_t), SEEK_CUR);
-            }
-        }
-        else
-        {
-            file_set_pos(mlvf, mlv_hdr.blockSize - sizeof(mlv_hdr_t), SEEK_CUR);
-        }
-        
-        //print_msg(MSG_INFO, "%c%c%c%c\n", mlv_hdr.blockType[0], mlv_hdr.blockType[1], mlv_hdr.blockType[2], mlv_hdr.blockType[3]);
-
-        if(rawif & idntf)
-        {
-            fclose(mlvf);
-            return 1;
-        }
+        case MLV_ERR_FORMAT:
+            print_msg(MSG_INFO, "Parsing file '%s'\n", mlv_name);
+            print_msg(MSG_ERROR, "'%s' is not a valid MLV\n", mlv_name);
+            return -1;
     }
+    print_msg(MSG_INFO, "Parsing file '%s'\n", mlv_name);
 
-    fclose(mlvf);
-    return 0;
+    file_hdr = info.file_hdr;
+    if(info.rawi_found) rawi_hdr = info.rawi_hdr;
+    rawc_hdr = (info.rawc_found) ? info.rawc_hdr : (mlv_rawc_hdr_t){ 0 };
+    if(info.idnt_found) idnt_hdr = info.idnt_hdr;
+    return ret;
 }
 
 /* detect crop rec */
@@ -347,66 +239,47 @@ static int get_croprec()
     return 0;
 }
 
-/* returns pixel pattern A, B or NONE in case of unsupported camera */
-static int get_pattern(int get_mode, char *cam_name)
+/* returns camera model or 0 in case of unsupported camera */
+static uint32_t get_camera(int get_mode, char *cam_name)
 {
+    const fpm_camera_t *camera = NULL;
     switch(get_mode)
     {
         case GET_CLI:
-            if(!strcasecmp(cam_name, "EOSM"))
-            {
-                memcpy(idnt_hdr.cameraName, "Canon EOS M", 12);
-                idnt_hdr.cameraModel = 0x80000331;
-                return PATTERN_EOSM;
-            }
-            else if(!strcasecmp(cam_name, "100D"))
-            {
-                memcpy(idnt_hdr.cameraName, "Canon EOS 100D", 15);
-                idnt_hdr.cameraModel = 0x80000346;
-                return PATTERN_100D;
-            }
-            else if(!strcasecmp(cam_name, "650D"))
-            {
-                memcpy(idnt_hdr.cameraName, "Canon EOS 650D", 15);
-                idnt_hdr.cameraModel = 0x80000301;
-                return PATTERN_650D;
-            }
-            else if(!strcasecmp(cam_name, "700D"))
-            {
-                memcpy(idnt_hdr.cameraName, "Canon EOS 700D", 15);
-                idnt_hdr.cameraModel = 0x80000326;
-                return PATTERN_700D;
-            }
-            else
-            {
-                return PATTERN_NONE;
-            }
+            camera = fpm_find_camera_by_name(fpm_ctx, cam_name);
+            if(!camera) return 0;
+            memcpy(idnt_hdr.cameraName, camera->full_name, sizeof(camera->full_name));
+            idnt_hdr.cameraModel = camera->model;
+            return camera->model;
     
         case GET_MLV:
-            switch(idnt_hdr.cameraModel)
-            {
-                case 0x80000331:
-                    return PATTERN_EOSM;
-
-                case 0x80000346:
-                    return PATTERN_100D;
-
-                case 0x80000301:
-                    return PATTERN_650D;
-
-                case 0x80000326:
-                    return PATTERN_700D;
-
-                default: // unsupported camera
-                    return PATTERN_NONE;
-            }
+            camera = fpm_find_camera_by_model(fpm_ctx, idnt_hdr.cameraModel);
+            return (camera) ? camera->model : 0;
 
         default:
-            return PATTERN_NONE;
+            return 0;
     }
 }
 
-/* returns video mode value, special case when vid_mode == "croprec" */
+/* sampling and crop window of the frame on the sensor, from the RAWC block */
+static void get_geometry(fpm_geometry_t * geometry)
+{
+    geometry->sampling_x = rawc_hdr.binning_x + rawc_hdr.skipping_x;
+    geometry->sampling_y = rawc_hdr.binning_y + rawc_hdr.skipping_y;
+    geometry->binning_x = rawc_hdr.binning_x;
+    geometry->binning_y = rawc_hdr.binning_y;
+    geometry->offset_x = rawc_hdr.offset_x;
+    geometry->offset_y = rawc_hdr.offset_y;
+}
+
+/* RAWC fields the projection depends on are equal */
+static int same_geometry(const mlv_rawc_hdr_t * a, const mlv_rawc_hdr_t * b)
+{
+    return a->binning_x == b->binning_x && a->skipping_x == b->skipping_x && a->binning_y == b->binning_y && a->skipping_y == b->skipping_y &&
+           a->offset_x == b->offset_x && a->offset_y == b->offset_y;
+}
+
+/* returns video mode value, special case when vid_mode == "croprec", "sensor" or a resolution without a mode projects the sensor pattern through RAWC */
 static int get_video_mode(int get_mode, char * vid_mode)
 {
     switch(get_mode)
@@ -417,43 +290,48 @@ static int get_video_mode(int get_mode, char * vid_mode)
                 rawi_hdr.crop = 0;
                 rawi_hdr.width = 1808;
                 rawi_hdr.height = 727;
-                return MV_720 + unified_mode;
+                return FPM_MV_720 + unified_mode;
             }   
             else if(!strcasecmp(vid_mode, "mv1080"))
             {
                 rawi_hdr.crop = 0;
                 rawi_hdr.width = 1808;
                 rawi_hdr.height = 1190;
-                return MV_1080 + unified_mode;
+                return FPM_MV_1080 + unified_mode;
             }
             else if(!strcasecmp(vid_mode, "mv1080crop"))
             {
                 rawi_hdr.crop = 0;
                 rawi_hdr.width = 1872;
                 rawi_hdr.height = 1060;
-                return MV_1080CROP + unified_mode;
+                return FPM_MV_1080CROP + unified_mode;
             }
             else if(!strcasecmp(vid_mode, "zoom"))
             {
                 rawi_hdr.crop = 0;
                 rawi_hdr.width = 2592;
                 rawi_hdr.height = 1332;
-                return MV_ZOOM + unified_mode;
+                return FPM_MV_ZOOM + unified_mode;
             }
             else if(!strcasecmp(vid_mode, "croprec"))
             {
                 rawi_hdr.crop = 1;
                 rawi_hdr.width = 1808;
                 rawi_hdr.height = 727;
-                return MV_CROPREC + unified_mode;
+                return FPM_MV_CROPREC + unified_mode;
             }
             else
             {
                 rawi_hdr.crop = 0;
-                return MV_NONE;
+                return FPM_MV_NONE;
             }
         
         case GET_MLV:
+            if(vid_mode != NULL && !strcasecmp(vid_mode, "sensor"))
+            {
+                rawi_hdr.crop = 0;
+                return (rawc_hdr.blockType[0]) ? FPM_MV_SENSOR : FPM_MV_NONE;
+            }
             switch(rawi_hdr.width)
             {
                 case 1808:
@@ -463,35 +341,35 @@ static int get_video_mode(int get_mode, char * vid_mode)
                         if((vid_mode != NULL && !strcasecmp(vid_mode, "croprec")) || is_crop_rec)
                         {
                             rawi_hdr.crop = (!is_crop_rec) ? 1 : is_crop_rec;
-                            return MV_CROPREC + unified_mode;
+                            return FPM_MV_CROPREC + unified_mode;
                         }
                         else
                         {
                             rawi_hdr.crop = 0;
-                            return MV_720 + unified_mode;
+                            return FPM_MV_720 + unified_mode;
                         }
                     }
                     else
                     {
                         rawi_hdr.crop = 0;
-                        return MV_1080 + unified_mode;
+                        return FPM_MV_1080 + unified_mode;
                     }
 
                 case 1872:
                     rawi_hdr.crop = 0;
-                    return MV_1080CROP + unified_mode;
+                    return FPM_MV_1080CROP + unified_mode;
 
                 case 2592:
                     rawi_hdr.crop = 0;
-                    return MV_ZOOM + unified_mode;
+                    return FPM_MV_ZOOM + unified_mode;
 
                 default:
                     rawi_hdr.crop = 0;
-                    return MV_NONE + unified_mode;
+                    return (rawc_hdr.blockType[0]) ? FPM_MV_SENSOR : FPM_MV_NONE;
             }
 
         default:
-            return MV_NONE;
+            return FPM_MV_NONE;
     }
 }
 
@@ -518,32 +396,14 @@ static char *get_output_filename(char *output_filename)
     }
 }
 
-/* add focus pixel coordinats to the map */
-static int add_pixel_to_map(struct pixel_map * map, int x, int y)
+/* open an output map, a file linked from the map cache is replaced instead of written through */
+static FILE * open_output(const char * file_name, const char * mode)
 {
-    if(!map->capacity)
-    {
-        map->capacity = 32;
-        map->pixels = malloc(sizeof(struct pixel_xy) * map->capacity);
-        if(!map->pixels) goto malloc_error;
-    }
-    else if(map->count >= map->capacity)
-    {
-        map->capacity *= 2;
-        map->pixels = realloc(map->pixels, sizeof(struct pixel_xy) * map->capacity);
-        if(!map->pixels) goto malloc_error;
-    }
-    
-    map->pixels[map->count].x = x;
-    map->pixels[map->count].y = y;
-    map->count++;
-    return 1;
-
-malloc_error:
-
-    print_msg(MSG_ERROR, "could not allocate memory\n");
-    map->count = 0;
-    return 0;
+#if !defined(__WIN32)
+    struct stat attr;
+    if(!lstat(file_name, &attr) && S_ISREG(attr.st_mode) && attr.st_nlink > 1) remove(file_name);
+#endif
+    return fopen(file_name, mode);
 }
 
 /* scan file name for ID and resolution */
@@ -555,22 +415,22 @@ static int scan_filename(char * input_filename, uint32_t * cameraModel, uint32_t
     if(file_name) ++file_name;
     else file_name = file_path;
     
-    enum pattern pattern = PATTERN_NONE;
-    enum video_mode video_mode = MV_NONE;
+    uint32_t camera = 0;
+    enum fpm_video_mode video_mode = FPM_MV_NONE;
     
-    if(cam_name) pattern = get_pattern(GET_CLI, cam_name);
+    if(cam_name) camera = get_camera(GET_CLI, cam_name);
     if(vid_mode) video_mode = get_video_mode(GET_CLI, vid_mode);        
 
     char * n_cameraModel = strtok(file_name, "_");
     char * n_width = strtok(NULL, "x");
     char * n_height = strtok(NULL, ".");
 
-    if( ( (n_cameraModel[0] != '8' && n_cameraModel[1] != '0') && !pattern) || ( (!n_width || !n_height) && !video_mode ) )
+    if( ( (n_cameraModel[0] != '8' && n_cameraModel[1] != '0') && !camera) || ( (!n_width || !n_height) && !video_mode ) )
     {
         return 0;
     }
 
-    if(!pattern && n_cameraModel)
+    if(!camera && n_cameraModel)
     {
         *cameraModel = atoh(n_cameraModel);
     }
@@ -584,112 +444,186 @@ static int scan_filename(char * input_filename, uint32_t * cameraModel, uint32_t
     return 1;
 }
 
-/* load .fpm file */
-static int fpm_load(struct pixel_map * map, char * file_name)
+/* map 'file_name' as a whole, returns 0 and reports the error if it can not be read */
+static int map_input(mlv_mapping_t * mapping, char * file_name)
 {
-    FILE* f = fopen(file_name, "r");
+    FILE* f = fopen(file_name, "rb");
     if(!f)
     {
         print_msg(MSG_ERROR, "could not read from '%s'\n", file_name);
         return 0;
     }
-    
-    if(fscanf(f, "#FPM%*[ ]%X%*[ ]%u%*[ ]%u%*[ ]%u%*[^\n]", &idnt_hdr.cameraModel, &rawi_hdr.width, &rawi_hdr.height, &rawi_hdr.crop) != 4)
+
+    int ret = !mlv_map_file(mapping, f);
+    fclose(f);
+    if(!ret) print_msg(MSG_ERROR, "could not read from '%s'\n", file_name);
+    return ret;
+}
+
+/* camera and frame of the map are those of the global headers */
+static void set_map_info(fpm_map_t * map)
+{
+    fpm_info_t info = { idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height, rawi_hdr.crop };
+    fpm_map_set_info(map, &info);
+}
+
+/* take camera and frame over from a map file header */
+static void get_map_info(const fpm_map_t * map)
+{
+    const fpm_info_t * info = fpm_map_info(map);
+    idnt_hdr.cameraModel = info->camera_model;
+    rawi_hdr.width = info->width;
+    rawi_hdr.height = info->height;
+    rawi_hdr.crop = info->crop;
+}
+
+/* load .fpm file, without a header camera and resolution come from the file name or command line */
+static int fpm_load(fpm_map_t * map, char * file_name)
+{
+    mlv_mapping_t mapping;
+    if(!map_input(&mapping, file_name)) return 0;
+
+    int header_found = 0;
+    int ret = fpm_read_text(map, mapping.data, mapping.size, &header_found);
+    mlv_unmap_file(&mapping);
+    if(ret)
     {
-        if(!scan_filename(file_name, &idnt_hdr.cameraModel, &rawi_hdr.width, &rawi_hdr.height))
-        {
-            print_msg(MSG_ERROR, "'%s' map can not be converted!\nCould not acquire sufficient information from header, file name or command line\n", file_name);
-            return 0;
-        }
+        print_fpm_error(ret, file_name);
+        return 0;
     }
 
-    int x, y, prev_y = 0;
-    while (fscanf(f, "%u%*[ \t]%u%*[^\n]", &x, &y) != EOF)
+    if(header_found)
     {
-        if(y < prev_y) // detect next pass start
-        {
-            map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-        }
-        prev_y = y;
-
-        add_pixel_to_map(map, x, y);
+        get_map_info(map);
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-    
-    fclose(f);
+    else if(!scan_filename(file_name, &idnt_hdr.cameraModel, &rawi_hdr.width, &rawi_hdr.height))
+    {
+        print_msg(MSG_ERROR, "'%s' map can not be converted!\nCould not acquire sufficient information from header, file name or command line\n", file_name);
+        return 0;
+    }
+
     output_ext = EXT_PBM;
     return 1;    
 }
 
 /* save .fpm file */
-static int fpm_save(struct pixel_map * map, char * file_name)
+static int fpm_save(fpm_map_t * map, char * file_name)
 {
-    FILE* f = fopen(file_name, "w");
+    FILE* f = open_output(file_name, "w");
     if(!f)
     {
         print_msg(MSG_ERROR, "could not open '%s'\n", file_name);
         return 0;
     }
     
-    if(!no_header)
-    {
-        if(fprintf(f, "#FPM %X %u %u %u %u -- fpmutil v%s\n", idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height, rawi_hdr.crop, map->pass.count, fpmutil_version) < 0)
-        {
-            print_msg(MSG_ERROR, "could not write to '%s'\n", file_name);
-            return 0;
-        }
-    }
-
-    for (size_t i = 0; i < map->count; ++i)
+    char comment[32];
+    sprintf(comment, "fpmutil v%s", fpmutil_version);
+    int ret = fpm_write_text(map, f, (no_header) ? NULL : comment);
+    if(fclose(f) && !ret) ret = FPM_ERR_WRITE;
+    if(ret)
     {
-        if(fprintf(f, "%u \t %u\n", map->pixels[i].x, map->pixels[i].y) < 0)
-        {
-            print_msg(MSG_ERROR, "could not write to '%s'\n", file_name);
-            return 0;
-        }
+        print_fpm_error(ret, file_name);
+        return 0;
     }
     
-    print_msg(MSG_INFO, "%d pixels saved as %u pass focus pixel map '%s'\n", map->count, map->pass.count, file_name);
+    print_msg(MSG_INFO, "%d pixels saved as %u pass focus pixel map '%s'\n", fpm_map_pixel_count(map, -1), fpm_map_pass_count(map), file_name);
+    return 1;
+}
 
+/* check if file starts with the binary FPM v2 magic */
+static int fpm2_detect(char * file_name)
+{
+    uint8_t magic[4];
+    FILE* f = fopen(file_name, "rb");
+    if(!f) return 0;
+    int ret = (fread(magic, 4, 1, f) == 1 && fpm_is_binary(magic, 4));
     fclose(f);
-    return 1;;
+    return ret;
 }
 
-/* 1 bit image pixel toggle for PBM map */
-static void pbm_toggle_pixel(char * img_buf, int index)
+/* load binary .fpm file */
+static int fpm2_load(fpm_map_t * map, char * file_name)
 {
-    img_buf[index / 8] ^= 1 << (7 - index % 8);
+    mlv_mapping_t mapping;
+    if(!map_input(&mapping, file_name)) return 0;
+
+    int ret = fpm_read_binary(map, mapping.data, mapping.size);
+    mlv_unmap_file(&mapping);
+    if(ret == FPM_ERR_FORMAT)
+    {
+        print_msg(MSG_ERROR, "invalid binary FPM file '%s'\n", file_name);
+        return 0;
+    }
+    else if(ret)
+    {
+        print_fpm_error(ret, file_name);
+        return 0;
+    }
+
+    get_map_info(map);
+    output_ext = EXT_PBM;
+    return 1;
 }
 
-/* 1 bit image get pixel value for PBM map */
-static char pbm_get_pixel(char * img_buf, int index)
+/* save binary .fpm file */
+static int fpm2_save(fpm_map_t * map, char * file_name)
 {
-    return 1 & img_buf[index / 8] >> (7 - index % 8);
+    FILE* f = open_output(file_name, "wb");
+    if(!f)
+    {
+        print_msg(MSG_ERROR, "could not open '%s'\n", file_name);
+        return 0;
+    }
+
+    int ret = fpm_write_binary(map, f);
+    if(fclose(f) && !ret) ret = FPM_ERR_WRITE;
+    if(ret)
+    {
+        print_fpm_error(ret, file_name);
+        return 0;
+    }
+
+    print_msg(MSG_INFO, "%d pixels saved as %u pass binary focus pixel map '%s'\n", fpm_map_pixel_count(map, -1), fpm_map_pass_count(map), file_name);
+    return 1;
 }
 
-/* load .pbm file */
-static int pbm_load(struct pixel_map * map, char * file_name)
+/* PBM image of one input file, decoded into a pass of its own map */
+struct pbm_job
 {
-    FILE* f = fopen(file_name, "rb");
+    char * file_name;
+    uint32_t width;
+    uint32_t height;
+    long offset;                /* image data start */
+    fpm_map_t * map;
+    int ret;
+};
+
+/* read .pbm header and take over camera ID, crop and resolution */
+static int pbm_read_header(struct pbm_job * job)
+{
+    FILE* f = fopen(job->file_name, "rb");
     if(!f)
     {
-        print_msg(MSG_ERROR, "could not open '%s'\n", file_name);
+        print_msg(MSG_ERROR, "could not open '%s'\n", job->file_name);
         return 0;
     }
     
-    char pbm_header[256];
+    char pbm_header[257] = { 0 };
     if(fread(pbm_header, 256, 1, f) != 1)
     {
-        print_msg(MSG_ERROR, "could not read from '%s'\n", file_name);
+        print_msg(MSG_ERROR, "could not read from '%s'\n", job->file_name);
+        fclose(f);
         return 0;
     }
+    fclose(f);
 
     if(memcmp(pbm_header, "P4", 2) != 0 ) // Check P4 signature
     {
-        print_msg(MSG_ERROR, "invalid PBM file '%s'\n", file_name);
+        print_msg(MSG_ERROR, "invalid PBM file '%s'\n", job->file_name);
         return 0;
     }
 
+    char * file_name = job->file_name;
     if(strchr(pbm_header, '#')) // Check if there is a comment line
     {
         if(sscanf(pbm_header, "P4\n#%*[ ]%X%*[ ]%u%*[^\n]%u%*[ ]%u%*[^\n]", &idnt_hdr.cameraModel, &rawi_hdr.crop, &rawi_hdr.width, &rawi_hdr.height) != 4) // All matched
@@ -735,98 +669,126 @@ static int pbm_load(struct pixel_map * map, char * file_name)
         }
     }
 
-    size_t pbm_row_bytes = rawi_hdr.width / 8 + (!!(rawi_hdr.width % 8));
-    size_t pbm_image_buf_size = pbm_row_bytes * rawi_hdr.height;
-    char * pbm_image_buf = calloc(pbm_image_buf_size, 1);
-
     /* calculate header size */
-    int offset = strrchr(pbm_header, '\n') - pbm_header + 1;
-    file_set_pos(f, offset, SEEK_SET);
-    if(fread(pbm_image_buf, pbm_image_buf_size, 1, f) != 1)
+    job->offset = strrchr(pbm_header, '\n') - pbm_header + 1;
+    job->width = rawi_hdr.width;
+    job->height = rawi_hdr.height;
+    return 1;
+}
+
+/* decode image data of a .pbm file into the first pass of 'job->map' */
+static void * pbm_decode(void * arg)
+{
+    struct pbm_job * job = arg;
+    job->ret = 0;
+
+    mlv_mapping_t mapping;
+    if(!map_input(&mapping, job->file_name)) return NULL;
+
+    int ret = FPM_ERR_READ;
+    job->map = fpm_map_new(fpm_ctx, NULL);
+    if(!job->map) ret = FPM_ERR_MEMORY;
+    else if(job->offset <= mapping.size) ret = fpm_read_pbm_raster(job->map, mapping.data + job->offset, mapping.size - job->offset, job->width, job->height);
+    mlv_unmap_file(&mapping);
+
+    /* a short image is a read error like it was for fread() */
+    if(ret == FPM_ERR_FORMAT) ret = FPM_ERR_READ;
+    print_fpm_error(ret, job->file_name);
+    job->ret = !ret;
+    return NULL;
+}
+
+/* load .pbm files, each image is a pass. Headers are read in order, images are decoded in parallel */
+static int pbm_load(fpm_map_t * map, char ** input_filename, int input_filecount)
+{
+    int ret = 0;
+    struct pbm_job * jobs = calloc(input_filecount, sizeof(struct pbm_job));
+    pthread_t * threads = calloc(input_filecount, sizeof(pthread_t));
+    int * threaded = calloc(input_filecount, sizeof(int));
+    if(!jobs || !threads || !threaded)
     {
-        print_msg(MSG_ERROR, "could not read from '%s'\n", file_name);
-        return 0;
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        goto bailout;
     }
-    
-    size_t pbm_row_width = pbm_row_bytes * 8;
-    for(size_t y = 0; y < rawi_hdr.height; ++y)
+
+    for(int i = 0; i < input_filecount; i++)
+    {
+        jobs[i].file_name = input_filename[i];
+        if(!pbm_read_header(&jobs[i])) goto bailout;
+    }
+
+    for(int i = 1; i < input_filecount; i++)
     {
-        for(size_t x = 0; x < rawi_hdr.width; ++x)
+        threaded[i] = !pthread_create(&threads[i], NULL, pbm_decode, &jobs[i]);
+    }
+    pbm_decode(&jobs[0]);
+    for(int i = 1; i < input_filecount; i++)
+    {
+        if(threaded[i]) pthread_join(threads[i], NULL);
+        else pbm_decode(&jobs[i]);
+    }
+
+    /* move decoded passes over in input order */
+    for(int i = 0; i < input_filecount; i++)
+    {
+        if(!jobs[i].ret) goto bailout;
+    }
+    for(int i = 0; i < input_filecount; i++)
+    {
+        int append_ret = fpm_map_append(map, jobs[i].map);
+        if(append_ret)
         {
-            if(pbm_get_pixel(pbm_image_buf, y * pbm_row_width + x))
-            {
-                add_pixel_to_map(map, x, y);
-            }
+            print_fpm_error(append_ret, input_filename[i]);
+            goto bailout;
         }
+        jobs[i].map = NULL;
     }
 
-    free(pbm_image_buf);
-    fclose(f);
     output_ext = EXT_FPM;
-    return 1;
+    ret = 1;
+
+bailout:
+
+    for(int i = 0; jobs && i < input_filecount; i++) fpm_map_free(jobs[i].map);
+    free(jobs);
+    free(threads);
+    free(threaded);
+    return ret;
 }
 
-/* save .pbm file */
-static int pbm_save(struct pixel_map * map, char * file_name, int pass_No)
+/* save .pbm file of one pass or all passes if 'pass_No' is zero */
+static int pbm_save(fpm_map_t * map, char * file_name, int pass_No)
 {
-    FILE* f = fopen(file_name, "wb");
+    FILE* f = open_output(file_name, "wb");
     if(!f)
     {
         print_msg(MSG_ERROR, "could not open '%s'\n", file_name);
         return 0;
     }
 
-    /* save .pbm header */
-    char pbm_header[64];
-    sprintf(pbm_header, "P4\n# %X %u -- fpmutil v%s\n%u %u\n", idnt_hdr.cameraModel, rawi_hdr.crop, fpmutil_version, rawi_hdr.width, rawi_hdr.height);
-    int pbm_header_size = strlen(pbm_header);
-    if(fwrite(pbm_header, sizeof(char), pbm_header_size, f) != pbm_header_size)
-    {
-        print_msg(MSG_ERROR, "could not write to '%s'\n", file_name);
-        return 0;
-    }
-
-    /* save .pbm image data */
-    size_t pbm_row_bytes = rawi_hdr.width / 8 + (!!(rawi_hdr.width % 8));
-    size_t pbm_image_buf_size = pbm_row_bytes * rawi_hdr.height;
-    char * pbm_image_buf = calloc(pbm_image_buf_size, 1);
-    size_t pbm_row_width = pbm_row_bytes * 8;
-    
-    int pass_start = 0;
-    int pass_end = map->count;
-    if(pass_No) // if pass_No is zero then write one file with all passes
-    {
-        pass_start = map->pass.range[pass_No - 1];
-        pass_end = map->pass.range[pass_No];
-    }
-
-    for (size_t i = pass_start; i < pass_end; ++i)
-    {
-        pbm_toggle_pixel(pbm_image_buf, map->pixels[i].y * pbm_row_width + map->pixels[i].x);
-    }
-
-    if(fwrite(pbm_image_buf, pbm_image_buf_size, 1, f) != 1)
+    char comment[32];
+    sprintf(comment, "fpmutil v%s", fpmutil_version);
+    int ret = fpm_write_pbm(map, f, pass_No - 1, comment);
+    if(fclose(f) && !ret) ret = FPM_ERR_WRITE;
+    if(ret)
     {
-        print_msg(MSG_ERROR, "could not write to '%s'\n", file_name);
+        print_fpm_error(ret, file_name);
         return 0;
     }
     
     if(one_pass_pbm)
     {
-        print_msg(MSG_INFO, "%d pixels saved as 1 pass focus pixel map '%s'\n", map->count, file_name);
+        print_msg(MSG_INFO, "%d pixels saved as 1 pass focus pixel map '%s'\n", fpm_map_pixel_count(map, -1), file_name);
     }
     else
     {
-        print_msg(MSG_INFO, "%d pixels saved as pass %u focus pixel map '%s'\n", pass_end - pass_start, pass_No, file_name);
+        print_msg(MSG_INFO, "%d pixels saved as pass %u focus pixel map '%s'\n", fpm_map_pixel_count(map, pass_No - 1), pass_No, file_name);
     }
-    
-    free(pbm_image_buf);
-    fclose(f);
     return 1;
 }
 
 /* load .fpm or .pbm pixel map */
-static int load_pixel_map(struct pixel_map * map, char ** input_filename, int input_filecount)
+static int load_pixel_map(fpm_map_t * map, char ** input_filename, int input_filecount)
 {
     char file_name[1024] = { 0 };
     strcpy(file_name, input_filename[0]);
@@ -837,23 +799,17 @@ static int load_pixel_map(struct pixel_map * map, char ** input_filename, int in
         print_msg(MSG_ERROR, "wrong input file name '%s'\n", file_name);
         return 0;
     }
+    else if(fpm2_detect(file_name))
+    {
+        return fpm2_load(map, file_name);
+    }
     else if(!strcasecmp(ext, ".fpm"))
     {
         return fpm_load(map, file_name);
     }
     else if(!strcasecmp(ext, ".pbm"))
     {
-        map->pass.count = input_filecount;
-
-        int ret = 0;
-        for(int i = 0; i < input_filecount; i++)
-        {
-            ret = pbm_load(map, input_filename[i]);
-            if(!ret) break;
-        }
-
-        return ret;
-
+        return pbm_load(map, input_filename, input_filecount);
     }
 
     print_msg(MSG_ERROR, "'%s' is not a valid focus map file extension\n", ext);
@@ -861,8 +817,10 @@ static int load_pixel_map(struct pixel_map * map, char ** input_filename, int in
 }
 
 /* load .fpm or .pbm pixel map */
-static int save_pixel_map(struct pixel_map * map, char * output_filename)
+static int save_pixel_map(fpm_map_t * map, char * output_filename)
 {
+    set_map_info(map);
+
     char file_name[1024] = { 0 };
     strcpy(file_name, output_filename);
     char *ext = strrchr(file_name, '.');
@@ -874,18 +832,18 @@ static int save_pixel_map(struct pixel_map * map, char * output_filename)
     }
     else if(!strcasecmp(ext, ".fpm"))
     {
-        return fpm_save(map, file_name);
+        return (binary_fpm) ? fpm2_save(map, file_name) : fpm_save(map, file_name);
     }
     else if(!strcasecmp(ext, ".pbm"))
     {
-        if(map->pass.count == 1 || one_pass_pbm)
+        if(fpm_map_pass_count(map) == 1 || one_pass_pbm)
         {
             return pbm_save(map, file_name, 0);
         }
 
         int ret = 0;
         char passNo[11] = { 0 };
-        for(int i = 1; i <= MIN(map->pass.count, 9); i++)
+        for(int i = 1; i <= MIN(fpm_map_pass_count(map), 9); i++)
         {
             sprintf(passNo, ".pass%u.pbm", i);
             memcpy(ext, passNo, 10);
@@ -899,601 +857,1517 @@ static int save_pixel_map(struct pixel_map * map, char * output_filename)
     return 0;
 }
 
-/* standard generators ************************************************************************************************/
-
-/*
-  mv720() function
-  Draw the focus pixel pattern for mv720 video mode.
-*/
-static void mv720(struct pixel_map * map, int pattern)
+/* draw all passes of a pattern for the camera and resolution of the global headers, sensor patterns are projected through RAWC */
+static int generate_map(fpm_map_t ** map, const fpm_pattern_t * pattern)
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
+    fpm_info_t info = { idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height, rawi_hdr.crop };
+    if(pattern->video_mode == FPM_MV_SENSOR)
+    {
+        fpm_geometry_t geometry;
+        get_geometry(&geometry);
+        int ret = fpm_project_pattern(fpm_ctx, map, pattern, &geometry, &info);
+        if(ret == FPM_ERR_FORMAT)
+        {
+            print_msg(MSG_ERROR, "sampling %ux%u with binning %ux%u can not be projected\n", geometry.sampling_x, geometry.sampling_y, geometry.binning_x, geometry.binning_y);
+        }
+        else
+        {
+            print_fpm_error(ret, NULL);
+        }
+        return !ret;
+    }
+    int ret = fpm_generate_pattern(fpm_ctx, map, pattern, &info);
+    print_fpm_error(ret, NULL);
+    return !ret;
+}
 
-    int fp_start = 290; 
-    int fp_end = 465;
-    int x_rep = 8;
-    int y_rep = 12;
-    
-    if(pattern == PATTERN_100D)
+/* map cache **********************************************************************************************************/
+
+/* bump when generated maps change without a change of the pattern tables */
+#define CACHE_VERSION 1
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const void * data, size_t size)
+{
+    const uint8_t * bytes = data;
+    for(size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+static uint64_t hash_int(uint64_t hash, uint32_t value)
+{
+    return hash_bytes(hash, &value, sizeof(value));
+}
+
+/* cache file of the map 'pattern' generates for the current camera and resolution, saved like 'output_filename',
+   keyed on everything the file content depends on. Returns 0 if the map is not cached */
+static int cache_entry_name(char * entry, size_t size, const fpm_pattern_t * pattern, enum fpm_video_mode video_mode, const char * output_filename)
+{
+    const char * ext = strrchr(output_filename, '.');
+    if(!ext) return 0;
+    int pbm = !strcasecmp(ext, ".pbm");
+    if(!pbm && strcasecmp(ext, ".fpm")) return 0;
+    if(pbm && pattern->pass_count > 1 && !one_pass_pbm) return 0; // one '.pbm' per pass
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = hash_int(hash, CACHE_VERSION);
+    hash = hash_bytes(hash, fpmutil_version, strlen(fpmutil_version));
+    hash = hash_int(hash, idnt_hdr.cameraModel);
+    hash = hash_int(hash, rawi_hdr.width);
+    hash = hash_int(hash, rawi_hdr.height);
+    hash = hash_int(hash, rawi_hdr.crop);
+    hash = hash_int(hash, video_mode);
+    hash = hash_int(hash, pbm);
+    hash = hash_int(hash, (pbm) ? 0 : binary_fpm);
+    hash = hash_int(hash, (pbm) ? 0 : no_header);
+    if(video_mode == FPM_MV_SENSOR)
+    {
+        fpm_geometry_t geometry;
+        get_geometry(&geometry);
+        hash = hash_bytes(hash, &geometry, sizeof(fpm_geometry_t));
+    }
+
+    /* the pattern itself, so edited tables and pattern files never hit old maps */
+    hash = hash_int(hash, pattern->pass_count);
+    for(int i = 0; i < pattern->pass_count; i++)
+    {
+        hash = hash_int(hash, pattern->passes[i].sweep_count);
+        for(int j = 0; j < pattern->passes[i].sweep_count; j++)
+        {
+            const fpm_sweep_t * sweep = &pattern->passes[i].sweeps[j];
+            hash = hash_int(hash, sweep->fp_start);
+            hash = hash_int(hash, sweep->fp_end);
+            hash = hash_int(hash, sweep->x_start);
+            hash = hash_int(hash, sweep->x_rep);
+            hash = hash_int(hash, sweep->y_rep);
+            hash = hash_int(hash, sweep->phase_count);
+            for(int k = 0; k < sweep->phase_count; k++)
+            {
+                hash = hash_int(hash, sweep->phases[k].phase);
+                hash = hash_int(hash, sweep->phases[k].shift);
+            }
+        }
+    }
+
+    int len = snprintf(entry, size, "%s/%x_%ux%u_%u_%s%s_%016" PRIx64 "%s", cache_dir, idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height, rawi_hdr.crop,
+                       fpm_video_mode_name(video_mode), FPM_IS_UNIFIED(video_mode) ? "-u" : "", hash, (pbm) ? ".pbm" : ".fpm");
+    return (len > 0 && len < size);
+}
+
+/* copy 'from' to a new file 'to', as a reflink where the file system supports it */
+static int copy_file(const char * from, const char * to)
+{
+    FILE * in = fopen(from, "rb");
+    if(!in) return 0;
+    FILE * out = fopen(to, "wb");
+    if(!out)
     {
-        fp_start = 86;
-        fp_end = 669;
+        fclose(in);
+        return 0;
     }
 
-    for(int y = fp_start; y <= fp_end; y++)
+    int ret = 0;
+#if defined(FICLONE)
+    if(!ioctl(fileno(out), FICLONE, fileno(in)))
     {
-        if(((y + 3) % y_rep) == 0) shift = 7;
-        else if(((y + 4) % y_rep) == 0) shift = 6;
-        else if(((y + 9) % y_rep) == 0) shift = 3;
-        else if(((y + 10) % y_rep) == 0) shift = 2;
-        else continue;
-    
-        for(int x = 72; x < raw_width; x++)
+        ret = 1;
+        goto bailout;
+    }
+#endif
+
+    char buf[64 * 1024];
+    size_t size;
+    while((size = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        if(fwrite(buf, 1, size, out) != size) goto bailout;
+    }
+    ret = !ferror(in);
+
+bailout:
+
+    fclose(in);
+    if(fclose(out)) ret = 0;
+    if(!ret) remove(to);
+    return ret;
+}
+
+/* hardlink 'from' as 'to' or copy it, Windows always copies as its writers go through links */
+static int link_or_copy(const char * from, const char * to)
+{
+#if !defined(__WIN32)
+    if(!link(from, to)) return 1;
+#endif
+    return copy_file(from, to);
+}
+
+/* serve 'output_filename' from cache 'entry', returns 0 on a miss */
+static int cache_fetch(const char * entry, const char * output_filename)
+{
+    struct stat entry_attr;
+    if(stat(entry, &entry_attr)) return 0;
+
+#if !defined(__WIN32)
+    struct stat output_attr;
+    if(!stat(output_filename, &output_attr) && output_attr.st_dev == entry_attr.st_dev && output_attr.st_ino == entry_attr.st_ino)
+    {
+        print_msg(MSG_INFO, "Focus pixel map '%s' is cached as '%s'\n", output_filename, entry);
+        return 1;
+    }
+#endif
+
+    remove(output_filename);
+    if(!link_or_copy(entry, output_filename)) return 0;
+
+    print_msg(MSG_INFO, "Focus pixel map '%s' taken from cache '%s'\n", output_filename, entry);
+    return 1;
+}
+
+/* add saved 'output_filename' as cache 'entry', written to a temporary name and renamed so concurrent runs only ever see complete entries */
+static void cache_store(const char * entry, const char * output_filename)
+{
+    char tmp_name[1100];
+#if defined(__WIN32)
+    CreateDirectoryA(cache_dir, NULL);
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%lu.tmp", entry, (unsigned long)GetCurrentProcessId());
+#else
+    mkdir(cache_dir, 0777);
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%lu.tmp", entry, (unsigned long)getpid());
+#endif
+
+    if(!link_or_copy(output_filename, tmp_name))
+    {
+        print_msg(MSG_ERROR, "could not add '%s' to cache '%s'\n", output_filename, cache_dir);
+        return;
+    }
+
+#if defined(__WIN32)
+    if(!MoveFileExA(tmp_name, entry, MOVEFILE_REPLACE_EXISTING)) remove(tmp_name);
+#else
+    if(rename(tmp_name, entry)) remove(tmp_name);
+#endif
+}
+
+/* end of map cache ***************************************************************************************************/
+
+/* batch mode *********************************************************************************************************/
+
+/* MLV clip of a batch run */
+struct batch_clip
+{
+    char * file_name;
+    char * output_filename;     /* MLVFS named map next to the clip */
+    mlv_info_t info;
+    int ret;                    /* of mlv_parse_info() */
+    int group;                  /* -1 if there is no map for the clip */
+    int written;
+};
+
+/* clips resolving to the same map */
+struct batch_group
+{
+    mlv_idnt_hdr_t idnt_hdr;
+    mlv_rawi_hdr_t rawi_hdr;
+    mlv_rawc_hdr_t rawc_hdr;    /* sensor geometry, only compared in sensor mode */
+    enum fpm_video_mode video_mode;
+    const fpm_pattern_t * pattern;
+    int clip_count;
+};
+
+struct batch
+{
+    struct batch_clip * clips;
+    int clip_count;
+    int clip_capacity;
+    int next_clip;              /* next clip to parse, taken atomically by the workers */
+    struct batch_group * groups;
+    int group_count;
+};
+
+static int get_cpu_count()
+{
+#if defined(__WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? count : 1;
+#endif
+}
+
+static int compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int batch_add_clip(struct batch * batch, const char * file_name)
+{
+    if(batch->clip_count >= batch->clip_capacity)
+    {
+        int capacity = (batch->clip_capacity) ? batch->clip_capacity * 2 : 64;
+        struct batch_clip * clips = realloc(batch->clips, sizeof(struct batch_clip) * capacity);
+        if(!clips) return 0;
+        batch->clips = clips;
+        batch->clip_capacity = capacity;
+    }
+
+    struct batch_clip * clip = &batch->clips[batch->clip_count++];
+    memset(clip, 0, sizeof(struct batch_clip));
+    clip->group = -1;
+    clip->file_name = strdup(file_name);
+    return clip->file_name != NULL;
+}
+
+/* add a clip or the '.mlv' files of a directory, walked recursively in name order */
+static int batch_collect(struct batch * batch, const char * path, int from_dir)
+{
+    struct stat attr;
+    if(stat(path, &attr))
+    {
+        print_msg(MSG_ERROR, "file '%s' not found\n", path);
+        return 0;
+    }
+
+    if(!S_ISDIR(attr.st_mode))
+    {
+        const char * ext = strrchr(path, '.');
+        if(from_dir && (!ext || strcasecmp(ext, ".mlv"))) return 1;
+        if(batch_add_clip(batch, path)) return 1;
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        return 0;
+    }
+
+    DIR * dir = opendir(path);
+    if(!dir)
+    {
+        print_msg(MSG_ERROR, "could not open directory '%s'\n", path);
+        return 0;
+    }
+
+    char ** names = NULL;
+    int name_count = 0, name_capacity = 0, ret = 1;
+    struct dirent * entry;
+    while((entry = readdir(dir)))
+    {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        if(name_count >= name_capacity)
         {
-            if(((x + shift) % x_rep) == 0)
+            name_capacity = (name_capacity) ? name_capacity * 2 : 64;
+            char ** new_names = realloc(names, sizeof(char *) * name_capacity);
+            if(!new_names) goto malloc_error;
+            names = new_names;
+        }
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        names[name_count] = malloc(len);
+        if(!names[name_count]) goto malloc_error;
+        snprintf(names[name_count++], len, "%s/%s", path, entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, name_count, sizeof(char *), compare_names);
+    for(int i = 0; i < name_count; i++)
+    {
+        if(ret) ret = batch_collect(batch, names[i], 1);
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+
+malloc_error:
+
+    print_msg(MSG_ERROR, "could not allocate memory\n");
+    closedir(dir);
+    for(int i = 0; i < name_count; i++) free(names[i]);
+    free(names);
+    return 0;
+}
+
+/* info blocks of the clips, workers take the next unparsed one until none is left */
+static void * batch_parse(void * arg)
+{
+    struct batch * batch = arg;
+    int i;
+    while((i = __atomic_fetch_add(&batch->next_clip, 1, __ATOMIC_RELAXED)) < batch->clip_count)
+    {
+        batch->clips[i].ret = mlv_parse_info(&batch->clips[i].info, batch->clips[i].file_name);
+    }
+    return NULL;
+}
+
+/* camera, video mode and pattern of a parsed clip the way a single '.mlv' input resolves them, returns the group index or -1 */
+static int batch_resolve(struct batch * batch, struct batch_clip * clip)
+{
+    switch(clip->ret)
+    {
+        case MLV_ERR_OPEN:
+            print_msg(MSG_ERROR, "file '%s' not found\n", clip->file_name);
+            return -1;
+        case MLV_ERR_READ:
+            print_msg(MSG_ERROR, "could not read from '%s'\n", clip->file_name);
+            return -1;
+        case MLV_ERR_FORMAT:
+            print_msg(MSG_ERROR, "'%s' is not a valid MLV\n", clip->file_name);
+            return -1;
+        case 0:
+            print_msg(MSG_ERROR, "'%s' does not have all needed info blocks\n", clip->file_name);
+            return -1;
+    }
+
+    file_hdr = clip->info.file_hdr;
+    rawi_hdr = clip->info.rawi_hdr;
+    rawc_hdr = (clip->info.rawc_found) ? clip->info.rawc_hdr : (mlv_rawc_hdr_t){ 0 };
+    idnt_hdr = clip->info.idnt_hdr;
+
+    uint32_t camera = get_camera(GET_MLV, cam_name);
+    if(!camera)
+    {
+        print_msg(MSG_ERROR, "'%s' is from unsupported camera '%s'\n", clip->file_name, idnt_hdr.cameraName);
+        return -1;
+    }
+
+    /* unified mode is switched on per clip for restricted lossless raw */
+    int cli_unified_mode = unified_mode;
+    if( (file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) && (rawi_hdr.white_level < 15000) ) unified_mode = FPM_UNIFIED;
+    enum fpm_video_mode video_mode = get_video_mode(GET_MLV, vid_mode);
+    unified_mode = cli_unified_mode;
+
+    const fpm_pattern_t * pattern = (video_mode != FPM_MV_NONE) ? fpm_find_pattern(fpm_ctx, video_mode, camera) : NULL;
+    if(!pattern)
+    {
+        print_msg(MSG_ERROR, "'%s' has no focus pixel pattern for its camera and video mode\n", clip->file_name);
+        return -1;
+    }
+
+    for(int i = 0; i < batch->group_count; i++)
+    {
+        struct batch_group * group = &batch->groups[i];
+        if(group->pattern == pattern && group->video_mode == video_mode && group->idnt_hdr.cameraModel == idnt_hdr.cameraModel &&
+           group->rawi_hdr.width == rawi_hdr.width && group->rawi_hdr.height == rawi_hdr.height && group->rawi_hdr.crop == rawi_hdr.crop &&
+           (video_mode != FPM_MV_SENSOR || same_geometry(&group->rawc_hdr, &rawc_hdr)))
+        {
+            group->clip_count++;
+            return i;
+        }
+    }
+
+    struct batch_group * groups = realloc(batch->groups, sizeof(struct batch_group) * (batch->group_count + 1));
+    if(!groups)
+    {
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        return -1;
+    }
+    batch->groups = groups;
+    struct batch_group * group = &batch->groups[batch->group_count];
+    group->idnt_hdr = idnt_hdr;
+    group->rawi_hdr = rawi_hdr;
+    group->rawc_hdr = rawc_hdr;
+    group->video_mode = video_mode;
+    group->pattern = pattern;
+    group->clip_count = 1;
+    return batch->group_count++;
+}
+
+/* MLVFS named map file in the directory of the clip */
+static char * batch_output_filename(const char * clip_name)
+{
+    char * map_name = get_output_filename(NULL);
+    if(!map_name) return NULL;
+
+    const char * slash = strrchr(clip_name, '/');
+#if defined(__WIN32)
+    const char * backslash = strrchr(clip_name, '\\');
+    if(backslash > slash) slash = backslash;
+#endif
+    size_t dir_len = (slash) ? slash - clip_name + 1 : 0;
+    char * output_filename = malloc(dir_len + strlen(map_name) + 1);
+    if(output_filename)
+    {
+        memcpy(output_filename, clip_name, dir_len);
+        strcpy(output_filename + dir_len, map_name);
+    }
+    free(map_name);
+    return output_filename;
+}
+
+/* one map for every distinct camera, resolution and video mode of the clips, written once and linked next to every clip */
+static int batch_generate(char ** paths, int path_count)
+{
+    struct batch batch = { 0 };
+    int generated = 0, cached = 0, linked = 0, unresolved = 0, failed = 0;
+
+    for(int i = 0; i < path_count; i++)
+    {
+        if(!batch_collect(&batch, paths[i], 0)) failed++;
+    }
+    if(!batch.clip_count)
+    {
+        print_msg(MSG_ERROR, "no MLV files found\n");
+        goto bailout;
+    }
+
+    /* info blocks are read in parallel */
+    int thread_count = MIN(get_cpu_count(), batch.clip_count);
+    pthread_t * threads = calloc(thread_count, sizeof(pthread_t));
+    int * threaded = calloc(thread_count, sizeof(int));
+    if(!threads || !threaded)
+    {
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        free(threads);
+        free(threaded);
+        goto bailout;
+    }
+    for(int i = 1; i < thread_count; i++) threaded[i] = !pthread_create(&threads[i], NULL, batch_parse, &batch);
+    batch_parse(&batch);
+    for(int i = 1; i < thread_count; i++) if(threaded[i]) pthread_join(threads[i], NULL);
+    free(threads);
+    free(threaded);
+
+    for(int i = 0; i < batch.clip_count; i++)
+    {
+        struct batch_clip * clip = &batch.clips[i];
+        clip->group = batch_resolve(&batch, clip);
+        if(clip->group >= 0)
+        {
+            clip->output_filename = batch_output_filename(clip->file_name);
+            if(clip->output_filename) continue;
+            print_msg(MSG_ERROR, "could not allocate memory\n");
+            batch.groups[clip->group].clip_count--;
+            clip->group = -1;
+        }
+        unresolved++;
+        failed++;
+    }
+
+    print_msg(MSG_INFO, "%d clips use %d focus pixel maps\n\n", batch.clip_count - unresolved, batch.group_count);
+
+    for(int g = 0; g < batch.group_count; g++)
+    {
+        struct batch_group * group = &batch.groups[g];
+        idnt_hdr = group->idnt_hdr;
+        rawi_hdr = group->rawi_hdr;
+        rawc_hdr = group->rawc_hdr;
+        print_msg(MSG_INFO, "Camera     : %s (0x%X)\nVideo mode : %dx%d '%s' %smode, %d clips\n\n", idnt_hdr.cameraName, idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height,
+                  fpm_video_mode_name(group->video_mode), FPM_IS_UNIFIED(group->video_mode) ? "lossless " : "", group->clip_count);
+
+        const char * map_filename = NULL;
+        for(int i = 0; i < batch.clip_count; i++)
+        {
+            struct batch_clip * clip = &batch.clips[i];
+            if(clip->group != g) continue;
+
+            /* clips in one directory share the map, different maps of the same name are not overwritten */
+            int taken = 0;
+            for(int k = 0; k < batch.clip_count && !taken; k++)
+            {
+                if(batch.clips[k].written && !strcmp(batch.clips[k].output_filename, clip->output_filename)) taken = (batch.clips[k].group == g) ? 1 : -1;
+            }
+            if(taken > 0) continue;
+            if(taken < 0)
+            {
+                print_msg(MSG_ERROR, "'%s' of '%s' is already saved for a different video mode, skipped\n", clip->output_filename, clip->file_name);
+                failed++;
+                continue;
+            }
+
+            if(!map_filename)
             {
-                add_pixel_to_map(map, x, y);
+                char cache_entry[1024] = { 0 };
+                if(cache_dir && !cache_entry_name(cache_entry, sizeof(cache_entry), group->pattern, group->video_mode, clip->output_filename)) cache_entry[0] = 0;
+
+                if(cache_entry[0] && cache_fetch(cache_entry, clip->output_filename))
+                {
+                    cached++;
+                }
+                else
+                {
+                    fpm_map_t * map = NULL;
+                    int ret = generate_map(&map, group->pattern) && save_pixel_map(map, clip->output_filename);
+                    fpm_map_free(map);
+                    if(!ret)
+                    {
+                        failed++;
+                        break;
+                    }
+                    if(cache_entry[0]) cache_store(cache_entry, clip->output_filename);
+                    generated++;
+                }
+                map_filename = clip->output_filename;
             }
+            else
+            {
+                remove(clip->output_filename);
+                if(!link_or_copy(map_filename, clip->output_filename))
+                {
+                    print_msg(MSG_ERROR, "could not write to '%s'\n", clip->output_filename);
+                    failed++;
+                    continue;
+                }
+                print_msg(MSG_INFO, "Focus pixel map '%s' linked to '%s'\n", clip->output_filename, map_filename);
+                linked++;
+            }
+            clip->written = 1;
         }
+        print_msg(MSG_INFO, "\n");
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
+
+    print_msg(MSG_INFO, "%d maps generated, %d taken from cache, %d linked, %d failed\n", generated, cached, linked, failed);
+
+bailout:
+
+    for(int i = 0; i < batch.clip_count; i++)
+    {
+        free(batch.clips[i].file_name);
+        free(batch.clips[i].output_filename);
+    }
+    free(batch.clips);
+    free(batch.groups);
+    return (batch.clip_count && !failed);
 }
 
+/* end of batch mode **************************************************************************************************/
+
+/* frame pipeline *****************************************************************************************************/
+
 /*
-  mv1080() function
-  Draw the focus pixel pattern for mv1080 video mode.
+  Clips are streamed block by block: the main thread reads blocks into a ring of slots, workers process the
+  frames in any order and, if there is an output, a writer thread writes the slots back in file order. At most
+  'slot_count' blocks are in memory at a time. LJ92 frames are decoded by the workers and handed on packed like
+  uncompressed ones. A worker may replace the block of its frame, blocks left empty are not written.
 */
-static void mv1080(struct pixel_map * map, int pattern)
+enum slot_state { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+struct frame_slot
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
+    uint8_t * data;             /* whole block */
+    size_t size;
+    size_t capacity;
+    int state;
+};
 
-    int fp_start = 459;
-    int fp_end = 755;
-    int x_rep = 8;
-    int y_rep = 10;
-    
-    if(pattern == PATTERN_100D)
+struct frame_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct frame_slot * slots;
+    int slot_count;
+    uint64_t read_count;        /* blocks read, slot of block n is n % slot_count */
+    uint64_t taken_count;       /* blocks taken by the workers */
+    uint64_t written_count;
+    int reading_done;
+    int failed;
+    int (*process)(void * arg, int worker, struct frame_slot * slot, uint8_t * frame, size_t size);   /* for every VIDF frame, returns 0 or an fpm_error */
+    void * arg;
+    int worker_count;           /* workers started, numbered from 0 */
+    uint32_t lossless_pixels;   /* pixels of LJ92 frames, 0 for uncompressed clips */
+    uint32_t bits_per_pixel;    /* of LJ92 frames once packed */
+    FILE * out;                 /* NULL if nothing is written */
+    char * output_filename;
+    uint32_t frames;
+    uint32_t skipped;           /* VIDF blocks without a complete frame, copied as they are */
+    int drop_skipped;           /* or left out of the output */
+    uint32_t video_frames;      /* VIDF and AUDF blocks written */
+    uint32_t audio_frames;
+};
+
+/* frames of the clip of the global headers are LJ92 compressed or not */
+static void pipeline_set_clip(struct frame_pipeline * p)
+{
+    int lossless = (file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) != 0;
+    p->lossless_pixels = (lossless) ? rawi_hdr.width * rawi_hdr.height : 0;
+    p->bits_per_pixel = rawi_hdr.bits_per_pixel;
+}
+
+/* read the next block into 'slot', returns 0 at the end of the file and -1 on error */
+static int read_block(FILE * in, struct frame_slot * slot)
+{
+    mlv_hdr_t hdr;
+    size_t len = fread(&hdr, 1, sizeof(mlv_hdr_t), in);
+    if(!len && feof(in)) return 0;
+    if(len != sizeof(mlv_hdr_t) || hdr.blockSize < sizeof(mlv_hdr_t)) return -1;
+
+    if(hdr.blockSize > slot->capacity)
     {
-        fp_start = 119;
-        fp_end = 1095;
+        uint8_t * data = realloc(slot->data, hdr.blockSize);
+        if(!data) return -1;
+        slot->data = data;
+        slot->capacity = hdr.blockSize;
     }
+    memcpy(slot->data, &hdr, sizeof(mlv_hdr_t));
+    if(fread(slot->data + sizeof(mlv_hdr_t), hdr.blockSize - sizeof(mlv_hdr_t), 1, in) != 1 && hdr.blockSize > sizeof(mlv_hdr_t)) return -1;
+    slot->size = hdr.blockSize;
+    return 1;
+}
 
-    for(int y = fp_start; y <= fp_end; y++)
+/* decoding buffers of a worker */
+struct lossless_frame
+{
+    uint16_t * pixels;
+    uint8_t * packed;
+};
+
+/* process the frame of a VIDF block, returns 1 if done, 0 for other blocks and an fpm_error otherwise */
+static int process_block(struct frame_pipeline * p, int worker, struct frame_slot * slot, struct lossless_frame * lossless)
+{
+    if(slot->size < sizeof(mlv_vidf_hdr_t) || mlv_block_type(slot->data) != BT_VIDF) return 0;
+
+    mlv_vidf_hdr_t vidf;
+    memcpy(&vidf, slot->data, sizeof(mlv_vidf_hdr_t));
+    uint64_t offset = sizeof(mlv_vidf_hdr_t) + (uint64_t)vidf.frameSpace;
+    if(offset > slot->size) return FPM_ERR_FORMAT;
+    uint8_t * frame = slot->data + offset;
+    size_t size = slot->size - offset;
+
+    if(p->lossless_pixels)
     {
-        if(((y + 0) % y_rep) == 0) shift=0;
-        else if(((y + 1) % y_rep) == 0) shift = 1;
-        else if(((y + 5) % y_rep) == 0) shift = 5;
-        else if(((y + 6) % y_rep) == 0) shift = 4;
-        else continue;
-    
-        for(int x = 72; x < raw_width; x++)
+        mlv_lj92_info_t info;
+        if(mlv_lj92_info(frame, size, &info) || (uint64_t)info.width * info.height * info.components != p->lossless_pixels) return FPM_ERR_FORMAT;
+        if(mlv_lj92_decode(frame, size, lossless->pixels, p->lossless_pixels)) return FPM_ERR_FORMAT;
+
+        /* samples of more bits than the clip claims are clipped */
+        if(info.bits_per_sample > p->bits_per_pixel)
+        {
+            uint16_t max = (1 << p->bits_per_pixel) - 1;
+            for(uint32_t i = 0; i < p->lossless_pixels; i++) if(lossless->pixels[i] > max) lossless->pixels[i] = max;
+        }
+        mlv_raw_pack(lossless->packed, 0, p->lossless_pixels, p->bits_per_pixel, lossless->pixels);
+        frame = lossless->packed;
+        size = mlv_raw_frame_size(p->lossless_pixels, 1, p->bits_per_pixel);
+    }
+
+    int ret = p->process(p->arg, worker, slot, frame, size);
+    return (ret) ? ret : 1;
+}
+
+static void * pipeline_worker(void * arg)
+{
+    struct frame_pipeline * p = arg;
+    struct lossless_frame lossless = { NULL, NULL };
+    if(p->lossless_pixels)
+    {
+        lossless.pixels = malloc(sizeof(uint16_t) * p->lossless_pixels);
+        lossless.packed = malloc(mlv_raw_frame_size(p->lossless_pixels, 1, p->bits_per_pixel));
+    }
+
+    pthread_mutex_lock(&p->lock);
+    int worker = p->worker_count++;
+    if(p->lossless_pixels && (!lossless.pixels || !lossless.packed) && !p->failed)
+    {
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        p->failed = 1;
+    }
+    for(;;)
+    {
+        while(p->taken_count == p->read_count && !p->reading_done && !p->failed) pthread_cond_wait(&p->changed, &p->lock);
+        if(p->taken_count == p->read_count || p->failed) break;
+
+        struct frame_slot * slot = &p->slots[p->taken_count++ % p->slot_count];
+        pthread_mutex_unlock(&p->lock);
+        int ret = process_block(p, worker, slot, &lossless);
+        pthread_mutex_lock(&p->lock);
+
+        if(ret > 0) p->frames++;
+        else if(ret == FPM_ERR_FORMAT)
         {
-            if(((x + shift) % x_rep) == 0)
+            p->skipped++;
+            if(p->drop_skipped) slot->size = 0;
+        }
+        else if(ret < 0 && !p->failed)
+        {
+            print_fpm_error(ret, NULL);
+            p->failed = 1;
+        }
+        slot->state = (p->out) ? SLOT_DONE : SLOT_FREE;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(lossless.pixels);
+    free(lossless.packed);
+    return NULL;
+}
+
+/* write the blocks back in file order as they are done */
+static void * pipeline_writer(void * arg)
+{
+    struct frame_pipeline * p = arg;
+    pthread_mutex_lock(&p->lock);
+    for(;;)
+    {
+        struct frame_slot * slot = &p->slots[p->written_count % p->slot_count];
+        while(!(p->written_count < p->read_count && slot->state == SLOT_DONE) && !(p->reading_done && p->written_count == p->read_count) && !p->failed)
+        {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if(p->failed || p->written_count == p->read_count) break;
+
+        pthread_mutex_unlock(&p->lock);
+        int ret = !slot->size || fwrite(slot->data, slot->size, 1, p->out) == 1;
+        pthread_mutex_lock(&p->lock);
+
+        if(slot->size && mlv_block_type(slot->data) == BT_VIDF) p->video_frames++;
+        else if(slot->size && mlv_block_type(slot->data) == BT_AUDF) p->audio_frames++;
+
+        if(!ret)
+        {
+            print_msg(MSG_ERROR, "could not write to '%s'\n", p->output_filename);
+            p->failed = 1;
+        }
+        slot->state = SLOT_FREE;
+        p->written_count++;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* stream all blocks of 'in' through 'p', returns 1 on success */
+static int run_pipeline(struct frame_pipeline * p, FILE * in, const char * input_filename)
+{
+    /* two blocks in flight per worker keep them busy while the reader and writer wait for the disk */
+    int thread_count = get_cpu_count();
+    p->slot_count = thread_count * 2 + 2;
+    p->slots = calloc(p->slot_count, sizeof(struct frame_slot));
+    pthread_t * threads = calloc(thread_count + 1, sizeof(pthread_t));
+    int * threaded = calloc(thread_count + 1, sizeof(int));
+    if(!p->slots || !threads || !threaded)
+    {
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        free(p->slots);
+        free(threads);
+        free(threaded);
+        p->slots = NULL;
+        return 0;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    /* the writer is thread 0 */
+    threaded[0] = (p->out) ? !pthread_create(&threads[0], NULL, pipeline_writer, p) : 1;
+    for(int i = 1; i <= thread_count && threaded[0]; i++) threaded[i] = !pthread_create(&threads[i], NULL, pipeline_worker, p);
+    if(!threaded[0] || !threaded[1])
+    {
+        print_msg(MSG_ERROR, "could not start threads\n");
+        p->failed = 1;
+    }
+    if(!p->out) threaded[0] = 0;
+
+    uint64_t offset = 0;
+    pthread_mutex_lock(&p->lock);
+    while(!p->failed)
+    {
+        struct frame_slot * slot = &p->slots[p->read_count % p->slot_count];
+        while(slot->state != SLOT_FREE && !p->failed) pthread_cond_wait(&p->changed, &p->lock);
+        if(p->failed) break;
+        pthread_mutex_unlock(&p->lock);
+        int read_ret = read_block(in, slot);
+        pthread_mutex_lock(&p->lock);
+
+        if(read_ret <= 0)
+        {
+            if(read_ret < 0)
             {
-                add_pixel_to_map(map, x, y);
+                print_msg(MSG_ERROR, "'%s' block at offset %" PRIu64 " could not be read\n", input_filename, offset);
+                p->failed = 1;
             }
+            break;
         }
+        offset += slot->size;
+        slot->state = SLOT_READ;
+        p->read_count++;
+        pthread_cond_broadcast(&p->changed);
+    }
+    p->reading_done = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+
+    for(int i = 0; i <= thread_count; i++) if(threaded[i]) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+
+    for(int i = 0; i < p->slot_count; i++) free(p->slots[i].data);
+    free(p->slots);
+    free(threads);
+    free(threaded);
+    p->slots = NULL;
+    return !p->failed;
+}
+
+static uint64_t time_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* LJ92 predictor of transcoded frames, the previous pixel of the same color */
+#define TRANSCODE_PREDICTOR     1
+
+struct transcode_job
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t bits_per_pixel;
+    uint32_t components;        /* a row is split into this many interleaved components, one per color */
+    uint16_t ** pixels;         /* one per worker, made on its first frame */
+};
+
+/* replace the VIDF block of 'slot' by one with the frame LJ92 compressed */
+static int transcode_frame(void * arg, int worker, struct frame_slot * slot, uint8_t * frame, size_t size)
+{
+    struct transcode_job * job = arg;
+    uint32_t pixel_count = job->width * job->height;
+    if(size < mlv_raw_frame_size(job->width, job->height, job->bits_per_pixel)) return FPM_ERR_FORMAT;
+    if(!job->pixels[worker] && !(job->pixels[worker] = malloc(sizeof(uint16_t) * pixel_count))) return FPM_ERR_MEMORY;
+    mlv_raw_unpack(frame, 0, pixel_count, job->bits_per_pixel, job->pixels[worker]);
+
+    /* the frame is compressed over the old one, the slot only grows if that does not fit */
+    mlv_vidf_hdr_t vidf;
+    memcpy(&vidf, slot->data, sizeof(mlv_vidf_hdr_t));
+    uint32_t width = job->width / job->components;
+    size_t encoded = mlv_lj92_encode(job->pixels[worker], width, job->height, job->components, job->bits_per_pixel, TRANSCODE_PREDICTOR,
+                                     slot->data + sizeof(mlv_vidf_hdr_t), slot->capacity - sizeof(mlv_vidf_hdr_t));
+    if(!encoded)
+    {
+        size_t capacity = sizeof(mlv_vidf_hdr_t) + mlv_lj92_max_size(width, job->height, job->components);
+        uint8_t * data = realloc(slot->data, capacity);
+        if(!data) return FPM_ERR_MEMORY;
+        slot->data = data;
+        slot->capacity = capacity;
+        encoded = mlv_lj92_encode(job->pixels[worker], width, job->height, job->components, job->bits_per_pixel, TRANSCODE_PREDICTOR,
+                                  slot->data + sizeof(mlv_vidf_hdr_t), slot->capacity - sizeof(mlv_vidf_hdr_t));
+        if(!encoded) return FPM_ERR_FORMAT;
+    }
+
+    /* blocks stay 4 byte aligned, the padding is zero */
+    size_t block_size = (sizeof(mlv_vidf_hdr_t) + encoded + 3) & ~(size_t)3;
+    memset(slot->data + sizeof(mlv_vidf_hdr_t) + encoded, 0, block_size - sizeof(mlv_vidf_hdr_t) - encoded);
+    vidf.blockSize = block_size;
+    vidf.frameSpace = 0;
+    memcpy(slot->data, &vidf, sizeof(mlv_vidf_hdr_t));
+    slot->size = block_size;
+    return 0;
+}
+
+/* end of frame pipeline **********************************************************************************************/
+
+/* dark frames ********************************************************************************************************/
+
+/* typical deviations off the median dark level a hot or dead pixel is */
+#define DARK_SIGMA          8.0
+
+struct dark_job
+{
+    fpm_dark_t * dark;
+    fpm_dark_acc_t ** accs;     /* one per worker, made on its first frame */
+};
+
+static int dark_frame(void * arg, int worker, struct frame_slot * slot, uint8_t * frame, size_t size)
+{
+    struct dark_job * job = arg;
+    if(!job->accs[worker])
+    {
+        int ret = fpm_dark_acc_new(job->dark, &job->accs[worker]);
+        if(ret) return ret;
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
+    return fpm_dark_add_frame(job->accs[worker], frame, size);
 }
 
-/*
-  mv1080crop() function
-  Draw the focus pixel pattern for mv1080crop video mode.
-*/
-static void mv1080crop(struct pixel_map * map, int pattern)
+/* append the hot, dead and stuck pixels of a lens cap clip as a pass of 'map', the clip must match the frame of the global headers */
+static int add_dark_pass(fpm_map_t * map, char * dark_filename)
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
+    mlv_file_hdr_t map_file_hdr = file_hdr;
+    mlv_rawi_hdr_t map_rawi_hdr = rawi_hdr;
+    mlv_rawc_hdr_t map_rawc_hdr = rawc_hdr;
+    mlv_idnt_hdr_t map_idnt_hdr = idnt_hdr;
+    struct dark_job job = { NULL, NULL };
+    fpm_map_t * defects = NULL;
+    FILE * in = NULL;
+    int thread_count = get_cpu_count();
+    int ret = 0;
 
-    int fp_start = 121;
-    int fp_end = 1013;
-    int x_rep = 24;
-    int y_rep = 60;
-    
-    if(pattern == PATTERN_100D)
+    print_msg(MSG_INFO, "\n");
+    int parse_ret = mlv_parse_file(dark_filename);
+    if(parse_ret == 0) print_msg(MSG_ERROR, "'%s' does not have all needed info blocks\n", dark_filename);
+    if(parse_ret != 1) goto bailout;
+
+    if(rawi_hdr.width != map_rawi_hdr.width || rawi_hdr.height != map_rawi_hdr.height)
+    {
+        print_msg(MSG_ERROR, "dark frames are %ux%u, the map is %ux%u\n", rawi_hdr.width, rawi_hdr.height, map_rawi_hdr.width, map_rawi_hdr.height);
+        goto bailout;
+    }
+    if(map_idnt_hdr.cameraModel && idnt_hdr.cameraModel != map_idnt_hdr.cameraModel)
+    {
+        print_msg(MSG_INFO, "Dark frames are from camera 0x%X, the map is for 0x%X\n", idnt_hdr.cameraModel, map_idnt_hdr.cameraModel);
+    }
+
+    int dark_ret = fpm_dark_new(fpm_ctx, &job.dark, rawi_hdr.width, rawi_hdr.height, rawi_hdr.bits_per_pixel);
+    if(dark_ret == FPM_ERR_FORMAT)
+    {
+        print_msg(MSG_ERROR, "%d bits per pixel are not supported\n", rawi_hdr.bits_per_pixel);
+        goto bailout;
+    }
+    else if(dark_ret)
+    {
+        print_fpm_error(dark_ret, dark_filename);
+        goto bailout;
+    }
+    job.accs = calloc(thread_count, sizeof(fpm_dark_acc_t *));
+    in = fopen(dark_filename, "rb");
+    if(!job.accs || !in)
+    {
+        print_msg(MSG_ERROR, (!in) ? "could not read from '%s'\n" : "could not allocate memory\n", dark_filename);
+        goto bailout;
+    }
+
+    struct frame_pipeline p;
+    memset(&p, 0, sizeof(struct frame_pipeline));
+    p.process = dark_frame;
+    pipeline_set_clip(&p);
+    p.arg = &job;
+    int run_ret = run_pipeline(&p, in, dark_filename);
+
+    /* the rest of every worker's frames go to the dark */
+    for(int i = 0; i < thread_count; i++) fpm_dark_acc_free(job.accs[i]);
+    free(job.accs);
+    job.accs = NULL;
+    if(!run_ret) goto bailout;
+
+    uint32_t frames = fpm_dark_frame_count(job.dark);
+    if(!frames)
+    {
+        print_msg(MSG_ERROR, "no dark frames in '%s'\n", dark_filename);
+        goto bailout;
+    }
+    int map_ret = fpm_dark_map(job.dark, &defects, DARK_SIGMA, fpm_map_info(map));
+    if(map_ret)
+    {
+        print_fpm_error(map_ret, NULL);
+        goto bailout;
+    }
+
+    uint32_t count = fpm_map_pixel_count(defects, 0);
+    if(!count)
+    {
+        print_msg(MSG_INFO, "No hot, dead or stuck pixels in %u dark frames\n\n", frames);
+        ret = 1;
+        goto bailout;
+    }
+    int append_ret = fpm_map_append(map, defects);
+    if(append_ret)
+    {
+        print_fpm_error(append_ret, NULL);
+        goto bailout;
+    }
+    defects = NULL;
+    print_msg(MSG_INFO, "%u hot, dead or stuck pixels in %u dark frames added as pass %d\n\n", count, frames, fpm_map_pass_count(map));
+    ret = 1;
+
+bailout:
+
+    if(in) fclose(in);
+    free(job.accs);
+    fpm_map_free(defects);
+    fpm_dark_free(job.dark);
+    file_hdr = map_file_hdr;
+    rawi_hdr = map_rawi_hdr;
+    rawc_hdr = map_rawc_hdr;
+    idnt_hdr = map_idnt_hdr;
+    return ret;
+}
+
+/* end of dark frames *************************************************************************************************/
+
+/* fix mode ***********************************************************************************************************/
+
+/* '<name><suffix><ext>' next to the clip */
+static char * clip_output_filename(const char * input_filename, const char * suffix)
+{
+    const char * ext = strrchr(input_filename, '.');
+    const char * slash = strrchr(input_filename, SLASH);
+    if(!ext || (slash && ext < slash)) ext = input_filename + strlen(input_filename);
+
+    char * output_filename = malloc(strlen(input_filename) + strlen(suffix) + 1);
+    if(output_filename) sprintf(output_filename, "%.*s%s%s", (int)(ext - input_filename), input_filename, suffix, ext);
+    return output_filename;
+}
+
+struct fix_job
+{
+    fpm_fixer_t * fixer;
+    struct transcode_job * lossless;    /* LJ92 clips get their fixed frames compressed again, NULL otherwise */
+};
+
+static int fix_frame(void * arg, int worker, struct frame_slot * slot, uint8_t * frame, size_t size)
+{
+    struct fix_job * job = arg;
+    int ret = fpm_fix_frame(job->fixer, frame, size);
+    if(ret || !job->lossless) return ret;
+    return transcode_frame(job->lossless, worker, slot, frame, size);
+}
+
+/* write a copy of the clip with the focus pixels of all frames interpolated, the map is generated for the clip like for a single '.mlv' input */
+static int fix_mlv(char * input_filename, char * output_filename)
+{
+    fpm_map_t * map = NULL;
+    fpm_fixer_t * fixer = NULL;
+    FILE * in = NULL;
+    struct frame_pipeline p;
+    struct fix_job job = { NULL, NULL };
+    struct transcode_job lossless;
+    int thread_count = get_cpu_count();
+    int ret = 0;
+    memset(&p, 0, sizeof(struct frame_pipeline));
+    memset(&lossless, 0, sizeof(struct transcode_job));
+
+    int parse_ret = mlv_parse_file(input_filename);
+    if(parse_ret == 0) print_msg(MSG_ERROR, "MLV file does not have all needed info blocks\n");
+    if(parse_ret != 1) return 0;
+
+    uint32_t camera = get_camera(GET_MLV, cam_name);
+    if(!camera)
+    {
+        print_msg(MSG_ERROR, "wrong MLV, unsupported camera '%s'\n", idnt_hdr.cameraName);
+        return 0;
+    }
+    enum fpm_video_mode video_mode = get_video_mode(GET_MLV, vid_mode);
+    const fpm_pattern_t * pattern = (video_mode != FPM_MV_NONE) ? fpm_find_pattern(fpm_ctx, video_mode, camera) : NULL;
+    if(!pattern)
+    {
+        print_msg(MSG_ERROR, "no focus pixel pattern for this camera and video mode\n");
+        return 0;
+    }
+    print_msg(MSG_INFO, "Using MLV info block values\n\nCamera     : %s (0x%X)\nVideo mode : %dx%d '%s' mode, %d bit\n\n", idnt_hdr.cameraName, idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height,
+              fpm_video_mode_name(video_mode), rawi_hdr.bits_per_pixel);
+
+    if(!generate_map(&map, pattern)) goto bailout;
+    if(dark_file && !add_dark_pass(map, dark_file)) goto bailout;
+    int fixer_ret = fpm_fixer_new(fpm_ctx, &fixer, map, rawi_hdr.bits_per_pixel, rawi_hdr.black_level, rawi_hdr.white_level);
+    if(fixer_ret == FPM_ERR_FORMAT)
+    {
+        print_msg(MSG_ERROR, "%d bits per pixel are not supported\n", rawi_hdr.bits_per_pixel);
+        goto bailout;
+    }
+    else if(fixer_ret)
+    {
+        print_fpm_error(fixer_ret, input_filename);
+        goto bailout;
+    }
+
+    job.fixer = fixer;
+
+    /* the pipeline decodes LJ92 frames, fixed they are compressed again like '-t' does */
+    if(file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
+    {
+        lossless.width = rawi_hdr.width;
+        lossless.height = rawi_hdr.height;
+        lossless.bits_per_pixel = rawi_hdr.bits_per_pixel;
+        lossless.components = (lossless.width % 2) ? 1 : 2;
+        lossless.pixels = calloc(thread_count, sizeof(uint16_t *));
+        if(!lossless.pixels)
+        {
+            print_msg(MSG_ERROR, "could not allocate memory\n");
+            goto bailout;
+        }
+        job.lossless = &lossless;
+    }
+
+    in = fopen(input_filename, "rb");
+    if(!in)
+    {
+        print_msg(MSG_ERROR, "could not read from '%s'\n", input_filename);
+        goto bailout;
+    }
+
+    /* writing the clip onto itself would destroy it while it is read */
+    struct stat in_attr, out_attr;
+    if(!fstat(fileno(in), &in_attr) && !stat(output_filename, &out_attr) && in_attr.st_dev == out_attr.st_dev && in_attr.st_ino == out_attr.st_ino)
+    {
+        print_msg(MSG_ERROR, "output '%s' is the input file\n", output_filename);
+        goto bailout;
+    }
+
+    p.out = open_output(output_filename, "wb");
+    if(!p.out)
+    {
+        print_msg(MSG_ERROR, "could not open '%s'\n", output_filename);
+        goto bailout;
+    }
+    p.process = fix_frame;
+    pipeline_set_clip(&p);
+    p.arg = &job;
+    p.output_filename = output_filename;
+
+    print_msg(MSG_INFO, "Fixing %u pixels per frame of '%s' into '%s'\n", fpm_fixer_pixel_count(fixer), input_filename, output_filename);
+    uint64_t start = time_now_ns();
+    int run_ret = run_pipeline(&p, in, input_filename);
+
+    if(fclose(p.out) && run_ret)
+    {
+        print_msg(MSG_ERROR, "could not write to '%s'\n", output_filename);
+        run_ret = 0;
+    }
+    p.out = NULL;
+    if(!run_ret)
+    {
+        remove(output_filename);
+        goto bailout;
+    }
+
+    double seconds = (time_now_ns() - start) / 1e9;
+    if(p.skipped) print_msg(MSG_INFO, "%u VIDF blocks without a complete frame copied unchanged\n", p.skipped);
+    print_msg(MSG_INFO, "%u frames fixed in %.2f s (%.0f fps)\n", p.frames, seconds, (seconds > 0) ? p.frames / seconds : 0.0);
+    ret = 1;
+
+bailout:
+
+    if(p.out) fclose(p.out);
+    if(in) fclose(in);
+    if(lossless.pixels) for(int i = 0; i < thread_count; i++) free(lossless.pixels[i]);
+    free(lossless.pixels);
+    fpm_fixer_free(fixer);
+    fpm_map_free(map);
+    return ret;
+}
+
+/* end of fix mode ****************************************************************************************************/
+
+/* transcode mode *****************************************************************************************************/
+
+/* write a copy of the uncompressed clip with all frames LJ92 compressed, frame counts of the header are taken from the blocks written */
+static int transcode_mlv(char * input_filename, char * output_filename)
+{
+    struct transcode_job job;
+    FILE * in = NULL;
+    struct frame_pipeline p;
+    int thread_count = get_cpu_count();
+    int ret = 0;
+    memset(&p, 0, sizeof(struct frame_pipeline));
+    memset(&job, 0, sizeof(struct transcode_job));
+
+    int parse_ret = mlv_parse_file(input_filename);
+    if(parse_ret == 0) print_msg(MSG_ERROR, "MLV file does not have all needed info blocks\n");
+    if(parse_ret != 1) return 0;
+
+    if(file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
+    {
+        print_msg(MSG_ERROR, "'%s' is lossless compressed already\n", input_filename);
+        return 0;
+    }
+    if(rawi_hdr.bits_per_pixel < 2 || rawi_hdr.bits_per_pixel > 16 || !rawi_hdr.width || !rawi_hdr.height)
+    {
+        print_msg(MSG_ERROR, "%dx%d frames of %d bits per pixel are not supported\n", rawi_hdr.width, rawi_hdr.height, rawi_hdr.bits_per_pixel);
+        return 0;
+    }
+    job.width = rawi_hdr.width;
+    job.height = rawi_hdr.height;
+    job.bits_per_pixel = rawi_hdr.bits_per_pixel;
+    job.components = (job.width % 2) ? 1 : 2;
+    job.pixels = calloc(thread_count, sizeof(uint16_t *));
+    if(!job.pixels)
     {
-        fp_start = 29;
-        fp_end = 1057;
-        x_rep = 12;
-        y_rep = 6;
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        return 0;
     }
 
-    for(int y = fp_start; y <= fp_end; y++)
+    in = fopen(input_filename, "rb");
+    if(!in)
     {
-        switch(pattern)
-        {
-            case PATTERN_EOSM:
-            case PATTERN_650D:
-            case PATTERN_700D:
-                if(((y + 7) % y_rep) == 0 ) shift = 19;
-                else if(((y + 11) % y_rep) == 0 ) shift = 13;
-                else if(((y + 12) % y_rep) == 0 ) shift = 18;
-                else if(((y + 14) % y_rep) == 0 ) shift = 12;
-                else if(((y + 26) % y_rep) == 0 ) shift = 0;
-                else if(((y + 29) % y_rep) == 0 ) shift = 1;
-                else if(((y + 37) % y_rep) == 0 ) shift = 7;
-                else if(((y + 41) % y_rep) == 0 ) shift = 13;
-                else if(((y + 42) % y_rep) == 0 ) shift = 6;
-                else if(((y + 44) % y_rep) == 0 ) shift = 12;
-                else if(((y + 56) % y_rep) == 0 ) shift = 0;
-                else if(((y + 59) % y_rep) == 0 ) shift = 1;
-                else continue;
-                break;
-
-            case PATTERN_100D:
-                if(((y + 2) % y_rep) == 0 ) shift = 0;
-                else if(((y + 5) % y_rep) == 0 ) shift = 1;
-                else if(((y + 6) % y_rep) == 0 ) shift = 6;
-                else if(((y + 7) % y_rep) == 0 ) shift = 7;
-                else continue;
-                break;
-        }
-      
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
+        print_msg(MSG_ERROR, "could not read from '%s'\n", input_filename);
+        goto bailout;
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-}
-
-/*
-  zoom() function
-  Draw the focus pixel pattern for zoom video mode.
-*/
-static void zoom(struct pixel_map * map, int pattern)
-{
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
 
-    int fp_start = 31;
-    int fp_end = rawi_hdr.height - 1;
-    int x_rep = 24;
-    int y_rep = 60;
-    
-    if(pattern == PATTERN_100D)
+    /* writing the clip onto itself would destroy it while it is read */
+    struct stat in_attr, out_attr;
+    if(!fstat(fileno(in), &in_attr) && !stat(output_filename, &out_attr) && in_attr.st_dev == out_attr.st_dev && in_attr.st_ino == out_attr.st_ino)
     {
-        fp_start = 28;
-        x_rep = 12;
-        y_rep = 6;
+        print_msg(MSG_ERROR, "output '%s' is the input file\n", output_filename);
+        goto bailout;
     }
 
-    for(int y = fp_start; y <= fp_end; y++)
+    p.out = open_output(output_filename, "wb");
+    if(!p.out)
     {
-        switch(pattern)
-        {
-            case PATTERN_EOSM:
-            case PATTERN_650D:
-            case PATTERN_700D:
-                if(((y + 7) % y_rep) == 0) shift = 19;
-                else if(((y + 11) % y_rep) == 0) shift = 13;
-                else if(((y + 12) % y_rep) == 0) shift = 18;
-                else if(((y + 14) % y_rep) == 0) shift = 12;
-                else if(((y + 26) % y_rep) == 0) shift = 0;
-                else if(((y + 29) % y_rep) == 0) shift = 1;
-                else if(((y + 37) % y_rep) == 0) shift = 7;
-                else if(((y + 41) % y_rep) == 0) shift = 13;
-                else if(((y + 42) % y_rep) == 0) shift = 6;
-                else if(((y + 44) % y_rep) == 0) shift = 12;
-                else if(((y + 56) % y_rep) == 0) shift = 0;
-                else if(((y + 59) % y_rep) == 0) shift = 1;
-                else continue;
-                break;
-
-            case PATTERN_100D:
-                if(((y + 2) % y_rep) == 0) shift = 0;
-                else if(((y + 5) % y_rep) == 0) shift = 1;
-                else if(((y + 6) % y_rep) == 0) shift = 6;
-                else if(((y + 7) % y_rep) == 0) shift = 7;
-                else continue;
-                break;
-        }
-        
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
+        print_msg(MSG_ERROR, "could not open '%s'\n", output_filename);
+        goto bailout;
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-}
+    p.process = transcode_frame;
+    p.arg = &job;
+    p.output_filename = output_filename;
+    p.drop_skipped = 1;
 
-/*
-  crop_rec() function
-  Draw the focus pixel pattern for crop_rec video mode.
-  Requires the crop_rec module.
-*/
-static void crop_rec(struct pixel_map * map, int pattern)
-{
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
+    print_msg(MSG_INFO, "Transcoding %ux%u %u bit frames of '%s' into '%s'\n", job.width, job.height, job.bits_per_pixel, input_filename, output_filename);
+    uint64_t start = time_now_ns();
+    int run_ret = run_pipeline(&p, in, input_filename);
 
-    int fp_start = 219;
-    int fp_end = 515;
-    int x_rep = 8;
-    int y_rep = 10;
-    
-    switch(pattern)
+    /* the header is the first block, its counts are set like mlv_setframes does from the blocks that made it */
+    if(run_ret)
     {
-        case PATTERN_EOSM:
-        case PATTERN_650D:
+        mlv_file_hdr_t hdr = file_hdr;
+        hdr.videoClass |= MLV_VIDEO_CLASS_FLAG_LJ92;
+        hdr.videoFrameCount = p.video_frames;
+        hdr.audioFrameCount = p.audio_frames;
+        if(fseek(p.out, 0, SEEK_SET) || fwrite(&hdr, sizeof(mlv_file_hdr_t), 1, p.out) != 1)
         {
-            // first pass is like fpm_mv720
-            mv720(map, pattern);
-            break;
+            print_msg(MSG_ERROR, "could not write to '%s'\n", output_filename);
+            run_ret = 0;
         }
+    }
+    if(fclose(p.out) && run_ret)
+    {
+        print_msg(MSG_ERROR, "could not write to '%s'\n", output_filename);
+        run_ret = 0;
+    }
+    p.out = NULL;
+    if(!run_ret)
+    {
+        remove(output_filename);
+        goto bailout;
+    }
 
-        case PATTERN_700D:
-        {
-            // no first pass needed
-            break;
-        }
+    double seconds = (time_now_ns() - start) / 1e9;
+    if(p.skipped) print_msg(MSG_INFO, "%u VIDF blocks without a complete frame left out\n", p.skipped);
+    print_msg(MSG_INFO, "%u frames transcoded in %.2f s (%.0f fps), %u video and %u audio frames in the header\n", p.frames, seconds,
+              (seconds > 0) ? p.frames / seconds : 0.0, p.video_frames, p.audio_frames);
+    if(!stat(output_filename, &out_attr) && in_attr.st_size > 0) print_msg(MSG_INFO, "Output is %.1f%% of the input size\n", 100.0 * out_attr.st_size / in_attr.st_size);
+    ret = 1;
 
-        case PATTERN_100D:
-        {
-            // first pass is like fpm_mv720
-            mv720(map, pattern);
-            // second pass is like fpm_mv1080 with corrected fp_start/fp_end
-            fp_start = 28;
-            fp_end = 724;
-            x_rep = 8;
-            y_rep = 10;
-            break;
-        }
+bailout:
 
-        default: // unsupported camera
-            return;
-    }
+    if(p.out) fclose(p.out);
+    if(in) fclose(in);
+    for(int i = 0; i < thread_count; i++) free(job.pixels[i]);
+    free(job.pixels);
+    return ret;
+}
 
-    for(int y = fp_start; y <= fp_end; y++)
-    {
-        if(((y + 0) % y_rep) == 0) shift=0;
-        else if(((y + 1) % y_rep) == 0) shift = 1;
-        else if(((y + 5) % y_rep) == 0) shift = 5;
-        else if(((y + 6) % y_rep) == 0) shift = 4;
-        else continue;
+/* end of transcode mode **********************************************************************************************/
 
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
-    }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-}
+/* detect mode ********************************************************************************************************/
 
-/* unified generators ************************************************************************************************/
+/* share of the frames a pixel has to stand out in to be a candidate */
+#define DETECT_FRACTION     0.5
 
-/*
-  mv720_u() function
-  Draw unified focus pixel pattern for mv720 video mode.
-*/
-static void mv720_u(struct pixel_map * map, int pattern)
+static int detect_frame(void * detector, int worker, struct frame_slot * slot, uint8_t * frame, size_t size)
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
+    return fpm_detect_frame(detector, frame, size);
+}
 
-    int fp_start = 28; 
-    int fp_end = 726;
-    int x_rep = 8;
-    int y_rep = 12;
-    
-    for(int y = fp_start; y <= fp_end; y++)
-    {
-        if(((y + 3) % y_rep) == 0) shift = 7;
-        else if(((y + 4) % y_rep) == 0) shift = 6;
-        else if(((y + 9) % y_rep) == 0) shift = 3;
-        else if(((y + 10) % y_rep) == 0) shift = 2;
-        else continue;
-    
-        for(int x = 72; x < raw_width; x++)
+/* pixels of the first pass of 'a' also in the first pass of 'b' */
+static uint32_t count_common_pixels(const fpm_map_t * a, const fpm_map_t * b)
+{
+    uint32_t common = 0;
+    for(uint32_t y = 0; y < fpm_map_info(a)->height; y++)
+    {
+        fpm_row_iter_t iter_a, iter_b;
+        uint32_t x_a, x_b;
+        fpm_row_iter_init(&iter_a, a, 0, y);
+        fpm_row_iter_init(&iter_b, b, 0, y);
+        int more_a = fpm_row_iter_next(&iter_a, &x_a), more_b = fpm_row_iter_next(&iter_b, &x_b);
+        while(more_a && more_b)
         {
-            if(((x + shift) % x_rep) == 0)
+            if(x_a == x_b)
+            {
+                common++;
+                more_a = fpm_row_iter_next(&iter_a, &x_a);
+                more_b = fpm_row_iter_next(&iter_b, &x_b);
+            }
+            else if(x_a < x_b)
+            {
+                more_a = fpm_row_iter_next(&iter_a, &x_a);
+            }
+            else
             {
-                add_pixel_to_map(map, x, y);
+                more_b = fpm_row_iter_next(&iter_b, &x_b);
             }
         }
-    
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
+    return common;
 }
 
-/*
-  mv1080_u() function
-  Draw unified focus pixel pattern for mv1080 video mode.
-*/
-static void mv1080_u(struct pixel_map * map, int pattern)
+/* pattern in the syntax of '-p' files, commented out if the resolution is no known video mode */
+static void write_sweeps(FILE * f, const fpm_pattern_t * pattern, const char * comment)
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
-
-    int fp_start = 28;
-    int fp_end = 1189;
-    int x_rep = 8;
-    int y_rep = 10;
-    
-    for(int y = fp_start; y <= fp_end; y++)
+    for(int i = 0; i < pattern->passes[0].sweep_count; i++)
     {
-        if(((y + 0) % y_rep) == 0) shift=0;
-        else if(((y + 1) % y_rep) == 0) shift = 1;
-        else if(((y + 5) % y_rep) == 0) shift = 5;
-        else if(((y + 6) % y_rep) == 0) shift = 4;
-        else continue;
-    
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
+        const fpm_sweep_t * sweep = &pattern->passes[0].sweeps[i];
+        fprintf(f, "%ssweep %d %d %d %d %d", comment, sweep->fp_start, sweep->fp_end, sweep->x_start, sweep->x_rep, sweep->y_rep);
+        for(int j = 0; j < sweep->phase_count; j++) fprintf(f, " %d:%d", sweep->phases[j].phase, sweep->phases[j].shift);
+        fprintf(f, "\n");
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
 }
 
-/*
-  mv1080crop_u() functions (shifted and normal)
-  Draw unified focus pixel pattern for mv1080crop video mode.
-*/
-/* shifted */
-static void mv1080crop_u_shifted(struct pixel_map * map, int pattern)
+/* 'sensor' is the same pattern on the whole sensor if the clip is a 1:1 window, NULL otherwise */
+static void write_pattern(FILE * f, const fpm_pattern_t * pattern, enum fpm_video_mode video_mode, const fpm_pattern_t * sensor)
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
-
-    int fp_start = 28;
-    int fp_end = 1058;
-    int x_rep = 8;
-    int y_rep = 60;
-    
-    if(pattern == PATTERN_100D)
+    const fpm_camera_t * camera = fpm_find_camera_by_model(fpm_ctx, idnt_hdr.cameraModel);
+    char name[16];
+    if(camera)
     {
-        x_rep = 12;
-        y_rep = 6;
+        strcpy(name, camera->name);
     }
-
-    for(int y = fp_start; y <= fp_end; y++)
+    else
     {
-        switch(pattern)
-        {
-            case PATTERN_EOSM:
-            case PATTERN_650D:
-            case PATTERN_700D:
-                if(((y + 7) % y_rep) == 0 ) shift = 2;
-                else if(((y + 11) % y_rep) == 0 ) shift = 4;
-                else if(((y + 12) % y_rep) == 0 ) shift = 1;
-                else if(((y + 14) % y_rep) == 0 ) shift = 3;
-                else if(((y + 26) % y_rep) == 0 ) shift = 7;
-                else if(((y + 29) % y_rep) == 0 ) shift = 0;
-                else if(((y + 37) % y_rep) == 0 ) shift = 6;
-                else if(((y + 41) % y_rep) == 0 ) shift = 4;
-                else if(((y + 42) % y_rep) == 0 ) shift = 5;
-                else if(((y + 44) % y_rep) == 0 ) shift = 3;
-                else if(((y + 56) % y_rep) == 0 ) shift = 7;
-                else if(((y + 59) % y_rep) == 0 ) shift = 0;
-                else continue;
-                break;
-
-            case PATTERN_100D:
-                if(((y + 2) % y_rep) == 0 ) shift = 11;
-                else if(((y + 5) % y_rep) == 0 ) shift = 0;
-                else if(((y + 6) % y_rep) == 0 ) shift = 5;
-                else if(((y + 7) % y_rep) == 0 ) shift = 6;
-                else continue;
-                break;
-        }
-      
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
+        sprintf(name, "%X", idnt_hdr.cameraModel);
+        fprintf(f, "camera %s %X %s\n", name, idnt_hdr.cameraModel, idnt_hdr.cameraName);
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-}
-/* normal */
-static void mv1080crop_u(struct pixel_map * map, int pattern)
-{
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
 
-    int fp_start = 28;
-    int fp_end = 1058;
-    int x_rep = 8;
-    int y_rep = 60;
-    
-    if(pattern == PATTERN_100D)
+    const char * comment = "";
+    if(video_mode == FPM_MV_NONE)
     {
-        x_rep = 12;
-        y_rep = 6;
+        fprintf(f, "# %ux%u is no known video mode, uncomment with the mode of the footage\n", rawi_hdr.width, rawi_hdr.height);
+        comment = "# ";
     }
+    fprintf(f, "%spattern %s %s\n%spass\n", comment, (video_mode != FPM_MV_NONE) ? fpm_video_mode_name(video_mode) : "<mode>", name, comment);
+    write_sweeps(f, pattern, comment);
 
-    for(int y = fp_start; y <= fp_end; y++)
+    if(sensor && sensor->passes[0].sweep_count)
     {
-        switch(pattern)
-        {
-            case PATTERN_EOSM:
-            case PATTERN_650D:
-            case PATTERN_700D:
-                if(((y + 7) % y_rep) == 0 ) shift = 3;
-                else if(((y + 11) % y_rep) == 0 ) shift = 5;
-                else if(((y + 12) % y_rep) == 0 ) shift = 2;
-                else if(((y + 14) % y_rep) == 0 ) shift = 4;
-                else if(((y + 26) % y_rep) == 0 ) shift = 0;
-                else if(((y + 29) % y_rep) == 0 ) shift = 1;
-                else if(((y + 37) % y_rep) == 0 ) shift = 7;
-                else if(((y + 41) % y_rep) == 0 ) shift = 5;
-                else if(((y + 42) % y_rep) == 0 ) shift = 6;
-                else if(((y + 44) % y_rep) == 0 ) shift = 4;
-                else if(((y + 56) % y_rep) == 0 ) shift = 0;
-                else if(((y + 59) % y_rep) == 0 ) shift = 1;
-                else continue;
-                break;
-
-            case PATTERN_100D:
-                if(((y + 2) % y_rep) == 0 ) shift = 0;
-                else if(((y + 5) % y_rep) == 0 ) shift = 1;
-                else if(((y + 6) % y_rep) == 0 ) shift = 6;
-                else if(((y + 7) % y_rep) == 0 ) shift = 7;
-                else continue;
-                break;
-        }
-      
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
+        fprintf(f, "# the same on the sensor, seen 1:1 at offset %d,%d, projected for any recording geometry\n", rawc_hdr.offset_x, rawc_hdr.offset_y);
+        fprintf(f, "pattern sensor %s\npass\n", name);
+        write_sweeps(f, sensor, "");
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-
-    /* Second pass shifted */
-    mv1080crop_u_shifted(map, pattern);
 }
 
-/*
-  zoom_u() function
-  Draw unified focus pixel pattern for zoom video mode.
-*/
-static void zoom_u(struct pixel_map * map, int pattern)
+/* infer the pattern of the candidates, print it and save it as '<map name>.txt' */
+static void save_detected_pattern(const fpm_map_t * candidates, const char * output_filename)
 {
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
-
-    int fp_start = 28;
-    int fp_end = rawi_hdr.height - 1;
-    int x_rep = 8;
-    int y_rep = 60;
-    
-    if(pattern == PATTERN_100D)
+    fpm_pattern_t pattern;
+    fpm_map_t * drawn = NULL;
+    int ret = fpm_infer_pattern(candidates, &pattern);
+    if(ret == FPM_ERR_NO_PATTERN)
+    {
+        print_msg(MSG_INFO, "No periodic pattern found in the candidates\n");
+        return;
+    }
+    else if(ret || (ret = fpm_generate_pattern(fpm_ctx, &drawn, &pattern, fpm_map_info(candidates))))
+    {
+        print_fpm_error(ret, NULL);
+        return;
+    }
+
+    /* frame coordinates are no sensor pattern, a 1:1 window only needs its offset added */
+    enum fpm_video_mode video_mode = get_video_mode(GET_MLV, vid_mode);
+    if(video_mode == FPM_MV_SENSOR) video_mode = FPM_MV_NONE;
+    fpm_pattern_t sensor;
+    fpm_geometry_t geometry;
+    get_geometry(&geometry);
+    const fpm_pattern_t * lifted = (rawc_hdr.blockType[0] && !fpm_lift_pattern(&pattern, &geometry, &sensor)) ? &sensor : NULL;
+
+    uint32_t common = count_common_pixels(candidates, drawn);
+    print_msg(MSG_INFO, "\nPattern of %u pixels, %u of them candidates, %u candidates off the pattern:\n\n", fpm_map_pixel_count(drawn, 0), common,
+              fpm_map_pixel_count(candidates, 0) - common);
+    if(!quiet_mode) write_pattern(stdout, &pattern, video_mode, lifted);
+    fpm_map_free(drawn);
+
+    char file_name[1024];
+    const char * ext = strrchr(output_filename, '.');
+    snprintf(file_name, sizeof(file_name), "%.*s.txt", (int)((ext) ? ext - output_filename : (int)strlen(output_filename)), output_filename);
+    FILE * f = fopen(file_name, "w");
+    if(!f)
     {
-        x_rep = 12;
-        y_rep = 6;
+        print_msg(MSG_ERROR, "could not open '%s'\n", file_name);
+        return;
     }
+    write_pattern(f, &pattern, video_mode, lifted);
+    if(fclose(f)) print_msg(MSG_ERROR, "could not write to '%s'\n", file_name);
+    else print_msg(MSG_INFO, "\nPattern saved to '%s', load it with '-p'\n", file_name);
+}
+
+/* find the focus pixels of clips of one resolution and bit depth, clips not matching the first are skipped */
+static int detect_mlv(char ** input_filename, int input_count, char * output_filename)
+{
+    fpm_detector_t * detector = NULL;
+    fpm_map_t * map = NULL;
+    mlv_rawi_hdr_t first_rawi = { 0 };
+    mlv_idnt_hdr_t first_idnt = { 0 };
+    uint32_t clip_count = 0;
+    int ret = 0;
+    uint64_t start = time_now_ns();
 
-    for(int y = fp_start; y <= fp_end; y++)
+    for(int i = 0; i < input_count; i++)
     {
-        switch(pattern)
-        {
-            case PATTERN_EOSM:
-            case PATTERN_650D:
-            case PATTERN_700D:
-                if(((y + 7) % y_rep) == 0) shift = 3;
-                else if(((y + 11) % y_rep) == 0) shift = 5;
-                else if(((y + 12) % y_rep) == 0) shift = 2;
-                else if(((y + 14) % y_rep) == 0) shift = 4;
-                else if(((y + 26) % y_rep) == 0) shift = 0;
-                else if(((y + 29) % y_rep) == 0) shift = 1;
-                else if(((y + 37) % y_rep) == 0) shift = 7;
-                else if(((y + 41) % y_rep) == 0) shift = 5;
-                else if(((y + 42) % y_rep) == 0) shift = 6;
-                else if(((y + 44) % y_rep) == 0) shift = 4;
-                else if(((y + 56) % y_rep) == 0) shift = 0;
-                else if(((y + 59) % y_rep) == 0) shift = 1;
-                else continue;
-                break;
+        int parse_ret = mlv_parse_file(input_filename[i]);
+        if(parse_ret == 0) print_msg(MSG_ERROR, "'%s' does not have all needed info blocks\n", input_filename[i]);
+        if(parse_ret != 1) continue;
 
-            case PATTERN_100D:
-                if(((y + 2) % y_rep) == 0) shift = 0;
-                else if(((y + 5) % y_rep) == 0) shift = 1;
-                else if(((y + 6) % y_rep) == 0) shift = 6;
-                else if(((y + 7) % y_rep) == 0) shift = 7;
-                else continue;
-                break;
-        }
-        
-        for(int x = 72; x < raw_width; x++)
+        if(!detector)
         {
-            if(((x + shift) % x_rep) == 0)
+            int detector_ret = fpm_detector_new(fpm_ctx, &detector, rawi_hdr.width, rawi_hdr.height, rawi_hdr.bits_per_pixel);
+            if(detector_ret == FPM_ERR_FORMAT)
+            {
+                print_msg(MSG_ERROR, "'%s' has %ux%u pixels of %u bits, not supported\n", input_filename[i], rawi_hdr.width, rawi_hdr.height, rawi_hdr.bits_per_pixel);
+                continue;
+            }
+            else if(detector_ret)
             {
-                add_pixel_to_map(map, x, y);
+                print_fpm_error(detector_ret, input_filename[i]);
+                goto bailout;
             }
+            first_rawi = rawi_hdr;
+            first_idnt = idnt_hdr;
+            print_msg(MSG_INFO, "\nCamera     : %s (0x%X)\nVideo mode : %dx%d, %d bit\n\n", idnt_hdr.cameraName, idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height, rawi_hdr.bits_per_pixel);
         }
-    }
-
-    for(int y = fp_start; y <= fp_end; y++)
-    {
-       switch(pattern)
+        else if(rawi_hdr.width != first_rawi.width || rawi_hdr.height != first_rawi.height || rawi_hdr.bits_per_pixel != first_rawi.bits_per_pixel)
         {
-            case PATTERN_EOSM:
-            case PATTERN_650D:
-            case PATTERN_700D:
-                if(((y + 14) % y_rep) == 0) shift = 4;
-                else continue;
-                break;
-
-            case PATTERN_100D:
-                if(((y + 2) % y_rep) == 0) shift = 4;
-                else if(((y + 5) % y_rep) == 0) shift = 5;
-                else if(((y + 6) % y_rep) == 0) shift = 10;
-                else if(((y + 7) % y_rep) == 0) shift = 11;
-                else continue;
-                break;
+            print_msg(MSG_ERROR, "'%s' differs in resolution or bit depth from the first clip, skipped\n", input_filename[i]);
+            continue;
         }
 
-        for(int x = 72; x < raw_width; x++)
+        FILE * in = fopen(input_filename[i], "rb");
+        if(!in)
         {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        } 
+            print_msg(MSG_ERROR, "could not read from '%s'\n", input_filename[i]);
+            continue;
+        }
+        struct frame_pipeline p;
+        memset(&p, 0, sizeof(struct frame_pipeline));
+        p.process = detect_frame;
+        pipeline_set_clip(&p);
+        p.arg = detector;
+        int run_ret = run_pipeline(&p, in, input_filename[i]);
+        fclose(in);
+        if(!run_ret) goto bailout;
+        if(p.skipped) print_msg(MSG_INFO, "%u VIDF blocks without a complete frame skipped\n", p.skipped);
+        clip_count++;
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
-}
-
-/*
-  crop_rec_u() function
-  Draw unified focus pixel pattern for crop_rec video mode.
-  Requires the crop_rec module.
-*/
-static void crop_rec_u(struct pixel_map * map, int pattern)
-{
-    // first pass is like mv720
-    mv720_u(map, pattern);
 
-    int shift = 0;
-    int raw_width = rawi_hdr.width;
-
-    int fp_start = 28;
-    int fp_end = 726;
-    int x_rep = 8;
-    int y_rep = 10;
+    uint32_t frames = (detector) ? fpm_detector_frame_count(detector) : 0;
+    if(!frames)
+    {
+        print_msg(MSG_ERROR, "no frames to analyse\n");
+        goto bailout;
+    }
+    double seconds = (time_now_ns() - start) / 1e9;
+    print_msg(MSG_INFO, "\n%u frames of %u clips analysed in %.2f s (%.0f fps)\n", frames, clip_count, seconds, (seconds > 0) ? frames / seconds : 0.0);
 
-    for(int y = fp_start; y <= fp_end; y++)
+    /* the map belongs to the first clip */
+    rawi_hdr = first_rawi;
+    idnt_hdr = first_idnt;
+    fpm_info_t info = { idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height, 0 };
+    int map_ret = fpm_detector_map(detector, &map, DETECT_FRACTION, &info);
+    if(map_ret)
     {
-        if(((y + 0) % y_rep) == 0) shift=0;
-        else if(((y + 1) % y_rep) == 0) shift = 1;
-        else if(((y + 5) % y_rep) == 0) shift = 5;
-        else if(((y + 6) % y_rep) == 0) shift = 4;
-        else continue;
+        print_fpm_error(map_ret, NULL);
+        goto bailout;
+    }
+    print_msg(MSG_INFO, "%u candidate pixels stood out in %.0f%% of the frames or more\n", fpm_map_pixel_count(map, 0), DETECT_FRACTION * 100);
 
-        for(int x = 72; x < raw_width; x++)
-        {
-            if(((x + shift) % x_rep) == 0)
-            {
-                add_pixel_to_map(map, x, y);
-            }
-        }
+    char file_name[64];
+    if(!output_filename)
+    {
+        sprintf(file_name, "%x_%ix%i_detected.fpm", idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height);
+        output_filename = file_name;
     }
-    map->pass.range[MIN(++map->pass.count, 9)] = map->count;
+    ret = save_pixel_map(map, output_filename);
+    if(ret) save_detected_pattern(map, output_filename);
+
+bailout:
+
+    fpm_map_free(map);
+    fpm_detector_free(detector);
+    return ret;
 }
 
-/* end of generators **************************************************************************************************/
+/* end of detect mode *************************************************************************************************/
 
 static void show_usage(char *executable)
 {
@@ -1507,10 +2381,20 @@ static void show_usage(char *executable)
     print_msg(MSG_INFO, "                                  mv1080crop (1872x10**)\n");
     print_msg(MSG_INFO, "                                  zoom       (2592x1***)\n");
     print_msg(MSG_INFO, "                                  croprec    (1808x72* ) \n");
+    print_msg(MSG_INFO, "                                  sensor     (any, '.mlv' with RAWC only)\n");
+    print_msg(MSG_INFO, "\n");
+    print_msg(MSG_INFO, "  -p|--patterns <file>      load cameras and focus pixel patterns from <file>\n");
+    print_msg(MSG_INFO, "                            they take precedence over the built-in ones\n");
     print_msg(MSG_INFO, "\n");
     print_msg(MSG_INFO, "  -u|--unified              switch to different, unified map generation mode\n");
     print_msg(MSG_INFO, "  -n|--no-header            do not include header into '.fpm' file\n");
     print_msg(MSG_INFO, "  -1|--one-pass-pbm         export multi pass '.fpm' as one pass '.pbm'\n");
+    print_msg(MSG_INFO, "  -b|--binary               save '.fpm' in binary v2 format with row index\n");
+    print_msg(MSG_INFO, "  -f|--fix                  write a copy of the '.mlv' with focus pixels interpolated in every frame\n");
+    print_msg(MSG_INFO, "  -d|--detect               find focus pixels in the frames of '.mlv' files and infer their pattern\n");
+    print_msg(MSG_INFO, "  -t|--transcode            write a lossless compressed copy of an uncompressed '.mlv'\n");
+    print_msg(MSG_INFO, "  -C|--cache <dir>          reuse generated maps from cache <dir>, default is $FPMUTIL_CACHE if set\n");
+    print_msg(MSG_INFO, "  -D|--dark <file>          add hot, dead and stuck pixels of the lens cap '.mlv' <file> as an extra pass\n");
     print_msg(MSG_INFO, "  -q|--quiet                supress console output\n");
     print_msg(MSG_INFO, "  -h|--help                 show long help\n");
     print_msg(MSG_INFO, "\n");
@@ -1527,13 +2411,29 @@ static void show_help(char *executable)
     print_msg(MSG_INFO, "Notes:\n");
     print_msg(MSG_INFO, "  * auto generated name format is like used by MLVFS: 'cameraID_width_height.fpm'\n");
     print_msg(MSG_INFO, "  * multiple input files can be specified only for '.pbm' map images to save one combined multipass '.fpm'\n");
+    print_msg(MSG_INFO, "  * several '.mlv' files or directories (searched recursively for '.mlv') are processed in batch mode, one map per\n");
+    print_msg(MSG_INFO, "    camera, resolution and video mode is generated and linked next to the clips with auto generated name, '-o' is ignored\n");
     print_msg(MSG_INFO, "  * to build crop_rec compliant maps using '.mlv' input, '-m croprec' should be used in conjunction with input file\n");
     print_msg(MSG_INFO, "  * if input file extension is '.fpm' or '.pbm' then conversion between input and output formats will be done\n");
     print_msg(MSG_INFO, "  * output map format will be chosen according to the file extension and if extension is wrong program will abort\n");
     print_msg(MSG_INFO, "  * if input '.mlv' from unsupportred camera the warning will be shown and program will abort\n");
+    print_msg(MSG_INFO, "  * '.mlv' of other resolutions, or with '-m sensor', get the 'sensor' pattern of the camera projected through the\n");
+    print_msg(MSG_INFO, "    sampling and crop window of their RAWC block\n");
     print_msg(MSG_INFO, "  * if '-u' switch specified, will export unified, aggresive pixel map to fix restricted to 8-12bit lossless raw\n");
     print_msg(MSG_INFO, "  * if '-n' switch specified, will export '.fpm' without header\n");
     print_msg(MSG_INFO, "  * if '-1' switch specified, will export all passes in one .pbm, by default separate file created for each pass\n");
+    print_msg(MSG_INFO, "  * if '-b' switch specified, will export binary '.fpm', binary input maps are detected by content\n");
+    print_msg(MSG_INFO, "  * if '-f' switch specified, the map of the '.mlv' is applied to all its frames, LJ92 frames are compressed again, the copy\n");
+    print_msg(MSG_INFO, "    is named 'name_fixed.mlv' unless '-o' is given\n");
+    print_msg(MSG_INFO, "  * if '-d' switch specified, pixels standing out from their neighbours in half of the frames or more are saved as\n");
+    print_msg(MSG_INFO, "    'cameraID_width_height_detected.fpm' unless '-o' is given, the pattern found in them goes next to it as '.txt'\n");
+    print_msg(MSG_INFO, "    for '-p', clips of one resolution and bit depth only, moving scenes give the best results\n");
+    print_msg(MSG_INFO, "  * if '-t' switch specified, all frames of the '.mlv' are LJ92 compressed as the camera does for lossless raw, the\n");
+    print_msg(MSG_INFO, "    copy is named 'name_lossless.mlv' unless '-o' is given and its header gets the frame counts of the copy\n");
+    print_msg(MSG_INFO, "  * if '-D' switch specified, the mean and noise of every pixel over all frames of the dark clip are computed and\n");
+    print_msg(MSG_INFO, "    pixels far off the typical level or noise are added as the last pass, the dark clip must have the frame size of\n");
+    print_msg(MSG_INFO, "    the map, with '-f' they are interpolated as well, such maps are never cached\n");
+    print_msg(MSG_INFO, "  * if '-C' switch specified, generated maps are served from and added to the cache, conversions are never cached\n");
     print_msg(MSG_INFO, "\n");
     print_msg(MSG_INFO, "Examples:\n");
     print_msg(MSG_INFO, "  fpmutil -c EOSM -m mv1080                     will save '.fpm' 1808x1190 map with auto generated name\n");
@@ -1548,19 +2448,28 @@ static void show_help(char *executable)
     print_msg(MSG_INFO, "  fpmutil -c 100D -m croprec input.fpm          will save '.pbm' with overriden camera ID and video mode\n");
     print_msg(MSG_INFO, "  fpmutil input1.pbm input2.pbm                 will save '.fpm' with combined pixels from all input files as multipass map\n");
     print_msg(MSG_INFO, "  fpmutil -n input.pbm                          will save '.fpm' without header\n");
+    print_msg(MSG_INFO, "  fpmutil -b input.fpm -o output.fpm            will save binary '.fpm' converted from text '.fpm'\n");
+    print_msg(MSG_INFO, "  fpmutil -C ~/.fpmcache input.mlv              will link cached '.fpm' for the camera and resolution or generate and cache it\n");
+    print_msg(MSG_INFO, "  fpmutil -f input.mlv                          will save 'input_fixed.mlv' with focus pixels of all frames interpolated\n");
+    print_msg(MSG_INFO, "  fpmutil -t input.mlv                          will save 'input_lossless.mlv' with all frames lossless compressed\n");
+    print_msg(MSG_INFO, "  fpmutil -D dark.mlv input.mlv                 will save '.fpm' with the hot and dead pixels of 'dark.mlv' as an extra pass\n");
+    print_msg(MSG_INFO, "  fpmutil -d clip1.mlv clip2.mlv                will save '.fpm' of the focus pixels found in both clips and their pattern\n");
+    print_msg(MSG_INFO, "  fpmutil -C ~/.fpmcache shoot/                 will save '.fpm' next to every '.mlv' in 'shoot', each distinct map generated once\n");
     print_msg(MSG_INFO, "\n");
 }
 
 int main(int argc, char *argv[])
 {
-    char *input_filename[10] = { NULL };
+    char **input_filename = NULL;
     char *output_filename = NULL;
     int opt = ' ';
+    int ret = 1;
 
-    enum pattern pattern = PATTERN_NONE;
-    enum video_mode video_mode = MV_NONE;
+    uint32_t camera = 0;
+    enum fpm_video_mode video_mode = FPM_MV_NONE;
 
-    static struct pixel_map focus_pixel_map = { 0, 0, { 0, { 0 } }, NULL };
+    fpm_map_t * focus_pixel_map = NULL;
+    char cache_entry[1024] = { 0 };
 
     /* disable stdout buffering */
     setvbuf(stderr, NULL, _IONBF, 0);
@@ -1574,16 +2483,23 @@ int main(int argc, char *argv[])
     struct option long_options[] = {
         { "video-mode", required_argument, NULL, 'm' },
         { "camera-name", required_argument, NULL, 'c' },
-        { "unified",  no_argument, &unified_mode,  5 },
+        { "patterns", required_argument, NULL, 'p' },
+        { "unified",  no_argument, &unified_mode,  FPM_UNIFIED },
         { "no-header",  no_argument, &no_header,  1 },
         { "one-pass-pbm",  no_argument, &one_pass_pbm,  1 },
+        { "binary",  no_argument, &binary_fpm,  1 },
+        { "cache", required_argument, NULL, 'C' },
+        { "dark", required_argument, NULL, 'D' },
+        { "fix",  no_argument, &fix_mode,  1 },
+        { "detect",  no_argument, &detect_mode,  1 },
+        { "transcode",  no_argument, &transcode_mode,  1 },
         { "quiet",  no_argument, &quiet_mode,  1 },
         { "help",  optional_argument, NULL, 'h'},
         { NULL, 0, NULL, 0 }
     };
 
     int index = 0;
-    while ((opt = getopt_long(argc, argv, "c:m:o:un1qh", long_options, &index)) != -1)
+    while ((opt = getopt_long(argc, argv, "c:m:o:p:C:D:un1bfdtqh", long_options, &index)) != -1)
     {
         switch (opt)
         {
@@ -1599,8 +2515,12 @@ int main(int argc, char *argv[])
                 output_filename = strdup(optarg);
                 break;
 
+            case 'p':
+                pattern_file = strdup(optarg);
+                break;
+
             case 'u':
-                unified_mode = 5;
+                unified_mode = FPM_UNIFIED;
                 break;
 
             case 'n':
@@ -1611,6 +2531,32 @@ int main(int argc, char *argv[])
                 one_pass_pbm = 1;
                 break;
 
+            case 'b':
+                binary_fpm = 1;
+                break;
+
+            case 'f':
+                fix_mode = 1;
+                break;
+
+            case 'd':
+                detect_mode = 1;
+                break;
+
+            case 't':
+                transcode_mode = 1;
+                break;
+
+            case 'C':
+                free(cache_dir);
+                cache_dir = strdup(optarg);
+                break;
+
+            case 'D':
+                free(dark_file);
+                dark_file = strdup(optarg);
+                break;
+
             case 'q':
                 quiet_mode = 1;
                 break;
@@ -1639,6 +2585,25 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if(!cache_dir && getenv("FPMUTIL_CACHE") && *getenv("FPMUTIL_CACHE"))
+    {
+        cache_dir = strdup(getenv("FPMUTIL_CACHE"));
+    }
+
+    fpm_ctx = fpm_context_new(NULL);
+    focus_pixel_map = (fpm_ctx) ? fpm_map_new(fpm_ctx, NULL) : NULL;
+    if(!focus_pixel_map)
+    {
+        print_msg(MSG_ERROR, "could not allocate memory\n");
+        goto bailout;
+    }
+
+    /* cameras and patterns from file come first */
+    if(pattern_file && !load_patterns(pattern_file))
+    {
+        goto bailout;
+    }
+
     /* if input file name is missing, use command line options */
     if(optind >= argc)
     {
@@ -1646,13 +2611,13 @@ int main(int argc, char *argv[])
         {
             print_msg(MSG_ERROR, "missing required command line options\n");
             show_usage(argv[0]);
-            return 1;
+            goto bailout;
         }
         
         print_msg(MSG_INFO, "MLV file not specified, using command line option values\n");
 
-        pattern = get_pattern(GET_CLI, cam_name);
-        if(!pattern)
+        camera = get_camera(GET_CLI, cam_name);
+        if(!camera)
         {
             print_msg(MSG_ERROR, "unsupported camera '%s'\n", cam_name);
             show_usage(argv[0]);
@@ -1676,14 +2641,80 @@ int main(int argc, char *argv[])
            if its FPM/PBM convert pixel map to output format specified by '-o' switch
            if its PBM look for more than one input files
         */
-        int arg_idx = optind;
-        while(argv[arg_idx])
+        int arg_idx = argc;
+        input_filename = argv + optind;
+
+        struct stat attr;
+        char *ext = strrchr(input_filename[0], '.');
+
+        /* '-f' writes a fixed copy of one '.mlv' instead of a map */
+        if(fix_mode)
+        {
+            if(!ext || strcasecmp(ext, ".mlv") || arg_idx - optind > 1)
+            {
+                print_msg(MSG_ERROR, "'-f' needs exactly one '.mlv' input file\n");
+                goto bailout;
+            }
+            if(!output_filename) output_filename = clip_output_filename(input_filename[0], "_fixed");
+            if(!output_filename)
+            {
+                print_msg(MSG_ERROR, "could not allocate memory\n");
+                goto bailout;
+            }
+            if(!fix_mlv(input_filename[0], output_filename)) goto bailout;
+            goto done;
+        }
+
+        /* '-t' writes a lossless copy of one '.mlv' instead of a map */
+        if(transcode_mode)
         {
-            input_filename[arg_idx - optind] = argv[arg_idx];
-            arg_idx++;
+            if(!ext || strcasecmp(ext, ".mlv") || arg_idx - optind > 1)
+            {
+                print_msg(MSG_ERROR, "'-t' needs exactly one '.mlv' input file\n");
+                goto bailout;
+            }
+            if(!output_filename) output_filename = clip_output_filename(input_filename[0], "_lossless");
+            if(!output_filename)
+            {
+                print_msg(MSG_ERROR, "could not allocate memory\n");
+                goto bailout;
+            }
+            if(!transcode_mlv(input_filename[0], output_filename)) goto bailout;
+            goto done;
+        }
+
+        /* '-d' finds the focus pixels of one or more '.mlv' instead of generating them */
+        if(detect_mode)
+        {
+            for(int i = 0; i < arg_idx - optind; i++)
+            {
+                char *clip_ext = strrchr(input_filename[i], '.');
+                if(!clip_ext || strcasecmp(clip_ext, ".mlv"))
+                {
+                    print_msg(MSG_ERROR, "'-d' needs '.mlv' input files only\n");
+                    goto bailout;
+                }
+            }
+            if(dark_file) print_msg(MSG_INFO, "Command line option '-D' ignored with '-d'\n");
+            if(!detect_mlv(input_filename, arg_idx - optind, output_filename)) goto bailout;
+            goto done;
+        }
+
+        /* several '.mlv' files or directories of them are processed in batch mode */
+        if((ext && !strcasecmp(ext, ".mlv") && arg_idx - optind > 1) || (!stat(input_filename[0], &attr) && S_ISDIR(attr.st_mode)))
+        {
+            if(output_filename)
+            {
+                print_msg(MSG_INFO, "Command line option '-o' ignored in batch mode\n");
+            }
+            if(dark_file)
+            {
+                print_msg(MSG_INFO, "Command line option '-D' ignored in batch mode\n");
+            }
+            if(!batch_generate(input_filename, arg_idx - optind)) goto bailout;
+            goto done;
         }
 
-        char *ext = strrchr(input_filename[0], '.');
         if(!ext) // if input file has no file extension bail out
         {
             print_msg(MSG_ERROR, "wrong input file name\n");
@@ -1691,24 +2722,34 @@ int main(int argc, char *argv[])
         }
         else if(!strcasecmp(ext, ".mlv")) // if input file extension is .mlv
         {
-            int ret = mlv_parse_file(input_filename[0]);
-            if(ret == 1) // all needed info block found
+            int parse_ret = mlv_parse_file(input_filename[0]);
+            if(parse_ret == 1) // all needed info block found
             {
-                pattern = get_pattern(GET_MLV, cam_name);
-                if(!pattern)
+                camera = get_camera(GET_MLV, cam_name);
+                if(!camera)
                 {
                     print_msg(MSG_ERROR, "wrong MLV, unsupported camera '%s'\n", idnt_hdr.cameraName);
                     goto bailout;
                 }
 
                 /* if restricted to 8-12bit lossless mode detected, unified, all in one, focus pixel map generation mode is activated */
-                if( (file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) && (rawi_hdr.white_level < 15000) ) unified_mode = 5;
+                if( (file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) && (rawi_hdr.white_level < 15000) ) unified_mode = FPM_UNIFIED;
 
                 video_mode = get_video_mode(GET_MLV, vid_mode);
-                if(video_mode == MV_CROPREC)
+                if(video_mode == FPM_MV_CROPREC)
                 {
                     print_msg(MSG_INFO, "Using command line option '-m croprec'\n");
                 }
+                else if(vid_mode && !strcasecmp(vid_mode, "sensor") && video_mode != FPM_MV_SENSOR)
+                {
+                    print_msg(MSG_ERROR, "'-m sensor' needs the RAWC block the clip does not have\n");
+                    goto bailout;
+                }
+                else if(video_mode == FPM_MV_SENSOR)
+                {
+                    print_msg(MSG_INFO, "Projecting the sensor pattern through sampling %ux%u, binning %ux%u, offset %d,%d\n", rawc_hdr.binning_x + rawc_hdr.skipping_x,
+                              rawc_hdr.binning_y + rawc_hdr.skipping_y, rawc_hdr.binning_x, rawc_hdr.binning_y, rawc_hdr.offset_x, rawc_hdr.offset_y);
+                }
                 else if(cam_name || vid_mode)
                 {
                     print_msg(MSG_INFO, "Command line options ignored\n");
@@ -1716,11 +2757,11 @@ int main(int argc, char *argv[])
                 
                 print_msg(MSG_INFO, "Using MLV info block values\n\nCamera     : %s (0x%X)\nVideo mode : %dx%d\n\n", idnt_hdr.cameraName, idnt_hdr.cameraModel, rawi_hdr.width, rawi_hdr.height);
             }
-            else if(ret == -1) // file IO error
+            else if(parse_ret == -1) // file IO error
             {
                 goto bailout;
             }
-            else if(ret == 0) // no sufficient info blocks found
+            else if(parse_ret == 0) // no sufficient info blocks found
             {
                 print_msg(MSG_ERROR, "MLV file does not have all needed info blocks\n");
                 goto bailout;
@@ -1729,7 +2770,7 @@ int main(int argc, char *argv[])
         else // if input file extension is .fpm or .bpm convert between formats, on any other extension bail out
         {
             int input_filecount = arg_idx - optind; // each input .pbm image corresponds to a separate pass
-            if(!load_pixel_map(&focus_pixel_map, input_filename, input_filecount))
+            if(!load_pixel_map(focus_pixel_map, input_filename, input_filecount))
             {
                 goto bailout;
             }
@@ -1742,81 +2783,66 @@ int main(int argc, char *argv[])
     }
 
     print_msg(MSG_INFO, "Generating focus pixel map for ");
-    switch(video_mode)
+    if(video_mode != FPM_MV_NONE)
     {
-        case MV_720:
-            print_msg(MSG_INFO, "'mv720' mode\n\n");
-            mv720(&focus_pixel_map, pattern);
-            break;
-
-        case MV_1080:
-            print_msg(MSG_INFO, "'mv1080' mode\n\n");
-            mv1080(&focus_pixel_map, pattern);
-            break;
-
-        case MV_1080CROP:
-            print_msg(MSG_INFO, "'mv1080crop' mode\n\n");
-            mv1080crop(&focus_pixel_map, pattern);
-            break;
-
-        case MV_ZOOM:
-            print_msg(MSG_INFO, "'zoom' mode\n\n");
-            zoom(&focus_pixel_map, pattern);
-            break;
-
-        case MV_CROPREC:
-            print_msg(MSG_INFO, "'croprec' mode\n\n");
-            crop_rec(&focus_pixel_map, pattern);
-            break;
-
-        case MV_720_U:
-            print_msg(MSG_INFO, "'mv720' lossless mode\n\n");
-            mv720_u(&focus_pixel_map, pattern);
-            break;
-
-        case MV_1080_U:
-            print_msg(MSG_INFO, "'mv1080' lossless mode\n\n");
-            mv1080_u(&focus_pixel_map, pattern);
-            break;
-
-        case MV_1080CROP_U:
-            print_msg(MSG_INFO, "'mv1080crop' lossless mode\n\n");
-            mv1080crop_u(&focus_pixel_map, pattern);
-            break;
-
-        case MV_ZOOM_U:
-            print_msg(MSG_INFO, "'zoom' lossless mode\n\n");
-            zoom_u(&focus_pixel_map, pattern);
-            break;
+        const fpm_pattern_t *fp_pattern = fpm_find_pattern(fpm_ctx, video_mode, camera);
+        print_msg(MSG_INFO, "'%s' %smode\n\n", fpm_video_mode_name(video_mode), FPM_IS_UNIFIED(video_mode) ? "lossless " : "");
+        if(!fp_pattern)
+        {
+            print_msg(MSG_ERROR, "no focus pixel pattern for this camera and video mode\n");
+            goto bailout;
+        }
 
-        case MV_CROPREC_U:
-            print_msg(MSG_INFO, "'croprec' lossless mode\n\n");
-            crop_rec_u(&focus_pixel_map, pattern);
-            break;
+        output_filename = get_output_filename(output_filename);
+        /* maps with dark frame defects are of one body and never cached */
+        if(cache_dir && !dark_file && cache_entry_name(cache_entry, sizeof(cache_entry), fp_pattern, video_mode, output_filename))
+        {
+            if(cache_fetch(cache_entry, output_filename)) goto done;
+        }
+        else
+        {
+            cache_entry[0] = 0;
+        }
 
-        default:
-            break;
+        fpm_map_free(focus_pixel_map);
+        if(!generate_map(&focus_pixel_map, fp_pattern))
+        {
+            goto bailout;
+        }
     }
 
 savemap:
 
+    if(dark_file && !add_dark_pass(focus_pixel_map, dark_file))
+    {
+        goto bailout;
+    }
+
     /* auto generate output file name if '-o <outputfile>' switch omitted */
     output_filename = get_output_filename(output_filename);
     
-    if(!save_pixel_map(&focus_pixel_map, output_filename))
+    if(!save_pixel_map(focus_pixel_map, output_filename))
     {
         print_msg(MSG_INFO, "Focus pixel map not saved\n");
     }
-    
-    free(output_filename);
-    free(cam_name);
-    free(vid_mode);
-    free(focus_pixel_map.pixels);
-    return 0;
+    else if(cache_entry[0])
+    {
+        cache_store(cache_entry, output_filename);
+    }
+
+done:
+
+    ret = 0;
 
 bailout:
 
+    free(output_filename);
     free(cam_name);
     free(vid_mode);
-    return 1;
+    free(pattern_file);
+    free(cache_dir);
+    free(dark_file);
+    fpm_map_free(focus_pixel_map);
+    fpm_context_free(fpm_ctx);
+    return ret;
 }
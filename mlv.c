@@ -0,0 +1,1863 @@
+/*
+ * Copyright (C) 2016 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#if !defined(__WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define MLV_HAVE_IO_URING
+#endif
+#endif
+
+#include "mlv.h"
+
+int mlv_file_set_pos(FILE *stream, int64_t offset, int whence)
+{
+#if defined(__WIN32)
+    return fseeko64(stream, offset, whence);
+#else
+    return fseeko(stream, offset, whence);
+#endif
+}
+
+/* one 32 bit compare per block type instead of a memcmp chain */
+int mlv_block_type(const uint8_t *blockType)
+{
+    uint32_t fourcc;
+    memcpy(&fourcc, blockType, 4);
+
+    switch(fourcc)
+    {
+        case MLV_FOURCC('V','I','D','F'): return BT_VIDF;
+        case MLV_FOURCC('A','U','D','F'): return BT_AUDF;
+        case MLV_FOURCC('N','U','L','L'): return BT_NULL;
+        case MLV_FOURCC('R','T','C','I'): return BT_RTCI;
+        case MLV_FOURCC('X','R','E','F'): return BT_XREF;
+        case MLV_FOURCC('R','A','W','I'): return BT_RAWI;
+        case MLV_FOURCC('W','A','V','I'): return BT_WAVI;
+        case MLV_FOURCC('E','X','P','O'): return BT_EXPO;
+        case MLV_FOURCC('L','E','N','S'): return BT_LENS;
+        case MLV_FOURCC('I','D','N','T'): return BT_IDNT;
+        case MLV_FOURCC('I','N','F','O'): return BT_INFO;
+        case MLV_FOURCC('W','B','A','L'): return BT_WBAL;
+        case MLV_FOURCC('S','T','Y','L'): return BT_STYL;
+        case MLV_FOURCC('M','A','R','K'): return BT_MARK;
+        case MLV_FOURCC('E','L','V','L'): return BT_ELVL;
+        case MLV_FOURCC('D','E','B','G'): return BT_DEBG;
+        case MLV_FOURCC('B','K','U','P'): return BT_BKUP;
+        case MLV_FOURCC('M','L','V','I'): return BT_MLVI;
+        case MLV_FOURCC('R','A','W','C'): return BT_RAWC;
+        case MLV_FOURCC('D','I','S','O'): return BT_DISO;
+        case MLV_FOURCC('V','E','R','S'): return BT_VERS;
+        case MLV_FOURCC('E','L','N','S'): return BT_ELNS;
+        case MLV_FOURCC('B','I','D','X'): return BT_BIDX;
+        default: return BT_NONE;
+    }
+}
+
+/* FourCC of a block type, "NONE" for BT_NONE and anything unknown */
+const char *mlv_block_type_name(int block_type)
+{
+    static const char names[BT_COUNT][5] = { "NONE", "VIDF", "AUDF", "NULL", "RTCI", "XREF", "RAWI", "WAVI", "EXPO", "LENS", "IDNT", "INFO",
+                                             "WBAL", "STYL", "MARK", "ELVL", "DEBG", "BKUP", "MLVI", "RAWC", "DISO", "VERS", "ELNS", "BIDX" };
+    if(block_type < 0 || block_type >= BT_COUNT) return names[BT_NONE];
+    return names[block_type];
+}
+
+/* Asynchronous reads for cold storage. Walking blocks is a dependent chain of small reads,
+   one round trip each on HDD or NFS. The engine keeps up to 'depth' reads in flight, spans
+   ahead of the walker where blocks are small and the predicted headers of the next VIDF
+   blocks where frames are large. io_uring is used on Linux, a pool of pread() threads
+   where it is not available */
+#if !defined(__WIN32)
+
+#define MLV_AIO_SPAN        (256 * 1024)
+#define MLV_AIO_PAGE        4096
+#define MLV_AIO_WINDOW      (4 * MLV_AIO_PAGE)
+#define MLV_AIO_THREADS     8
+#define MLV_AIO_FRAMES      16  /* predicted VIDF headers, further ahead they only compete with the near ones */
+
+enum aio_state { AIO_FREE, AIO_PENDING, AIO_DONE };
+
+typedef struct {
+    uint64_t        offset;
+    uint32_t        length;
+    int32_t         result;     /* bytes read or -errno once AIO_DONE */
+    int             state;
+    uint64_t        used;       /* last use, lowest is evicted first */
+    uint8_t         *data;
+    struct iovec    iov;
+} aio_slot_t;
+
+struct mlv_aio {
+    int             fd;
+    int             depth;
+    uint64_t        file_size;
+    uint64_t        clock;
+    aio_slot_t      *slots;
+    aio_slot_t      *current;   /* slot the walker points into, never evicted */
+    uint64_t        vidf_first; /* VIDF positions seen so far give the average frame distance */
+    uint64_t        vidf_last;
+    uint64_t        vidf_count;
+    mlv_io_stats_t  io;         /* handed to the walker on close */
+
+#if defined(MLV_HAVE_IO_URING)
+    int             ring_fd;
+    unsigned        to_submit;
+    void            *sq_ring;
+    void            *cq_ring;
+    size_t          sq_ring_size;
+    size_t          cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t          sqes_size;
+    unsigned        *sq_tail;
+    unsigned        *sq_mask;
+    unsigned        *sq_array;
+    unsigned        *cq_head;
+    unsigned        *cq_tail;
+    unsigned        *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+
+    /* thread pool fallback, ring_fd < 0 */
+    pthread_t       threads[MLV_AIO_THREADS];
+    int             thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;
+    pthread_cond_t  done;
+    int             *queue;
+    int             queue_head;
+    int             queue_count;
+    int             quit;
+};
+
+#if defined(MLV_HAVE_IO_URING)
+static int aio_uring_init(mlv_aio_t *a)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    a->ring_fd = syscall(__NR_io_uring_setup, a->depth, &p);
+    if(a->ring_fd < 0) return -1;
+
+    a->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(a->cq_ring_size > a->sq_ring_size) a->sq_ring_size = a->cq_ring_size;
+        a->cq_ring_size = 0;
+    }
+    a->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    a->sq_ring = mmap(NULL, a->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQ_RING);
+    if(a->sq_ring == MAP_FAILED) goto bailout_ring;
+    a->cq_ring = a->sq_ring;
+    if(a->cq_ring_size)
+    {
+        a->cq_ring = mmap(NULL, a->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_CQ_RING);
+        if(a->cq_ring == MAP_FAILED) goto bailout_sq;
+    }
+    a->sqes = mmap(NULL, a->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQES);
+    if(a->sqes == MAP_FAILED) goto bailout_cq;
+
+    a->sq_tail = (unsigned *)((uint8_t *)a->sq_ring + p.sq_off.tail);
+    a->sq_mask = (unsigned *)((uint8_t *)a->sq_ring + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *)((uint8_t *)a->sq_ring + p.sq_off.array);
+    a->cq_head = (unsigned *)((uint8_t *)a->cq_ring + p.cq_off.head);
+    a->cq_tail = (unsigned *)((uint8_t *)a->cq_ring + p.cq_off.tail);
+    a->cq_mask = (unsigned *)((uint8_t *)a->cq_ring + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)((uint8_t *)a->cq_ring + p.cq_off.cqes);
+    return 0;
+
+bailout_cq:
+    if(a->cq_ring_size) munmap(a->cq_ring, a->cq_ring_size);
+bailout_sq:
+    munmap(a->sq_ring, a->sq_ring_size);
+bailout_ring:
+    close(a->ring_fd);
+    a->ring_fd = -1;
+    return -1;
+}
+
+static void aio_uring_reap(mlv_aio_t *a)
+{
+    unsigned head = *a->cq_head;
+    while(head != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &a->cqes[head & *a->cq_mask];
+        aio_slot_t *slot = &a->slots[cqe->user_data];
+        slot->result = cqe->res;
+        slot->state = AIO_DONE;
+        if(cqe->res > 0) a->io.read_bytes += cqe->res;
+        head++;
+    }
+    __atomic_store_n(a->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit queued reads, optionally block until at least one completes */
+static int aio_uring_enter(mlv_aio_t *a, int wait)
+{
+    for(;;)
+    {
+        int ret = syscall(__NR_io_uring_enter, a->ring_fd, a->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        a->io.syscalls++;
+        if(ret >= 0)
+        {
+            a->to_submit -= ret;
+            if(!a->to_submit || !ret) return 0;
+            continue;
+        }
+        if(errno != EINTR && errno != EAGAIN) return -1;
+    }
+}
+#endif
+
+static void *aio_worker(void *arg)
+{
+    mlv_aio_t *a = arg;
+    pthread_mutex_lock(&a->lock);
+    for(;;)
+    {
+        while(!a->quit && !a->queue_count) pthread_cond_wait(&a->queued, &a->lock);
+        if(a->quit) break;
+
+        aio_slot_t *slot = &a->slots[a->queue[a->queue_head]];
+        a->queue_head = (a->queue_head + 1) % a->depth;
+        a->queue_count--;
+        pthread_mutex_unlock(&a->lock);
+
+        ssize_t ret = pread(a->fd, slot->data, slot->length, slot->offset);
+
+        pthread_mutex_lock(&a->lock);
+        slot->result = (ret < 0) ? -errno : ret;
+        if(ret > 0) a->io.read_bytes += ret;
+        __atomic_store_n(&slot->state, AIO_DONE, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&a->done);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+static void aio_submit(mlv_aio_t *a, aio_slot_t *slot, uint64_t offset, uint32_t length)
+{
+    slot->offset = offset;
+    slot->length = length;
+    slot->result = 0;
+    slot->used = ++a->clock;
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = length;
+    a->io.reads++;
+
+#if defined(MLV_HAVE_IO_URING)
+    if(a->ring_fd >= 0)
+    {
+        unsigned tail = *a->sq_tail;
+        unsigned index = tail & *a->sq_mask;
+        struct io_uring_sqe *sqe = &a->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = a->fd;
+        sqe->addr = (uintptr_t)&slot->iov;
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = slot - a->slots;
+        a->sq_array[index] = index;
+        __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        slot->state = AIO_PENDING;
+        a->to_submit++;
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&a->lock);
+    a->io.syscalls++;
+    slot->state = AIO_PENDING;
+    a->queue[(a->queue_head + a->queue_count) % a->depth] = slot - a->slots;
+    a->queue_count++;
+    pthread_cond_signal(&a->queued);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static int aio_wait(mlv_aio_t *a, aio_slot_t *slot)
+{
+#if defined(MLV_HAVE_IO_URING)
+    if(a->ring_fd >= 0)
+    {
+        aio_uring_reap(a);
+        while(slot->state == AIO_PENDING)
+        {
+            if(aio_uring_enter(a, 1)) return -1;
+            aio_uring_reap(a);
+        }
+        return 0;
+    }
+#endif
+
+    pthread_mutex_lock(&a->lock);
+    while(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == AIO_PENDING) pthread_cond_wait(&a->done, &a->lock);
+    pthread_mutex_unlock(&a->lock);
+    return 0;
+}
+
+/* hand queued reads to the kernel without waiting for them */
+static void aio_flush(mlv_aio_t *a)
+{
+#if defined(MLV_HAVE_IO_URING)
+    if(a->ring_fd >= 0 && a->to_submit) aio_uring_enter(a, 0);
+#endif
+}
+
+static int aio_state(aio_slot_t *slot)
+{
+    return __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+}
+
+/* slot holding at least 'need' bytes at 'pos', or all bytes up to the end of file */
+static aio_slot_t *aio_find(mlv_aio_t *a, uint64_t pos, uint32_t need)
+{
+    for(int i = 0; i < a->depth; i++)
+    {
+        aio_slot_t *slot = &a->slots[i];
+        int state = aio_state(slot);
+        if(state == AIO_FREE || pos < slot->offset) continue;
+
+        uint64_t end = slot->offset + slot->length;
+        if(state == AIO_DONE)
+        {
+            if(slot->result < 0) continue;
+            end = slot->offset + slot->result;
+            if(end >= a->file_size && pos < end) return slot;
+        }
+        if(pos + need <= end) return slot;
+    }
+    return NULL;
+}
+
+/* free slot or one with data behind the walker, for demand reads any but the current one */
+static aio_slot_t *aio_victim(mlv_aio_t *a, uint64_t pos, int demand)
+{
+    aio_slot_t *victim = NULL;
+    for(int i = 0; i < a->depth; i++)
+    {
+        aio_slot_t *slot = &a->slots[i];
+        int state = aio_state(slot);
+        if(state == AIO_FREE) return slot;
+        if(slot == a->current || state != AIO_DONE) continue;
+        if(!demand && slot->offset + slot->length > pos) continue;
+        if(!victim || slot->used < victim->used) victim = slot;
+    }
+    if(victim || !demand) return victim;
+
+    /* everything in flight, reuse the oldest read once it lands */
+    for(int i = 0; i < a->depth; i++)
+    {
+        aio_slot_t *slot = &a->slots[i];
+        if(slot != a->current && (!victim || slot->used < victim->used)) victim = slot;
+    }
+    aio_wait(a, victim);
+    return victim;
+}
+
+static void aio_prefetch(mlv_aio_t *a, uint64_t offset, uint32_t length, uint64_t pos)
+{
+    offset &= ~(uint64_t)(MLV_AIO_PAGE - 1);
+    if(offset >= a->file_size || aio_find(a, offset, length)) return;
+    aio_slot_t *slot = aio_victim(a, pos, 0);
+    if(slot) aio_submit(a, slot, offset, length);
+}
+
+/* adds the I/O done to 'io' if given */
+static void aio_close(mlv_aio_t *a, mlv_io_stats_t *io)
+{
+    if(!a) return;
+
+#if defined(MLV_HAVE_IO_URING)
+    if(a->ring_fd >= 0)
+    {
+        /* the kernel still writes into pending buffers */
+        aio_flush(a);
+        for(int i = 0; i < a->depth; i++)
+        {
+            if(a->slots[i].state == AIO_PENDING && aio_wait(a, &a->slots[i])) break;
+        }
+        munmap(a->sqes, a->sqes_size);
+        if(a->cq_ring_size) munmap(a->cq_ring, a->cq_ring_size);
+        munmap(a->sq_ring, a->sq_ring_size);
+        close(a->ring_fd);
+    }
+#endif
+
+    if(a->thread_count)
+    {
+        pthread_mutex_lock(&a->lock);
+        a->quit = 1;
+        pthread_cond_broadcast(&a->queued);
+        pthread_mutex_unlock(&a->lock);
+        for(int i = 0; i < a->thread_count; i++) pthread_join(a->threads[i], NULL);
+    }
+    if(io)
+    {
+        io->reads += a->io.reads;
+        io->read_bytes += a->io.read_bytes;
+        io->syscalls += a->io.syscalls;
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->queued);
+    pthread_cond_destroy(&a->done);
+
+    if(a->slots)
+    {
+        for(int i = 0; i < a->depth; i++) free(a->slots[i].data);
+    }
+    free(a->slots);
+    free(a->queue);
+    free(a);
+}
+
+static mlv_aio_t *aio_open(int fd, int depth)
+{
+    struct stat attr;
+    if(fstat(fd, &attr)) return NULL;
+
+    mlv_aio_t *a = calloc(1, sizeof(mlv_aio_t));
+    if(!a) return NULL;
+    /* the engine does its own read ahead, kernel read ahead would pull in frame payloads */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    a->fd = fd;
+    a->depth = depth;
+    a->file_size = attr.st_size;
+#if defined(MLV_HAVE_IO_URING)
+    a->ring_fd = -1;
+#endif
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->queued, NULL);
+    pthread_cond_init(&a->done, NULL);
+
+    a->slots = calloc(depth, sizeof(aio_slot_t));
+    a->queue = calloc(depth, sizeof(int));
+    if(!a->slots || !a->queue) goto bailout;
+    for(int i = 0; i < depth; i++)
+    {
+        a->slots[i].data = malloc(MLV_AIO_SPAN);
+        if(!a->slots[i].data) goto bailout;
+    }
+
+#if defined(MLV_HAVE_IO_URING)
+    if(!aio_uring_init(a)) return a;
+#endif
+
+    int threads = (depth < MLV_AIO_THREADS) ? depth : MLV_AIO_THREADS;
+    for(a->thread_count = 0; a->thread_count < threads; a->thread_count++)
+    {
+        if(pthread_create(&a->threads[a->thread_count], NULL, aio_worker, a)) break;
+    }
+    if(a->thread_count) return a;
+
+bailout:
+    aio_close(a, NULL);
+    return NULL;
+}
+
+static size_t aio_walker_next(mlv_walker_t *w, const uint8_t **block)
+{
+    mlv_aio_t *a = w->aio;
+    if(w->pos >= a->file_size) return 0;
+
+    uint64_t distance = (a->vidf_count > 1) ? (a->vidf_last - a->vidf_first) / (a->vidf_count - 1) : 0;
+    aio_slot_t *slot = aio_find(a, w->pos, sizeof(mlv_vidf_hdr_t));
+    if(!slot)
+    {
+        slot = aio_victim(a, w->pos, 1);
+        aio_submit(a, slot, w->pos & ~(uint64_t)(MLV_AIO_PAGE - 1), (distance >= MLV_AIO_SPAN / 2) ? MLV_AIO_WINDOW : MLV_AIO_SPAN);
+    }
+    aio_flush(a);
+    if(aio_wait(a, slot) || slot->result <= 0 || w->pos >= slot->offset + slot->result) return 0;
+
+    a->current = slot;
+    slot->used = ++a->clock;
+    *block = slot->data + (w->pos - slot->offset);
+    size_t avail = slot->offset + slot->result - w->pos;
+
+    const mlv_hdr_t *hdr = (const mlv_hdr_t *)*block;
+    if(avail >= sizeof(mlv_hdr_t) && mlv_block_type(hdr->blockType) == BT_VIDF && w->pos > a->vidf_last)
+    {
+        if(!a->vidf_count++) a->vidf_first = w->pos;
+        a->vidf_last = w->pos;
+    }
+
+    /* large frames: the block right behind is known, the next VIDF headers are expected at the
+       average frame distance, which already includes interleaved AUDF and other small blocks */
+    if(distance >= MLV_AIO_SPAN / 2)
+    {
+        if(avail >= sizeof(mlv_hdr_t)) aio_prefetch(a, w->pos + hdr->blockSize, MLV_AIO_WINDOW, w->pos);
+        for(int k = 1; k < a->depth && k <= MLV_AIO_FRAMES; k++)
+        {
+            aio_prefetch(a, w->pos + k * distance - MLV_AIO_WINDOW / 2, MLV_AIO_WINDOW, w->pos);
+        }
+    }
+    /* small blocks: keep spans queued ahead */
+    else
+    {
+        uint64_t next = slot->offset + slot->length;
+        for(int k = 0; k < a->depth / 4 + 1; k++)
+        {
+            aio_prefetch(a, next + (uint64_t)k * MLV_AIO_SPAN, MLV_AIO_SPAN, w->pos);
+        }
+    }
+    aio_flush(a);
+    return avail;
+}
+
+#endif
+
+/* map the file if possible, otherwise leave walker in buffered mode */
+void mlv_walker_init(mlv_walker_t *w, FILE *file, uint64_t pos)
+{
+    memset(w, 0, sizeof(mlv_walker_t));
+    w->file = file;
+    w->pos = pos;
+#if !defined(__WIN32)
+    struct stat attr;
+    int fd = fileno(file);
+    if(fstat(fd, &attr) == 0 && attr.st_size > 0 && (uint64_t)attr.st_size == (size_t)attr.st_size)
+    {
+        void *map = mmap(NULL, attr.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map != MAP_FAILED)
+        {
+            /* only headers are touched, keep readahead from pulling in frame payloads */
+            madvise(map, attr.st_size, MADV_RANDOM);
+            w->map = map;
+            w->map_size = attr.st_size;
+        }
+    }
+#endif
+}
+
+/* replace mapped or buffered reads by the asynchronous engine with 'depth' reads in flight, returns 0 on success */
+int mlv_walker_set_async(mlv_walker_t *w, int depth)
+{
+#if defined(__WIN32)
+    return -1;
+#else
+    mlv_aio_t *aio = aio_open(fileno(w->file), depth);
+    if(!aio) return -1;
+    if(w->map) munmap((void *)w->map, w->map_size);
+    w->map = NULL;
+    w->aio = aio;
+    return 0;
+#endif
+}
+
+void mlv_walker_close(mlv_walker_t *w)
+{
+#if !defined(__WIN32)
+    if(w->map) munmap((void *)w->map, w->map_size);
+    aio_close(w->aio, &w->io);
+#endif
+    w->map = NULL;
+    w->aio = NULL;
+}
+
+/* points 'block' to the block at current position, returns number of bytes available there (at most sizeof(mlv_vidf_hdr_t) in buffered mode) */
+size_t mlv_walker_next(mlv_walker_t *w, const uint8_t **block)
+{
+#if !defined(__WIN32)
+    if(w->aio) return aio_walker_next(w, block);
+#endif
+    if(w->map)
+    {
+        if(w->pos >= w->map_size) return 0;
+        *block = w->map + w->pos;
+        return w->map_size - w->pos;
+    }
+
+    w->io.reads++;
+    w->io.syscalls += 2;
+    if(mlv_file_set_pos(w->file, w->pos, SEEK_SET)) return 0;
+    *block = w->buf;
+    size_t len = fread(w->buf, 1, sizeof(w->buf), w->file);
+    w->io.read_bytes += len;
+    return len;
+}
+
+void mlv_walker_skip(mlv_walker_t *w, uint64_t size)
+{
+    w->pos += size;
+}
+
+uint64_t mlv_walker_file_size(mlv_walker_t *w)
+{
+    if(w->map) return w->map_size;
+#if !defined(__WIN32)
+    if(w->aio) return w->aio->file_size;
+#endif
+
+    struct stat attr;
+    if(fstat(fileno(w->file), &attr)) return 0;
+    return attr.st_size;
+}
+
+/* blocks checked by mlv_walker_resync(), the largest accepted timestamp step between them (1 hour in us)
+   and how far a block may be written before the one preceding it (1 s, audio and video interleave) */
+#define MLV_SYNC_CHAIN      3
+#define MLV_SYNC_MAX_GAP    3600000000ULL
+#define MLV_SYNC_SLACK      1000000ULL
+#define MLV_SYNC_CHUNK      (1024 * 1024)
+
+/* Candidates for a block header are 4 upper case letters in a row, the FourCC of every
+   MLV block. Random payload has one every ~10 KB, zero filled gaps none, so the vector
+   scan runs at memory bandwidth and only candidates are checked in full. Returns the
+   offset of the first candidate, or 'size' if there is none */
+static size_t find_fourcc_scalar(const uint8_t *data, size_t size)
+{
+    for(size_t i = 0; i + 4 <= size; i++)
+    {
+        if((uint8_t)(data[i] - 'A') < 26 && (uint8_t)(data[i + 1] - 'A') < 26 &&
+           (uint8_t)(data[i + 2] - 'A') < 26 && (uint8_t)(data[i + 3] - 'A') < 26) return i;
+    }
+    return size;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __m128i upper_sse2(const uint8_t *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+}
+
+static size_t find_fourcc_sse2(const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+    for(; i + 16 + 3 <= size; i += 16)
+    {
+        __m128i m = _mm_and_si128(_mm_and_si128(upper_sse2(data + i), upper_sse2(data + i + 1)),
+                                  _mm_and_si128(upper_sse2(data + i + 2), upper_sse2(data + i + 3)));
+        unsigned mask = _mm_movemask_epi8(m);
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + find_fourcc_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i upper_avx2(const uint8_t *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+}
+
+__attribute__((target("avx2")))
+static size_t find_fourcc_avx2(const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+    for(; i + 32 + 3 <= size; i += 32)
+    {
+        __m256i m = _mm256_and_si256(_mm256_and_si256(upper_avx2(data + i), upper_avx2(data + i + 1)),
+                                     _mm256_and_si256(upper_avx2(data + i + 2), upper_avx2(data + i + 3)));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + find_fourcc_sse2(data + i, size - i);
+}
+#endif
+
+static size_t find_fourcc(const uint8_t *data, size_t size)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("avx2")) return find_fourcc_avx2(data, size);
+    return find_fourcc_sse2(data, size);
+#else
+    return find_fourcc_scalar(data, size);
+#endif
+}
+
+/* returns 1 if 'chain' plausible block headers follow each other from 'pos' on, or up to the end of file,
+   timestamps must not go back before 'min_timestamp' */
+int mlv_walker_valid_chain(mlv_walker_t *w, uint64_t pos, int chain, uint64_t min_timestamp)
+{
+    uint64_t saved_pos = w->pos, size = mlv_walker_file_size(w), last_timestamp = min_timestamp;
+    int ret = 1;
+
+    for(int i = 0; i < chain && pos < size; i++)
+    {
+        const uint8_t *block = NULL;
+        w->pos = pos;
+        if(mlv_walker_next(w, &block) < sizeof(mlv_hdr_t))
+        {
+            ret = 0;
+            break;
+        }
+
+        const mlv_hdr_t *hdr = (const mlv_hdr_t *)block;
+        int block_type = mlv_block_type(hdr->blockType);
+        if(block_type == BT_NONE || block_type == BT_MLVI || block_type == BT_BIDX ||
+           hdr->blockSize < sizeof(mlv_hdr_t) || hdr->blockSize > size - pos)
+        {
+            ret = 0;
+            break;
+        }
+
+        /* info blocks may carry no timestamp */
+        if(hdr->timestamp && last_timestamp)
+        {
+            if(hdr->timestamp + MLV_SYNC_SLACK < last_timestamp || hdr->timestamp > last_timestamp + MLV_SYNC_MAX_GAP)
+            {
+                ret = 0;
+                break;
+            }
+        }
+        if(hdr->timestamp > last_timestamp) last_timestamp = hdr->timestamp;
+        pos += hdr->blockSize;
+    }
+
+    w->pos = saved_pos;
+    return ret;
+}
+
+/* first block boundary in [from, to) found by a known block type followed by a valid chain of
+   headers, searched in place if mapped and in chunks read from file otherwise, the walker
+   position is kept, returns MLV_NO_SYNC if there is none */
+uint64_t mlv_walker_resync(mlv_walker_t *w, uint64_t from, uint64_t to, uint64_t min_timestamp)
+{
+    uint64_t size = mlv_walker_file_size(w);
+    uint8_t *chunk = NULL;
+    if(to > size) to = size;
+
+    while(from < to)
+    {
+        const uint8_t *data = NULL;
+        size_t len = 0;
+
+        /* a FourCC starting right before 'to' may reach behind it */
+        uint64_t end = (to + 3 < size) ? to + 3 : size;
+        if(w->map)
+        {
+            data = w->map + from;
+            len = end - from;
+        }
+        else
+        {
+            if(!chunk && !(chunk = malloc(MLV_SYNC_CHUNK))) break;
+            len = (end - from < MLV_SYNC_CHUNK) ? end - from : MLV_SYNC_CHUNK;
+            w->io.reads++;
+            w->io.syscalls += 2;
+            if(mlv_file_set_pos(w->file, from, SEEK_SET) || fread(chunk, len, 1, w->file) != 1) break;
+            w->io.read_bytes += len;
+            data = chunk;
+        }
+
+        for(size_t i = 0; i + 4 <= len; i++)
+        {
+            i += find_fourcc(data + i, len - i);
+            if(i + 4 > len || from + i >= to) break;
+
+            if(mlv_block_type(data + i) != BT_NONE && mlv_walker_valid_chain(w, from + i, MLV_SYNC_CHAIN, min_timestamp))
+            {
+                free(chunk);
+                return from + i;
+            }
+        }
+
+        /* overlap chunks by 3 bytes for a FourCC across the border */
+        if(len <= 3 || from + len >= end) break;
+        from += len - 3;
+    }
+
+    free(chunk);
+    return MLV_NO_SYNC;
+}
+
+/* For safety analyze 32 blocks and search for RAWI, RAWC and IDNT blocks, then get values from the
+   first matched, if RAWI and IDNT found return 1 otherwise 0, on file error return one of mlv_error.
+   RAWC is optional, it is looked for up to the first frame
+*/
+int mlv_parse_info(mlv_info_t *info, const char *mlv_name)
+{
+    memset(info, 0, sizeof(mlv_info_t));
+
+    FILE* mlvf = fopen(mlv_name, "rb");
+    if(!mlvf) return MLV_ERR_OPEN;
+
+    int ret = 0;
+    if(fread(&info->file_hdr, sizeof(mlv_file_hdr_t), 1, mlvf) != 1)
+    {
+        ret = MLV_ERR_READ;
+        goto bailout;
+    }
+    if(mlv_block_type(info->file_hdr.fileMagic) != BT_MLVI || info->file_hdr.blockSize != sizeof(mlv_file_hdr_t))
+    {
+        ret = MLV_ERR_FORMAT;
+        goto bailout;
+    }
+
+    mlv_walker_t walker;
+    mlv_walker_init(&walker, mlvf, info->file_hdr.blockSize);
+    for(int i = 0; i < 32; ++i)
+    {
+        const uint8_t *block = NULL;
+        size_t avail = mlv_walker_next(&walker, &block);
+        if(avail < sizeof(mlv_hdr_t))
+        {
+            ret = (info->rawi_found && info->idnt_found) ? 1 : MLV_ERR_READ;
+            break;
+        }
+
+        const mlv_hdr_t *hdr = (const mlv_hdr_t *)block;
+        int type = mlv_block_type(hdr->blockType);
+        void *dst = NULL;
+        size_t dst_size = 0;
+        switch(type)
+        {
+            case BT_RAWI:
+                if(!info->rawi_found) { dst = &info->rawi_hdr; dst_size = sizeof(mlv_rawi_hdr_t); info->rawi_found = 1; }
+                break;
+            case BT_RAWC:
+                if(!info->rawc_found) { dst = &info->rawc_hdr; dst_size = sizeof(mlv_rawc_hdr_t); info->rawc_found = 1; }
+                break;
+            case BT_IDNT:
+                if(!info->idnt_found) { dst = &info->idnt_hdr; dst_size = sizeof(mlv_idnt_hdr_t); info->idnt_found = 1; }
+                break;
+        }
+
+        if(dst)
+        {
+            /* buffered walker holds only the block start, read the rest */
+            if(avail >= dst_size) memcpy(dst, block, dst_size);
+            else if(mlv_file_set_pos(mlvf, walker.pos, SEEK_SET) || fread(dst, dst_size, 1, mlvf) != 1)
+            {
+                ret = MLV_ERR_READ;
+                break;
+            }
+        }
+
+        if(hdr->blockSize < sizeof(mlv_hdr_t))
+        {
+            ret = MLV_ERR_FORMAT;
+            break;
+        }
+        mlv_walker_skip(&walker, hdr->blockSize);
+
+        if(info->rawi_found && info->idnt_found && (info->rawc_found || type == BT_VIDF || type == BT_AUDF))
+        {
+            ret = 1;
+            break;
+        }
+    }
+    if(!ret && info->rawi_found && info->idnt_found) ret = 1;
+    mlv_walker_close(&walker);
+
+bailout:
+
+    fclose(mlvf);
+    return ret;
+}
+
+/* returns 0 on success, 'data' is NULL for an empty file */
+int mlv_map_file(mlv_mapping_t *mapping, FILE *file)
+{
+    memset(mapping, 0, sizeof(mlv_mapping_t));
+
+    struct stat attr;
+    if(fstat(fileno(file), &attr) || attr.st_size < 0 || (uint64_t)attr.st_size != (size_t)attr.st_size) return -1;
+    mapping->size = attr.st_size;
+    if(!mapping->size) return 0;
+
+#if !defined(__WIN32)
+    void *map = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if(map != MAP_FAILED)
+    {
+        mapping->data = map;
+        mapping->mapped = 1;
+        return 0;
+    }
+#endif
+
+    uint8_t *data = malloc(mapping->size);
+    if(!data) return -1;
+    if(mlv_file_set_pos(file, 0, SEEK_SET) || fread(data, mapping->size, 1, file) != 1)
+    {
+        free(data);
+        return -1;
+    }
+    mapping->data = data;
+    return 0;
+}
+
+void mlv_unmap_file(mlv_mapping_t *mapping)
+{
+#if !defined(__WIN32)
+    if(mapping->mapped) munmap((void *)mapping->data, mapping->size);
+#endif
+    if(!mapping->mapped) free((void *)mapping->data);
+    mapping->data = NULL;
+    mapping->size = 0;
+}
+
+/* Raw frames are a stream of little endian 16 bit words holding the pixels most significant bit first.
+   8 pixels of an even bit depth take 'bits_per_pixel' bytes, so runs starting at a multiple of 8 pixels
+   are unpacked 8 (SSE2) or 16 (AVX2) pixels at a time and packed 8 at a time. Pixel j of such a group spans words a_j and
+   a_j + 1, gathered into lanes A and B, and is (A << u_j | B >> (16 - u_j)) & mask with
+   u_j = bits_per_pixel - 16 + bit offset of the pixel in word a_j. Shifts by lane are multiplies */
+static int raw_kernel = -1;
+
+static inline uint32_t raw_load_word(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8;
+}
+
+static inline void raw_store_word(uint8_t *p, uint32_t word)
+{
+    p[0] = word;
+    p[1] = word >> 8;
+}
+
+/* byte of the word holding bit 'bit' */
+static inline uint64_t raw_word_offset(uint64_t bit)
+{
+    return bit / 16 * 2;
+}
+
+/* bit by bit, the definition of the layout */
+void mlv_raw_unpack_ref(const uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, uint16_t *dst)
+{
+    uint64_t bit = first * bits_per_pixel;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uint32_t value = 0;
+        for(uint32_t j = 0; j < bits_per_pixel; j++, bit++)
+        {
+            value = value << 1 | ((raw_load_word(frame + raw_word_offset(bit)) >> (15 - bit % 16)) & 1);
+        }
+        dst[i] = value;
+    }
+}
+
+void mlv_raw_pack_ref(uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, const uint16_t *src)
+{
+    uint64_t bit = first * bits_per_pixel;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        for(int j = bits_per_pixel - 1; j >= 0; j--, bit++)
+        {
+            uint8_t *p = frame + raw_word_offset(bit);
+            uint32_t mask = 1u << (15 - bit % 16);
+            raw_store_word(p, ((src[i] >> j) & 1) ? raw_load_word(p) | mask : raw_load_word(p) & ~mask);
+        }
+    }
+}
+
+/* a word at a time through a bit accumulator, any bit depth */
+static void raw_unpack_scalar(const uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, uint16_t *dst)
+{
+    if(!count) return;
+    uint64_t bit = first * bits_per_pixel;
+    const uint8_t *p = frame + raw_word_offset(bit) + 2;
+    uint32_t mask = (1u << bits_per_pixel) - 1;
+    uint64_t acc = raw_load_word(p - 2);
+    uint32_t avail = 16 - bit % 16;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(avail < bits_per_pixel)
+        {
+            acc = acc << 16 | raw_load_word(p);
+            p += 2;
+            avail += 16;
+        }
+        avail -= bits_per_pixel;
+        dst[i] = (acc >> avail) & mask;
+    }
+}
+
+/* bits of the first and last word outside the run are kept */
+static void raw_pack_scalar(uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, const uint16_t *src)
+{
+    if(!count) return;
+    uint64_t bit = first * bits_per_pixel;
+    uint8_t *p = frame + raw_word_offset(bit);
+    uint32_t mask = (1u << bits_per_pixel) - 1;
+    uint32_t bits = bit % 16;
+    uint64_t acc = raw_load_word(p) >> (16 - bits);
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        acc = acc << bits_per_pixel | (src[i] & mask);
+        bits += bits_per_pixel;
+        while(bits >= 16)
+        {
+            bits -= 16;
+            raw_store_word(p, acc >> bits);
+            p += 2;
+        }
+    }
+    if(bits)
+    {
+        uint32_t keep = (1u << (16 - bits)) - 1;
+        raw_store_word(p, (acc << (16 - bits) & ~keep) | (raw_load_word(p) & keep));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* the lane multipliers of A << u (low half of the product), A >> -u and B >> (16 - u) (high halves) */
+static void raw_lane_multipliers(uint32_t bits_per_pixel, uint16_t *a_left, uint16_t *a_right, uint16_t *b_right)
+{
+    for(int j = 0; j < 8; j++)
+    {
+        int u = bits_per_pixel - 16 + (j * bits_per_pixel) % 16;
+        a_left[j] = (u >= 0) ? 1 << u : 0;
+        a_right[j] = (u < 0) ? 1 << (16 + u) : 0;
+        b_right[j] = (u > 0) ? 1 << u : 0;
+    }
+}
+
+/* 8 pixels of group words 'v', each half of A and B is 4 words from word 'base' on, picked by 'shuffle' */
+#define RAW_GATHER_SSE2(v, base0, shuffle0, base1, shuffle1) \
+    _mm_unpacklo_epi64(_mm_shufflelo_epi16(_mm_srli_si128(v, 2 * (base0)), shuffle0), \
+                       _mm_shufflelo_epi16(_mm_srli_si128(v, 2 * (base1)), shuffle1))
+
+#define RAW_UNPACK_SSE2(base0, shuffle0, base1, shuffle1) \
+    for(; i < groups; i++) \
+    { \
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * bits_per_pixel)); \
+        __m128i a = RAW_GATHER_SSE2(v, base0, shuffle0, base1, shuffle1); \
+        __m128i b = RAW_GATHER_SSE2(v, base0 + 1, shuffle0, base1 + 1, shuffle1); \
+        __m128i pixels = _mm_or_si128(_mm_or_si128(_mm_mullo_epi16(a, a_left), _mm_mulhi_epu16(a, a_right)), _mm_mulhi_epu16(b, b_right)); \
+        _mm_storeu_si128((__m128i *)(dst + i * 8), _mm_and_si128(pixels, mask)); \
+    }
+
+/* 'groups' groups of 8 pixels, the 16 bytes from each group on have to be readable */
+static void raw_unpack_sse2(const uint8_t *src, size_t groups, uint32_t bits_per_pixel, uint16_t *dst)
+{
+    uint16_t m[3][8];
+    raw_lane_multipliers(bits_per_pixel, m[0], m[1], m[2]);
+    __m128i a_left = _mm_loadu_si128((const __m128i *)m[0]);
+    __m128i a_right = _mm_loadu_si128((const __m128i *)m[1]);
+    __m128i b_right = _mm_loadu_si128((const __m128i *)m[2]);
+    __m128i mask = _mm_set1_epi16((1 << bits_per_pixel) - 1);
+    size_t i = 0;
+
+    /* words a_j: 10 bit 0 0 1 1 2 3 3 4, 12 bit 0 0 1 2 3 3 4 5, 14 bit 0 0 1 2 3 4 5 6 */
+    switch(bits_per_pixel)
+    {
+        case 10:
+            RAW_UNPACK_SSE2(0, _MM_SHUFFLE(1, 1, 0, 0), 2, _MM_SHUFFLE(2, 1, 1, 0));
+            break;
+        case 12:
+            RAW_UNPACK_SSE2(0, _MM_SHUFFLE(2, 1, 0, 0), 3, _MM_SHUFFLE(2, 1, 0, 0));
+            break;
+        case 14:
+            RAW_UNPACK_SSE2(0, _MM_SHUFFLE(2, 1, 0, 0), 3, _MM_SHUFFLE(3, 2, 1, 0));
+            break;
+    }
+}
+
+/* A and B byte indices of each lane of a group, same for both halves of a 256 bit register */
+static void raw_gather_table(uint32_t bits_per_pixel, uint8_t *a, uint8_t *b)
+{
+    for(int j = 0; j < 8; j++)
+    {
+        int word = j * bits_per_pixel / 16;
+        a[2 * j] = a[16 + 2 * j] = 2 * word;
+        a[2 * j + 1] = a[16 + 2 * j + 1] = 2 * word + 1;
+        b[2 * j] = b[16 + 2 * j] = 2 * word + 2;
+        b[2 * j + 1] = b[16 + 2 * j + 1] = 2 * word + 3;
+    }
+}
+
+/* two groups per register, 'groups' is even */
+__attribute__((target("avx2")))
+static void raw_unpack_avx2(const uint8_t *src, size_t groups, uint32_t bits_per_pixel, uint16_t *dst)
+{
+    uint16_t m[3][8];
+    uint8_t t[2][32];
+    raw_lane_multipliers(bits_per_pixel, m[0], m[1], m[2]);
+    raw_gather_table(bits_per_pixel, t[0], t[1]);
+    __m256i a_left = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m[0]));
+    __m256i a_right = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m[1]));
+    __m256i b_right = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m[2]));
+    __m256i a_table = _mm256_loadu_si256((const __m256i *)t[0]);
+    __m256i b_table = _mm256_loadu_si256((const __m256i *)t[1]);
+    __m256i mask = _mm256_set1_epi16((1 << bits_per_pixel) - 1);
+
+    for(size_t i = 0; i < groups; i += 2)
+    {
+        const uint8_t *p = src + i * bits_per_pixel;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                            _mm_loadu_si128((const __m128i *)(p + bits_per_pixel)), 1);
+        __m256i a = _mm256_shuffle_epi8(v, a_table);
+        __m256i b = _mm256_shuffle_epi8(v, b_table);
+        __m256i pixels = _mm256_or_si256(_mm256_or_si256(_mm256_mullo_epi16(a, a_left), _mm256_mulhi_epu16(a, a_right)), _mm256_mulhi_epu16(b, b_right));
+        _mm256_storeu_si256((__m256i *)(dst + i * 8), _mm256_and_si256(pixels, mask));
+    }
+}
+
+/* 4 words, most significant first, as they are stored on a little endian CPU */
+static inline uint64_t raw_word_order(uint64_t words)
+{
+    words = words >> 32 | words << 32;
+    return (words >> 16 & 0x0000ffff0000ffffULL) | (words << 16 & 0xffff0000ffff0000ULL);
+}
+
+/* groups of 4 pixels 'r0' and 'r1', 4 * bits_per_pixel bits each, as the words of a group */
+static inline void raw_store_group(uint8_t *p, uint64_t r0, uint64_t r1, uint32_t bits_per_pixel)
+{
+    uint32_t free_bits = 64 - 4 * bits_per_pixel, rest = 8 * bits_per_pixel - 64;
+    uint64_t hi = raw_word_order(r0 << free_bits | r1 >> rest);
+    uint64_t lo = raw_word_order(r1 << (64 - rest));
+    memcpy(p, &hi, 8);
+    memcpy(p + 8, &lo, rest / 8);
+}
+
+/* pixel pairs are joined by a multiply add (even pixel times 1 << bits_per_pixel plus odd pixel), pairs of pairs by 64 bit shifts */
+static void raw_pack_sse2(uint8_t *dst, size_t groups, uint32_t bits_per_pixel, const uint16_t *src)
+{
+    __m128i mask = _mm_set1_epi16((1 << bits_per_pixel) - 1);
+    __m128i pair = _mm_set1_epi32(1 << bits_per_pixel | 1 << 16);
+    __m128i low = _mm_set1_epi64x(0xffffffff);
+    __m128i quad_shift = _mm_cvtsi32_si128(2 * bits_per_pixel);
+    uint64_t r[2];
+
+    for(size_t i = 0; i < groups; i++)
+    {
+        __m128i pixels = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i * 8)), mask);
+        __m128i pairs = _mm_madd_epi16(pixels, pair);
+        __m128i quads = _mm_or_si128(_mm_sll_epi64(_mm_and_si128(pairs, low), quad_shift), _mm_srli_epi64(pairs, 32));
+        _mm_storeu_si128((__m128i *)r, quads);
+        raw_store_group(dst + i * bits_per_pixel, r[0], r[1], bits_per_pixel);
+    }
+}
+
+#endif
+
+/* kernel used for a bit depth, the vector ones handle 10, 12 and 14 bit */
+static int raw_select(uint32_t bits_per_pixel)
+{
+    int best = MLV_RAW_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+    if(bits_per_pixel == 10 || bits_per_pixel == 12 || bits_per_pixel == 14)
+    {
+        best = (__builtin_cpu_supports("avx2")) ? MLV_RAW_AVX2 : MLV_RAW_SSE2;
+    }
+#endif
+    return (raw_kernel >= 0 && raw_kernel < best) ? raw_kernel : best;
+}
+
+/* limits the kernels used by mlv_raw_unpack() and mlv_raw_pack() for tests and benchmarks, -1 selects the fastest one
+   again. Returns the kernel now used for 14 bit */
+int mlv_raw_set_kernel(int kernel)
+{
+    raw_kernel = kernel;
+    return raw_select(14);
+}
+
+/* bytes of a frame, whole words */
+size_t mlv_raw_frame_size(uint32_t width, uint32_t height, uint32_t bits_per_pixel)
+{
+    return ((uint64_t)width * height * bits_per_pixel + 15) / 16 * 2;
+}
+
+/* pixels 'first' .. 'first' + 'count' - 1 of the frame, only the words holding them are accessed */
+void mlv_raw_unpack(const uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, uint16_t *dst)
+{
+    int kernel = raw_select(bits_per_pixel);
+    if(kernel == MLV_RAW_REFERENCE)
+    {
+        mlv_raw_unpack_ref(frame, first, count, bits_per_pixel, dst);
+        return;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if(kernel >= MLV_RAW_SSE2)
+    {
+        /* up to the first group, then as many groups as the 16 byte loads stay inside the run */
+        uint32_t head = (8 - first % 8) % 8;
+        if(head > count) head = count;
+        raw_unpack_scalar(frame, first, head, bits_per_pixel, dst);
+        first += head;
+        count -= head;
+        dst += head;
+
+        const uint8_t *src = frame + first / 8 * bits_per_pixel;
+        uint64_t end = raw_word_offset((first + count) * bits_per_pixel + 15) - first / 8 * bits_per_pixel;
+        size_t groups = count / 8;
+        size_t safe = (end >= 16) ? (end - 16) / bits_per_pixel + 1 : 0;
+        if(groups > safe) groups = safe;
+
+        size_t done = 0;
+        if(kernel == MLV_RAW_AVX2)
+        {
+            done = groups & ~(size_t)1;
+            raw_unpack_avx2(src, done, bits_per_pixel, dst);
+        }
+        raw_unpack_sse2(src + done * bits_per_pixel, groups - done, bits_per_pixel, dst + done * 8);
+        first += groups * 8;
+        count -= groups * 8;
+        dst += groups * 8;
+    }
+#endif
+    raw_unpack_scalar(frame, first, count, bits_per_pixel, dst);
+}
+
+/* values are cut to 'bits_per_pixel', bits of other pixels in the words written are kept */
+void mlv_raw_pack(uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, const uint16_t *src)
+{
+    int kernel = raw_select(bits_per_pixel);
+    if(kernel == MLV_RAW_REFERENCE)
+    {
+        mlv_raw_pack_ref(frame, first, count, bits_per_pixel, src);
+        return;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if(kernel >= MLV_RAW_SSE2 && count >= 8)
+    {
+        uint32_t head = (8 - first % 8) % 8;
+        raw_pack_scalar(frame, first, head, bits_per_pixel, src);
+        first += head;
+        count -= head;
+        src += head;
+
+        /* whole groups only write their own words, AVX2 would not be faster as the stores are the limit */
+        size_t groups = count / 8;
+        raw_pack_sse2(frame + first / 8 * bits_per_pixel, groups, bits_per_pixel, src);
+        first += groups * 8;
+        count -= groups * 8;
+        src += groups * 8;
+    }
+#endif
+    raw_pack_scalar(frame, first, count, bits_per_pixel, src);
+}
+
+/* Lossless JPEG (ITU T.81 process 14) as written by the cameras: one scan of interleaved components, sampling
+   1x1, Huffman coded differences to one of the predictors 1..7. Rows are entropy decoded into the output
+   first and predicted in a second loop per predictor, which the compiler vectorizes where there is no left
+   neighbour. Codes up to LJ92_LOOKUP_BITS long take one table lookup, which for the short codes of the
+   small differences most samples have also yields the difference, longer ones are searched by length */
+#define LJ92_LOOKUP_BITS    12
+
+typedef struct {
+    uint32_t    lookup[1 << LJ92_LOOKUP_BITS];  /* see lj92_build_table(), 0 for longer codes */
+    int32_t     max_code[17];                   /* largest code of each length, -1 if there is none */
+    int32_t     offset[17];                     /* index of the value of a code minus the first code of its length */
+    uint8_t     values[256];
+    int         defined;
+} lj92_table_t;
+
+typedef struct {
+    mlv_lj92_info_t info;
+    uint32_t        restart_interval;           /* samples of each component between restart markers, 0 if none */
+    uint32_t        point_transform;
+    int             table_of[4];                /* table of each scan component */
+    lj92_table_t    tables[4];
+    const uint8_t   *scan;                      /* entropy coded data */
+    const uint8_t   *end;
+} lj92_header_t;
+
+/* bits of the entropy coded data, most significant first. Stuffed zero bytes are dropped, at a marker or the
+   end of data zero bits are fed */
+typedef struct {
+    const uint8_t   *p;
+    const uint8_t   *end;
+    uint64_t        bits;
+    int             count;
+    int             marker;
+} lj92_reader_t;
+
+static inline uint32_t lj92_be16(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+static int lj92_build_table(lj92_table_t *t, const uint8_t *counts, const uint8_t *values, int value_count)
+{
+    memset(t, 0, sizeof(lj92_table_t));
+    memcpy(t->values, values, value_count);
+
+    int32_t code = 0;
+    int index = 0;
+    for(int length = 1; length <= 16; length++)
+    {
+        t->offset[length] = index - code;
+        for(int i = 0; i < counts[length - 1]; i++, index++, code++)
+        {
+            if(values[index] > 16 || code >= 1 << length) return -1;
+            /* short codes with their magnitude bits give the difference right away: bits used << 24 | 1 << 23 |
+               difference + 32768, others the code length << 8 | category */
+            if(length <= LJ92_LOOKUP_BITS)
+            {
+                int shift = LJ92_LOOKUP_BITS - length;
+                int category = values[index];
+                for(int j = 0; j < 1 << shift; j++)
+                {
+                    uint32_t entry = length << 8 | category;
+                    if(category == 0 || category == 16) entry = (uint32_t)length << 24 | 1 << 23 | ((category) ? 65536 : 32768);
+                    else if(length + category <= LJ92_LOOKUP_BITS)
+                    {
+                        int32_t value = (j >> (shift - category)) & ((1 << category) - 1);
+                        if(value < 1 << (category - 1)) value += 1 - (1 << category);
+                        entry = (uint32_t)(length + category) << 24 | 1 << 23 | (value + 32768);
+                    }
+                    t->lookup[(code << shift) + j] = entry;
+                }
+            }
+        }
+        t->max_code[length] = (counts[length - 1]) ? code - 1 : -1;
+        code <<= 1;
+    }
+    t->defined = 1;
+    return 0;
+}
+
+static int lj92_parse(const uint8_t *data, size_t size, lj92_header_t *h)
+{
+    memset(&h->info, 0, sizeof(mlv_lj92_info_t));
+    h->restart_interval = 0;
+    for(int i = 0; i < 4; i++) h->tables[i].defined = 0;
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8) return -1;
+
+    int component_ids[4] = { 0 };
+    size_t pos = 2;
+    for(;;)
+    {
+        while(pos < size && data[pos] == 0xFF && pos + 1 < size && data[pos + 1] == 0xFF) pos++;
+        if(pos + 4 > size || data[pos] != 0xFF) return -1;
+        int marker = data[pos + 1];
+        uint32_t length = lj92_be16(data + pos + 2);
+        if(length < 2 || pos + 2 + length > size) return -1;
+        const uint8_t *segment = data + pos + 4;
+        length -= 2;
+
+        if(marker == 0xC4)
+        {
+            for(uint32_t used = 0, value_count = 0; used < length; used += 17 + value_count)
+            {
+                const uint8_t *table = segment + used;
+                if(length - used < 17 || (table[0] >> 4) || (table[0] & 15) > 3) return -1;
+                value_count = 0;
+                for(int i = 0; i < 16; i++) value_count += table[1 + i];
+                if(value_count > 256 || length - used < 17 + value_count) return -1;
+                if(lj92_build_table(&h->tables[table[0] & 15], table + 1, table + 17, value_count)) return -1;
+            }
+        }
+        else if(marker == 0xC3)
+        {
+            if(length < 6) return -1;
+            h->info.bits_per_sample = segment[0];
+            h->info.height = lj92_be16(segment + 1);
+            h->info.width = lj92_be16(segment + 3);
+            h->info.components = segment[5];
+            if(h->info.components < 1 || h->info.components > 4 || length < 6 + 3 * h->info.components) return -1;
+            if(h->info.bits_per_sample < 2 || h->info.bits_per_sample > 16 || !h->info.width || !h->info.height) return -1;
+            for(uint32_t i = 0; i < h->info.components; i++)
+            {
+                component_ids[i] = segment[6 + 3 * i];
+                if(segment[7 + 3 * i] != 0x11) return -1;
+            }
+        }
+        else if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC8 && marker != 0xCC)
+        {
+            /* other processes */
+            return -1;
+        }
+        else if(marker == 0xDD)
+        {
+            if(length < 2) return -1;
+            h->restart_interval = lj92_be16(segment);
+        }
+        else if(marker == 0xDA)
+        {
+            if(!h->info.components || length < 1 || segment[0] != h->info.components || length < 4 + 2 * h->info.components) return -1;
+            for(uint32_t i = 0; i < h->info.components; i++)
+            {
+                int table = segment[2 + 2 * i] >> 4;
+                if(segment[1 + 2 * i] != component_ids[i] || table > 3 || !h->tables[table].defined) return -1;
+                h->table_of[i] = table;
+            }
+            h->info.predictor = segment[1 + 2 * h->info.components];
+            h->point_transform = segment[3 + 2 * h->info.components] & 15;
+            if(h->info.predictor < 1 || h->info.predictor > 7 || h->point_transform >= h->info.bits_per_sample) return -1;
+            h->scan = segment + length;
+            h->end = data + size;
+            return 0;
+        }
+        else if(marker == 0xD9 || marker == 0xD8)
+        {
+            return -1;
+        }
+        pos += 4 + length;
+    }
+}
+
+int mlv_lj92_info(const uint8_t *data, size_t size, mlv_lj92_info_t *info)
+{
+    lj92_header_t h;
+    if(lj92_parse(data, size, &h)) return -1;
+    *info = h.info;
+    return 0;
+}
+
+static inline void lj92_fill(lj92_reader_t *r)
+{
+    while(r->count <= 56)
+    {
+        uint32_t byte = 0;
+        if(!r->marker && r->p < r->end)
+        {
+            byte = *r->p;
+            if(byte != 0xFF) r->p++;
+            else if(r->p + 1 < r->end && !r->p[1]) r->p += 2;
+            else
+            {
+                r->marker = 1;
+                byte = 0;
+            }
+        }
+        r->bits |= (uint64_t)byte << (56 - r->count);
+        r->count += 8;
+    }
+}
+
+/* difference of the next sample, -1 for codes not in the table */
+static inline int lj92_diff(lj92_reader_t *r, const lj92_table_t *t, int32_t *diff)
+{
+    if(r->count < 32) lj92_fill(r);
+
+    int length, category;
+    uint32_t entry = t->lookup[r->bits >> (64 - LJ92_LOOKUP_BITS)];
+    if(entry & 1 << 23)
+    {
+        length = entry >> 24;
+        r->bits <<= length;
+        r->count -= length;
+        *diff = (int32_t)(entry & 0x1FFFF) - 32768;
+        return 0;
+    }
+    else if(entry)
+    {
+        length = entry >> 8;
+        category = entry & 0xFF;
+    }
+    else
+    {
+        int32_t code = 0;
+        for(length = LJ92_LOOKUP_BITS + 1; length <= 16; length++)
+        {
+            code = (int32_t)(r->bits >> (64 - length));
+            if(code <= t->max_code[length]) break;
+        }
+        if(length > 16) return -1;
+        category = t->values[code + t->offset[length]];
+    }
+    r->bits <<= length;
+    r->count -= length;
+
+    if(category == 0 || category == 16)
+    {
+        *diff = (category) ? 32768 : 0;
+        return 0;
+    }
+    int32_t value = (int32_t)(r->bits >> (64 - category));
+    r->bits <<= category;
+    r->count -= category;
+    *diff = (value < 1 << (category - 1)) ? value - (1 << category) + 1 : value;
+    return 0;
+}
+
+/* adds the prediction to the differences in 'row', the first sample of each component is predicted from above */
+static void lj92_predict_row(uint16_t *restrict row, const uint16_t *restrict above, uint32_t length, uint32_t components, int predictor)
+{
+    uint32_t c = components;
+    for(uint32_t i = 0; i < c; i++) row[i] += above[i];
+    switch(predictor)
+    {
+        case 1:
+            for(uint32_t i = c; i < length; i++) row[i] += row[i - c];
+            break;
+        case 2:
+            for(uint32_t i = c; i < length; i++) row[i] += above[i];
+            break;
+        case 3:
+            for(uint32_t i = c; i < length; i++) row[i] += above[i - c];
+            break;
+        case 4:
+            for(uint32_t i = c; i < length; i++) row[i] += row[i - c] + above[i] - above[i - c];
+            break;
+        case 5:
+            for(uint32_t i = c; i < length; i++) row[i] += row[i - c] + (((int32_t)above[i] - above[i - c]) >> 1);
+            break;
+        case 6:
+            for(uint32_t i = c; i < length; i++) row[i] += above[i] + (((int32_t)row[i - c] - above[i - c]) >> 1);
+            break;
+        case 7:
+            for(uint32_t i = c; i < length; i++) row[i] += ((uint32_t)row[i - c] + above[i]) >> 1;
+            break;
+    }
+}
+
+/* the samples in scan order, all components of a row interleaved, which for the cameras is the raw frame
+   order. 'count' has to hold width x height x components samples */
+int mlv_lj92_decode(const uint8_t *data, size_t size, uint16_t *dst, size_t count)
+{
+    lj92_header_t h;
+    if(lj92_parse(data, size, &h)) return -1;
+
+    uint32_t c = h.info.components;
+    uint32_t length = h.info.width * c;
+    if((uint64_t)length * h.info.height > count) return -1;
+
+    /* restarts are supported at row starts, where they reset prediction like the first row */
+    uint32_t restart_rows = 0;
+    if(h.restart_interval)
+    {
+        if(h.restart_interval % h.info.width) return -1;
+        restart_rows = h.restart_interval / h.info.width;
+    }
+
+    const lj92_table_t *tables[4];
+    for(uint32_t i = 0; i < c; i++) tables[i] = &h.tables[h.table_of[i]];
+
+    lj92_reader_t r = { h.scan, h.end, 0, 0, 0 };
+    uint16_t initial = 1 << (h.info.bits_per_sample - h.point_transform - 1);
+    for(uint32_t y = 0; y < h.info.height; y++)
+    {
+        uint16_t *row = dst + (size_t)y * length;
+        int first = (y == 0);
+        if(restart_rows && y && y % restart_rows == 0)
+        {
+            if(r.p + 1 >= r.end || r.p[0] != 0xFF || (r.p[1] & 0xF8) != 0xD0) return -1;
+            r.p += 2;
+            r.bits = 0;
+            r.count = 0;
+            r.marker = 0;
+            first = 1;
+        }
+
+        int32_t diff;
+        if(c == 1)
+        {
+            for(uint32_t i = 0; i < length; i++)
+            {
+                if(lj92_diff(&r, tables[0], &diff)) return -1;
+                row[i] = (uint16_t)diff;
+            }
+        }
+        else
+        {
+            for(uint32_t i = 0; i < length; i += c)
+            {
+                for(uint32_t j = 0; j < c; j++)
+                {
+                    if(lj92_diff(&r, tables[j], &diff)) return -1;
+                    row[i + j] = (uint16_t)diff;
+                }
+            }
+        }
+
+        if(first)
+        {
+            for(uint32_t i = 0; i < c; i++) row[i] += initial;
+            for(uint32_t i = c; i < length; i++) row[i] += row[i - c];
+        }
+        else
+        {
+            lj92_predict_row(row, row - length, length, c, h.info.predictor);
+        }
+    }
+
+    if(h.point_transform)
+    {
+        for(size_t i = 0; i < (size_t)length * h.info.height; i++) dst[i] <<= h.point_transform;
+    }
+    return 0;
+}
+
+/* bytes a frame of 'count' samples can take at most: 31 bits of code and magnitude per sample, every byte stuffed */
+size_t mlv_lj92_max_size(uint32_t width, uint32_t height, uint32_t components)
+{
+    return (size_t)width * height * components * 8 + 1024;
+}
+
+/* Huffman code lengths limited to 16 bits for the 17 difference categories, ITU T.81 annex K.2 and K.3. A reserved
+   symbol keeps codes of all ones unused */
+static void lj92_code_lengths(const uint32_t *frequency, uint8_t *counts, uint8_t *values, int *value_count)
+{
+    uint64_t freq[18];
+    int size[18] = { 0 }, others[18];
+    for(int i = 0; i < 17; i++) freq[i] = frequency[i];
+    freq[17] = 1;
+    for(int i = 0; i < 18; i++) others[i] = -1;
+
+    for(;;)
+    {
+        int v1 = -1, v2 = -1;
+        for(int i = 0; i < 18; i++) if(freq[i] && (v1 < 0 || freq[i] <= freq[v1])) v1 = i;
+        for(int i = 0; i < 18; i++) if(freq[i] && i != v1 && (v2 < 0 || freq[i] <= freq[v2])) v2 = i;
+        if(v2 < 0) break;
+
+        freq[v1] += freq[v2];
+        freq[v2] = 0;
+        for(size[v1]++; others[v1] >= 0; size[v1]++) v1 = others[v1];
+        others[v1] = v2;
+        for(size[v2]++; others[v2] >= 0; size[v2]++) v2 = others[v2];
+    }
+
+    int bits[33] = { 0 };
+    for(int i = 0; i < 18; i++) if(size[i]) bits[size[i]]++;
+    for(int i = 32; i > 16; i--)
+    {
+        while(bits[i] > 0)
+        {
+            int j = i - 2;
+            while(!bits[j]) j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    int longest = 16;
+    while(!bits[longest]) longest--;
+    bits[longest]--;
+
+    for(int i = 0; i < 16; i++) counts[i] = bits[i + 1];
+    *value_count = 0;
+    for(int length = 1; length <= 32; length++)
+    {
+        for(int i = 0; i < 17; i++) if(size[i] == length) values[(*value_count)++] = i;
+    }
+}
+
+/* differences of a row to the predictor, the mirror of lj92_predict_row(), vectorizable as all samples are known */
+static void lj92_diff_row(int16_t *restrict diff, const uint16_t *restrict row, const uint16_t *restrict above, uint32_t length, uint32_t components, int predictor, uint16_t initial)
+{
+    uint32_t c = components;
+    if(!above)
+    {
+        for(uint32_t i = 0; i < c; i++) diff[i] = (int16_t)(row[i] - initial);
+        for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - row[i - c]);
+        return;
+    }
+
+    for(uint32_t i = 0; i < c; i++) diff[i] = (int16_t)(row[i] - above[i]);
+    switch(predictor)
+    {
+        case 1:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - row[i - c]);
+            break;
+        case 2:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - above[i]);
+            break;
+        case 3:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - above[i - c]);
+            break;
+        case 4:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - (row[i - c] + above[i] - above[i - c]));
+            break;
+        case 5:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - (row[i - c] + (((int32_t)above[i] - above[i - c]) >> 1)));
+            break;
+        case 6:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - (above[i] + (((int32_t)row[i - c] - above[i - c]) >> 1)));
+            break;
+        case 7:
+            for(uint32_t i = c; i < length; i++) diff[i] = (int16_t)(row[i] - (((uint32_t)row[i - c] + above[i]) >> 1));
+            break;
+    }
+}
+
+/* category of a difference, 32768 is the only one of category 16 */
+static inline int lj92_category(int16_t diff)
+{
+    uint32_t magnitude = (diff < 0) ? -(int32_t)diff : diff;
+    return (magnitude) ? 32 - __builtin_clz(magnitude) : 0;
+}
+
+/* bits are collected most significant first and stored 32 at a time, bytes of 0xFF get a zero byte stuffed */
+typedef struct {
+    uint8_t     *p;
+    uint8_t     *end;
+    uint64_t    bits;
+    int         count;
+} lj92_writer_t;
+
+static inline int lj92_put(lj92_writer_t *w, uint32_t code, int length)
+{
+    w->bits = w->bits << length | code;
+    w->count += length;
+    if(w->count < 32) return 0;
+
+    w->count -= 32;
+    uint32_t word = (uint32_t)(w->bits >> w->count);
+    if(w->end - w->p < 8) return -1;
+    if(!((~word - 0x01010101u) & word & 0x80808080u))
+    {
+        word = __builtin_bswap32(word);
+        memcpy(w->p, &word, 4);
+        w->p += 4;
+        return 0;
+    }
+    for(int shift = 24; shift >= 0; shift -= 8)
+    {
+        uint8_t byte = word >> shift;
+        *w->p++ = byte;
+        if(byte == 0xFF) *w->p++ = 0;
+    }
+    return 0;
+}
+
+/* 'src' in scan order, as mlv_lj92_decode() returns it. Returns the size of the image or 0 if 'capacity' is too
+   small, which mlv_lj92_max_size() never is, or a parameter out of range */
+size_t mlv_lj92_encode(const uint16_t *src, uint32_t width, uint32_t height, uint32_t components, uint32_t bits_per_sample, int predictor, uint8_t *dst, size_t capacity)
+{
+    uint32_t c = components;
+    if(c < 1 || c > 4 || bits_per_sample < 2 || bits_per_sample > 16 || predictor < 1 || predictor > 7) return 0;
+    if(!width || !height || width > 65535 || height > 65535) return 0;
+
+    uint32_t length = width * c;
+    uint16_t initial = 1 << (bits_per_sample - 1);
+    int16_t *diff = malloc(sizeof(int16_t) * length);
+    if(!diff) return 0;
+
+    /* a table per component from the categories of the frame */
+    uint32_t frequency[4][17] = { { 0 } };
+    for(uint32_t y = 0; y < height; y++)
+    {
+        const uint16_t *row = src + (size_t)y * length;
+        lj92_diff_row(diff, row, (y) ? row - length : NULL, length, c, predictor, initial);
+        for(uint32_t i = 0; i < length; i += c)
+        {
+            for(uint32_t j = 0; j < c; j++) frequency[j][lj92_category(diff[i + j])]++;
+        }
+    }
+
+    uint8_t header[1024];
+    uint8_t *h = header;
+    uint32_t codes[4][17];
+    uint8_t lengths[4][17];
+    *h++ = 0xFF;
+    *h++ = 0xD8;
+    for(uint32_t j = 0; j < c; j++)
+    {
+        uint8_t counts[16], values[17];
+        int value_count;
+        lj92_code_lengths(frequency[j], counts, values, &value_count);
+
+        uint32_t code = 0;
+        int index = 0;
+        for(int bits = 1; bits <= 16; bits++, code <<= 1)
+        {
+            for(int i = 0; i < counts[bits - 1]; i++, index++, code++)
+            {
+                codes[j][values[index]] = code;
+                lengths[j][values[index]] = bits;
+            }
+        }
+
+        uint32_t segment = 2 + 1 + 16 + value_count;
+        *h++ = 0xFF;
+        *h++ = 0xC4;
+        *h++ = segment >> 8;
+        *h++ = segment;
+        *h++ = j;
+        memcpy(h, counts, 16);
+        memcpy(h + 16, values, value_count);
+        h += 16 + value_count;
+    }
+
+    uint8_t frame[] = { 0xFF, 0xC3, 0, 8 + 3 * c, bits_per_sample, height >> 8, height, width >> 8, width, c };
+    memcpy(h, frame, sizeof(frame));
+    h += sizeof(frame);
+    for(uint32_t j = 0; j < c; j++)
+    {
+        *h++ = j + 1;
+        *h++ = 0x11;
+        *h++ = 0;
+    }
+    uint8_t scan[] = { 0xFF, 0xDA, 0, 6 + 2 * c, c };
+    memcpy(h, scan, sizeof(scan));
+    h += sizeof(scan);
+    for(uint32_t j = 0; j < c; j++)
+    {
+        *h++ = j + 1;
+        *h++ = j << 4;
+    }
+    *h++ = predictor;
+    *h++ = 0;
+    *h++ = 0;
+
+    size_t size = 0;
+    lj92_writer_t w = { dst + (h - header), dst + capacity, 0, 0 };
+    if(capacity < (size_t)(h - header) + 2) goto bailout;
+    memcpy(dst, header, h - header);
+
+    for(uint32_t y = 0; y < height; y++)
+    {
+        const uint16_t *row = src + (size_t)y * length;
+        lj92_diff_row(diff, row, (y) ? row - length : NULL, length, c, predictor, initial);
+        for(uint32_t i = 0; i < length; i += c)
+        {
+            for(uint32_t j = 0; j < c; j++)
+            {
+                int32_t d = diff[i + j];
+                int category = lj92_category(d);
+                uint32_t magnitude = (category == 16) ? 0 : (uint32_t)((d < 0) ? d - 1 : d) & ((1u << category) - 1);
+                int extra = (category == 16) ? 0 : category;
+                if(lj92_put(&w, codes[j][category] << extra | magnitude, lengths[j][category] + extra)) goto bailout;
+            }
+        }
+    }
+
+    /* the last byte is filled up with ones */
+    int pad = (8 - w.count % 8) % 8;
+    if(pad && lj92_put(&w, (1u << pad) - 1, pad)) goto bailout;
+    while(w.count)
+    {
+        if(w.end - w.p < 4) goto bailout;
+        w.count -= 8;
+        uint8_t byte = w.bits >> w.count;
+        *w.p++ = byte;
+        if(byte == 0xFF) *w.p++ = 0;
+    }
+    if(w.end - w.p < 2) goto bailout;
+    *w.p++ = 0xFF;
+    *w.p++ = 0xD9;
+    size = w.p - dst;
+
+bailout:
+
+    free(diff);
+    return size;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2016 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _mlv_h_
+#define _mlv_h_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MLV_VIDEO_CLASS_FLAG_LJ92    0x20
+
+/* block type as little endian 32 bit value of its FourCC */
+#define MLV_FOURCC(a,b,c,d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+enum block_type { BT_NONE, BT_VIDF, BT_AUDF, BT_NULL, BT_RTCI, BT_XREF, BT_RAWI, BT_WAVI, BT_EXPO, BT_LENS, BT_IDNT, BT_INFO, BT_WBAL, BT_STYL, BT_MARK, BT_ELVL, BT_DEBG, BT_BKUP, BT_MLVI,
+                  BT_RAWC, BT_DISO, BT_VERS, BT_ELNS, BT_BIDX, BT_COUNT };
+
+enum mlv_error { MLV_ERR_OPEN = -1, MLV_ERR_READ = -2, MLV_ERR_FORMAT = -3 };
+
+/* on disk layout, packed and fixed width regardless of the platform data model. Block headers
+   are read in place from mapped files at any offset, info blocks are only copied out and keep
+   4 byte alignment so their fields can be passed by pointer */
+typedef struct {
+    uint8_t     blockType[4];
+    uint32_t    blockSize;
+    uint64_t    timestamp;
+} __attribute__((packed)) mlv_hdr_t;
+
+typedef struct {
+    uint8_t     fileMagic[4];
+    uint32_t    blockSize;
+    uint8_t     versionString[8];
+    uint64_t    fileGuid;
+    uint16_t    fileNum;
+    uint16_t    fileCount;
+    uint32_t    fileFlags;
+    uint16_t    videoClass;
+    uint16_t    audioClass;
+    uint32_t    videoFrameCount;
+    uint32_t    audioFrameCount;
+    uint32_t    sourceFpsNom;
+    uint32_t    sourceFpsDenom;
+} __attribute__((packed, aligned(4))) mlv_file_hdr_t;
+
+typedef struct {
+    uint8_t     blockType[4];
+    uint32_t    blockSize;
+    uint64_t    timestamp;
+    uint32_t    frameNumber;
+    uint16_t    cropPosX;
+    uint16_t    cropPosY;
+    uint16_t    panPosX;
+    uint16_t    panPosY;
+    uint32_t    frameSpace;
+} __attribute__((packed)) mlv_vidf_hdr_t;
+
+typedef struct {
+    uint8_t     blockType[4];
+    uint32_t    blockSize;
+    uint64_t    timestamp;
+    uint32_t    frameNumber;
+    uint32_t    frameSpace;
+} __attribute__((packed)) mlv_audf_hdr_t;
+
+typedef struct {
+    uint8_t     blockType[4];
+    uint32_t    blockSize;
+    uint64_t    timestamp;
+    uint16_t    xRes;
+    uint16_t    yRes;
+    uint32_t    dummy;
+    uint32_t    crop;
+    uint32_t    height;
+    uint32_t    width;
+    uint32_t    pitch;
+    uint32_t    frame_size;
+    uint32_t    bits_per_pixel;
+    uint32_t    black_level;
+    uint32_t    white_level;
+} __attribute__((packed, aligned(4))) mlv_rawi_hdr_t;
+
+typedef struct {
+    uint8_t     blockType[4];
+    uint32_t    blockSize;
+    uint64_t    timestamp;
+    uint16_t    sensor_res_x;
+    uint16_t    sensor_res_y;
+    uint16_t    sensor_crop;
+    uint16_t    reserved;
+    uint8_t     binning_x;
+    uint8_t     skipping_x;
+    uint8_t     binning_y;
+    uint8_t     skipping_y;
+    int16_t     offset_x;
+    int16_t     offset_y;
+} __attribute__((packed, aligned(4))) mlv_rawc_hdr_t;
+
+typedef struct {
+    uint8_t     blockType[4];
+    uint32_t    blockSize;
+    uint64_t    timestamp;
+    uint8_t     cameraName[32];
+    uint32_t    cameraModel;
+    uint8_t     cameraSerial[32];
+} __attribute__((packed, aligned(4))) mlv_idnt_hdr_t;
+
+/* block index sidecar '<file>.bidx' written by mlv_setframes, header is followed by
+   entryCount entries sorted by timestamp like XREF entries, then by frameTableCount
+   u32 entry indices of VIDF frameNumber (firstFrame + slot), MLV_BIDX_NO_ENTRY for
+   missing frames. Everything is little endian and naturally aligned for mapping */
+typedef struct {
+    uint8_t     magic[4];           /* "BIDX" */
+    uint32_t    headerSize;
+    uint32_t    version;
+    uint32_t    entrySize;
+    uint64_t    fileGuid;           /* GUID of the indexed clip */
+    uint32_t    entryCount;
+    uint32_t    videoCount;
+    uint32_t    audioCount;
+    uint32_t    firstFrame;         /* lowest VIDF frameNumber */
+    uint32_t    frameTableCount;    /* 0 if there is no frame table */
+    uint16_t    fileCount;          /* chunks of the clip */
+    uint16_t    reserved;
+    uint64_t    entriesOffset;
+    uint64_t    frameTableOffset;
+} __attribute__((packed)) mlv_bidx_hdr_t;
+
+typedef struct {
+    uint64_t    offset;             /* block offset inside its chunk */
+    uint64_t    timestamp;
+    uint32_t    blockSize;
+    uint32_t    frameNumber;
+    uint8_t     blockType[4];
+    uint16_t    fileNum;            /* chunk the block belongs to */
+    uint16_t    reserved;
+} __attribute__((packed)) mlv_bidx_entry_t;
+
+#define MLV_BIDX_NO_ENTRY    0xFFFFFFFF
+
+/* asynchronous read engine of the walker, see mlv_walker_set_async() */
+typedef struct mlv_aio mlv_aio_t;
+
+/* reads done for a walker and the system calls they took (seek and read, io_uring_enter or pread) */
+typedef struct {
+    uint64_t        reads;
+    uint64_t        read_bytes;
+    uint64_t        syscalls;
+} mlv_io_stats_t;
+
+/* walks block headers either in place inside a read only mapping of the whole file,
+   in spans read ahead by 'aio' or, where the file can not be mapped, with buffered
+   reads into 'buf' */
+typedef struct {
+    FILE            *file;
+    mlv_aio_t       *aio;
+    const uint8_t   *map;
+    uint64_t        map_size;
+    uint64_t        pos;
+    uint8_t         buf[sizeof(mlv_vidf_hdr_t)];
+    mlv_io_stats_t  io;             /* complete after mlv_walker_close() */
+} mlv_walker_t;
+
+/* info blocks of one file, filled by mlv_parse_info() */
+typedef struct {
+    mlv_file_hdr_t  file_hdr;
+    mlv_rawi_hdr_t  rawi_hdr;
+    mlv_rawc_hdr_t  rawc_hdr;
+    mlv_idnt_hdr_t  idnt_hdr;
+    int             rawi_found;
+    int             rawc_found;
+    int             idnt_found;
+} mlv_info_t;
+
+int mlv_file_set_pos(FILE *stream, int64_t offset, int whence);
+int mlv_block_type(const uint8_t *blockType);
+const char *mlv_block_type_name(int block_type);
+
+void mlv_walker_init(mlv_walker_t *w, FILE *file, uint64_t pos);
+int mlv_walker_set_async(mlv_walker_t *w, int depth);
+void mlv_walker_close(mlv_walker_t *w);
+size_t mlv_walker_next(mlv_walker_t *w, const uint8_t **block);
+void mlv_walker_skip(mlv_walker_t *w, uint64_t size);
+uint64_t mlv_walker_file_size(mlv_walker_t *w);
+
+/* no block header chain found by mlv_walker_resync() */
+#define MLV_NO_SYNC    UINT64_MAX
+
+int mlv_walker_valid_chain(mlv_walker_t *w, uint64_t pos, int chain, uint64_t min_timestamp);
+uint64_t mlv_walker_resync(mlv_walker_t *w, uint64_t from, uint64_t to, uint64_t min_timestamp);
+
+int mlv_parse_info(mlv_info_t *info, const char *mlv_name);
+
+/* whole file read only, mapped where possible and read into memory otherwise */
+typedef struct {
+    const uint8_t   *data;
+    uint64_t        size;
+    int             mapped;
+} mlv_mapping_t;
+
+int mlv_map_file(mlv_mapping_t *mapping, FILE *file);
+void mlv_unmap_file(mlv_mapping_t *mapping);
+
+/* Raw frame pixels, packed like Magic Lantern raw buffers: 16 bit little endian words holding the pixels
+   most significant bit first, rows without padding. 'first' counts pixels from the start of the frame,
+   bit depths are 1..16, vector kernels are used for 10, 12 and 14 bit. Frames may be shared by threads
+   as long as their runs do not share words */
+enum mlv_raw_kernel { MLV_RAW_REFERENCE, MLV_RAW_SCALAR, MLV_RAW_SSE2, MLV_RAW_AVX2 };
+
+size_t mlv_raw_frame_size(uint32_t width, uint32_t height, uint32_t bits_per_pixel);
+void mlv_raw_unpack(const uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, uint16_t *dst);
+void mlv_raw_pack(uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, const uint16_t *src);
+/* bit exact references of the above */
+void mlv_raw_unpack_ref(const uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, uint16_t *dst);
+void mlv_raw_pack_ref(uint8_t *frame, uint64_t first, uint32_t count, uint32_t bits_per_pixel, const uint16_t *src);
+int mlv_raw_set_kernel(int kernel);
+
+/* lossless JPEG (LJ92) frames of compressed clips, the samples of all components make up the raw frame */
+typedef struct {
+    uint32_t        width;              /* samples of each component per row */
+    uint32_t        height;
+    uint32_t        components;
+    uint32_t        bits_per_sample;
+    uint32_t        predictor;
+} mlv_lj92_info_t;
+
+int mlv_lj92_info(const uint8_t *data, size_t size, mlv_lj92_info_t *info);
+int mlv_lj92_decode(const uint8_t *data, size_t size, uint16_t *dst, size_t count);
+size_t mlv_lj92_max_size(uint32_t width, uint32_t height, uint32_t components);
+size_t mlv_lj92_encode(const uint16_t *src, uint32_t width, uint32_t height, uint32_t components, uint32_t bits_per_sample, int predictor, uint8_t *dst, size_t capacity);
+
+#endif
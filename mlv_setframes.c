@@ -18,59 +18,191 @@
  * Boston, MA  02110-1301, USA.
  */
 
-#include "stdint.h"
-#include "stdio.h"
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <time.h>
 #include <utime.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
-#include "string.h"
+#include <string.h>
+#include <strings.h>
+#if defined(__WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+#include "mlv.h"
+
+#define FAST_PROBES_DEFAULT 16
+#define ASYNC_DEPTH_DEFAULT 16
+#define SPLIT_MIN_REGION    (64 * 1024 * 1024)
+#define PROGRESS_DEFAULT    200     /* ms between progress lines */
+
+int spanned_mode = 0;
+int index_mode = 0;
+int fast_probes = 0;
+int async_depth = 0;
+int split_regions = 0;
+int recover_mode = 0;
+int progress_interval = PROGRESS_DEFAULT;
+int stats_mode = 0;
+char *stats_file = NULL;
+
+/* VIDF/AUDF blocks collected for the block index sidecar */
+typedef struct {
+    mlv_bidx_entry_t *entries;
+    size_t          count;
+    size_t          capacity;
+} block_index_t;
+
+/* what a scan went through, written by --stats */
+typedef struct {
+    uint64_t        block_count[BT_COUNT];
+    uint64_t        block_bytes[BT_COUNT];
+    mlv_io_stats_t  io;
+    uint64_t        major_faults;   /* reads of mapped files */
+    uint64_t        file_bytes;
+    uint32_t        damaged_ranges;
+    uint64_t        damaged_bytes;
+    uint64_t        wall_ns;
+    uint64_t        cpu_ns;
+} scan_stats_t;
+
+/* one input file of a run, in batch mode the output is collected in 'report' and printed in input order */
+typedef struct {
+    char            *file_name;
+    uint64_t        file_size;
+    dev_t           dev;
+    int             ret;
+    int             done;
+    int             report_buffered;
+    char            *report;
+    size_t          report_len;
+    size_t          report_cap;
+    int             scan_limit;     /* parallel chunk or region scans on the device of the file, 0 is unlimited */
+    uint64_t        progress_time;  /* last progress line, 0 if none was printed */
+    uint32_t        progress_frame; /* frameNumber of the last VIDF walked */
+    scan_stats_t    stats;
+} job_t;
+
+/* one .MLV/.Mxx chunk of a spanned clip */
+typedef struct {
+    job_t           job;            /* messages of this chunk, always buffered */
+    FILE            *file;
+    mlv_file_hdr_t  file_hdr;
+    uint32_t        frame_count;
+    uint32_t        audio_count;
+    block_index_t   index;
+    int             ret;
+} chunk_t;
 
-#define uint8_t unsigned char
-#define uint16_t unsigned short
-#define uint32_t unsigned long
-#define uint64_t unsigned long long
+/* damaged ranges skipped by --recover */
+typedef struct {
+    uint32_t        ranges;
+    uint64_t        bytes;
+} recovery_t;
+
+/* part of a mapped file scanned by its own thread */
+typedef struct {
+    job_t           job;            /* messages of this region, always buffered */
+    mlv_walker_t    walker;         /* copy sharing the mapping */
+    const mlv_file_hdr_t *file_hdr;
+    uint64_t        start;
+    uint64_t        end;
+    uint64_t        sync;           /* first block boundary found at or behind 'start' */
+    int             anchored;       /* sync is known, not searched */
+    uint64_t        stop;           /* first block boundary at or behind 'end' */
+    uint32_t        frame_count;
+    uint32_t        audio_count;
+    block_index_t   index;
+    int             index_mode;
+    int             ret;
+} region_t;
 
-enum block_type { BT_NONE, BT_VIDF, BT_AUDF, BT_NULL, BT_RTCI, BT_XREF, BT_RAWI, BT_WAVI, BT_EXPO, BT_LENS, BT_IDNT, BT_INFO, BT_WBAL, BT_STYL, BT_MARK, BT_ELVL, BT_DEBG, BT_BKUP, BT_MLVI };
+/* per storage device concurrency limit */
+typedef struct {
+    dev_t           dev;
+    int             active;
+    int             limit;
+} device_t;
 
+/* batch worker pool, every worker owns a deque of job indices, pops from its front and when
+   it runs dry steals from the back of other workers' deques. All state is guarded by one lock,
+   jobs are whole files so contention is negligible */
 typedef struct {
-    uint8_t     blockType[4];
-    uint32_t    blockSize;
-    uint64_t    timestamp;
-} mlv_hdr_t;
+    job_t           *jobs;
+    int             job_count;
+    int             *deque;         /* worker_count slices of job_count entries */
+    int             *deque_head;
+    int             *deque_tail;
+    int             worker_count;
+    device_t        *devices;
+    int             device_count;
+    int             pending;
+    short           setf;
+    pthread_mutex_t lock;
+    pthread_cond_t  slot_freed;     /* a device slot became free or a job finished */
+    pthread_cond_t  job_done;
+} pool_t;
 
-mlv_hdr_t mlv_hdr;
+typedef struct {
+    pool_t          *pool;
+    int             id;
+} worker_t;
 
-uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
+void job_printf(job_t *job, const char *format, ...)
 {
-#if defined(__WIN32)
-    return fseeko64(stream, offset, whence);
-#else
-    return fseek(stream, offset, whence);
-#endif
-}
+    va_list args;
+    va_start(args, format);
+
+    if(!job->report_buffered)
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    /* progress line breaks make no sense in collected output */
+    while(*format == '\n' || *format == '\r') format++;
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int len = vsnprintf(NULL, 0, format, args_copy);
+    va_end(args_copy);
+
+    if(len > 0)
+    {
+        if(job->report_len + len + 1 > job->report_cap)
+        {
+            size_t cap = (job->report_cap) ? job->report_cap * 2 : 256;
+            while(cap < job->report_len + len + 1) cap *= 2;
+            char *report = realloc(job->report, cap);
+            if(!report)
+            {
+                va_end(args);
+                return;
+            }
+            job->report = report;
+            job->report_cap = cap;
+        }
+        vsnprintf(job->report + job->report_len, len + 1, format, args);
+        job->report_len += len;
+    }
 
-unsigned char check_block_type()
-{
-    /* chech every block type to make sure mlv not corrupted */
-    if(!memcmp(mlv_hdr.blockType, "VIDF", 4)) return BT_VIDF;
-    if(!memcmp(mlv_hdr.blockType, "AUDF", 4)) return BT_AUDF;
-    if(!memcmp(mlv_hdr.blockType, "NULL", 4)) return BT_NULL;
-    if(!memcmp(mlv_hdr.blockType, "RTCI", 4)) return BT_RTCI;
-    if(!memcmp(mlv_hdr.blockType, "XREF", 4)) return BT_XREF;
-    if(!memcmp(mlv_hdr.blockType, "RAWI", 4)) return BT_RAWI;
-    if(!memcmp(mlv_hdr.blockType, "WAVI", 4)) return BT_WAVI;
-    if(!memcmp(mlv_hdr.blockType, "EXPO", 4)) return BT_EXPO;
-    if(!memcmp(mlv_hdr.blockType, "LENS", 4)) return BT_LENS;
-    if(!memcmp(mlv_hdr.blockType, "IDNT", 4)) return BT_IDNT;
-    if(!memcmp(mlv_hdr.blockType, "INFO", 4)) return BT_INFO;
-    if(!memcmp(mlv_hdr.blockType, "WBAL", 4)) return BT_WBAL;
-    if(!memcmp(mlv_hdr.blockType, "STYL", 4)) return BT_STYL;
-    if(!memcmp(mlv_hdr.blockType, "MARK", 4)) return BT_MARK;
-    if(!memcmp(mlv_hdr.blockType, "ELVL", 4)) return BT_ELVL;
-    if(!memcmp(mlv_hdr.blockType, "DEBG", 4)) return BT_DEBG;
-    if(!memcmp(mlv_hdr.blockType, "BKUP", 4)) return BT_BKUP;
-    if(!memcmp(mlv_hdr.blockType, "MLVI", 4)) return BT_MLVI;
-    return BT_NONE;
+    va_end(args);
 }
 
 void file_get_raw_times(struct utimbuf *rawtimes, char *filename)
@@ -86,160 +218,1463 @@ int file_set_raw_times(struct utimbuf *rawtimes, char *filename)
     return utime(filename, rawtimes);
 }
 
+uint64_t time_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-int main(int argc, char** argv)
+/* CPU time and major page faults of the calling thread, where threads can not be told apart
+   CPU time of the process and no faults */
+void thread_usage(uint64_t *cpu_ns, uint64_t *major_faults)
 {
+#if defined(RUSAGE_THREAD)
+    struct rusage usage;
+    if(!getrusage(RUSAGE_THREAD, &usage))
+    {
+        *cpu_ns = ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 + ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+        *major_faults = usage.ru_majflt;
+        return;
+    }
+#endif
+    *cpu_ns = (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+    *major_faults = 0;
+}
 
-    short setf = 0;
-    if(argc < 2)
-    {
-        printf(
-            "\n"
-            "usage:\n"
-            "\n"
-            " %s file.mlv [--set]\n"
-            "\n   --set    if specified actually writes frameCount to file"
-            "\n            otherwise just outputs the information\n"
-            "\n   Extra testing option:"
-            "\n   --set0x00000000    sets zero frameCount to any mlv file\n",
-            argv[0]
-        );
-        return 1;
+/* usage of the calling thread since 'cpu_ns' and 'major_faults' were taken by thread_usage() */
+void stats_add_usage(scan_stats_t *stats, uint64_t cpu_ns, uint64_t major_faults)
+{
+    uint64_t cpu_now = 0, faults_now = 0;
+    thread_usage(&cpu_now, &faults_now);
+    stats->cpu_ns += cpu_now - cpu_ns;
+    stats->major_faults += faults_now - major_faults;
+}
+
+/* adds all numbers of 'other', CPU time only if 'cpu' is set, it may have been taken by this thread already */
+void stats_add(scan_stats_t *stats, const scan_stats_t *other, int cpu)
+{
+    for(int i = 0; i < BT_COUNT; i++)
+    {
+        stats->block_count[i] += other->block_count[i];
+        stats->block_bytes[i] += other->block_bytes[i];
     }
-    else if((argc > 2) && (strcmp(argv[2], "--set") == 0))
+    stats->io.reads += other->io.reads;
+    stats->io.read_bytes += other->io.read_bytes;
+    stats->io.syscalls += other->io.syscalls;
+    stats->file_bytes += other->file_bytes;
+    stats->damaged_ranges += other->damaged_ranges;
+    stats->damaged_bytes += other->damaged_bytes;
+    if(cpu)
     {
-        setf = 1;
+        stats->cpu_ns += other->cpu_ns;
+        stats->major_faults += other->major_faults;
     }
-    else if((argc > 2) && (strcmp(argv[2], "--set0x00000000") == 0))
+}
+
+
+int index_add(block_index_t *index, const uint8_t *block, uint64_t offset, uint16_t file_num)
+{
+    if(index->count >= index->capacity)
     {
-        setf = 2;
+        size_t capacity = (index->capacity) ? index->capacity * 2 : 1024;
+        mlv_bidx_entry_t *entries = realloc(index->entries, sizeof(mlv_bidx_entry_t) * capacity);
+        if(!entries) return 0;
+        index->entries = entries;
+        index->capacity = capacity;
     }
 
-    struct utimbuf file_raw_times;
-    uint32_t frame_count = 0, frame_number = 0;
-    static unsigned short frame_count_offset = 0x24;
-    static unsigned short mlv_hdr_t_size = sizeof(mlv_hdr_t);
+    /* VIDF and AUDF both start with frameNumber */
+    const mlv_vidf_hdr_t *hdr = (const mlv_vidf_hdr_t *)block;
+    mlv_bidx_entry_t *entry = &index->entries[index->count++];
+    memset(entry, 0, sizeof(mlv_bidx_entry_t));
+    entry->offset = offset;
+    entry->timestamp = hdr->timestamp;
+    entry->blockSize = hdr->blockSize;
+    entry->frameNumber = hdr->frameNumber;
+    memcpy(entry->blockType, hdr->blockType, 4);
+    entry->fileNum = file_num;
+    return 1;
+}
 
-    /* Zero mlv hdr struct */
-    memset(&mlv_hdr, 0x00, sizeof(mlv_hdr_t));
-    
-    /* Open file */    
-    char *in_file_name = argv[1];
-    FILE* in_file = fopen(in_file_name, "r+b");
-    if(!in_file)
+int index_append(block_index_t *index, block_index_t *other)
+{
+    if(index->count + other->count > index->capacity)
     {
-        printf("%s: Error: could not open file\n", in_file_name);
-        return 1;
+        size_t capacity = (index->capacity) ? index->capacity : 1024;
+        while(capacity < index->count + other->count) capacity *= 2;
+        mlv_bidx_entry_t *entries = realloc(index->entries, sizeof(mlv_bidx_entry_t) * capacity);
+        if(!entries) return 0;
+        index->entries = entries;
+        index->capacity = capacity;
     }
 
-    /* Check if file is a valid MLV */
-    if(fread(&mlv_hdr, mlv_hdr_t_size, 1, in_file) != 1)
+    memcpy(index->entries + index->count, other->entries, sizeof(mlv_bidx_entry_t) * other->count);
+    index->count += other->count;
+    return 1;
+}
+
+int compare_index_entries(const void *a, const void *b)
+{
+    const mlv_bidx_entry_t *entry_a = a;
+    const mlv_bidx_entry_t *entry_b = b;
+    if(entry_a->timestamp != entry_b->timestamp) return (entry_a->timestamp < entry_b->timestamp) ? -1 : 1;
+    if(entry_a->fileNum != entry_b->fileNum) return (entry_a->fileNum < entry_b->fileNum) ? -1 : 1;
+    return (entry_a->offset < entry_b->offset) ? -1 : (entry_a->offset > entry_b->offset);
+}
+
+/* sort collected blocks, build frameNumber lookup table and save as '<file_name>.bidx', returns 0 on success */
+int index_save(job_t *job, block_index_t *index, const char *file_name, const mlv_file_hdr_t *file_hdr, uint16_t file_count)
+{
+    mlv_bidx_hdr_t header;
+    uint32_t video_count = 0, audio_count = 0, first_frame = MLV_BIDX_NO_ENTRY, last_frame = 0, table_count = 0;
+    uint32_t *table = NULL;
+    char *index_name = NULL, *temp_name = NULL;
+
+    qsort(index->entries, index->count, sizeof(mlv_bidx_entry_t), compare_index_entries);
+    for(size_t i = 0; i < index->count; i++)
+    {
+        if(mlv_block_type(index->entries[i].blockType) == BT_VIDF)
+        {
+            video_count++;
+            if(index->entries[i].frameNumber < first_frame) first_frame = index->entries[i].frameNumber;
+            if(index->entries[i].frameNumber > last_frame) last_frame = index->entries[i].frameNumber;
+        }
+        else
+        {
+            audio_count++;
+        }
+    }
+
+    /* O(1) frame lookup, skipped if garbage frame numbers would blow it up */
+    if(video_count && last_frame - first_frame < 4 * (uint64_t)video_count + 1024)
     {
-        printf("%s: Error: could not read from file\n", in_file_name);
+        table_count = last_frame - first_frame + 1;
+        table = malloc(sizeof(uint32_t) * table_count);
+        if(!table)
+        {
+            job_printf(job, "%s: Error: could not allocate memory\n", file_name);
+            return 1;
+        }
+        for(uint32_t i = 0; i < table_count; i++) table[i] = MLV_BIDX_NO_ENTRY;
+        for(size_t i = 0; i < index->count; i++)
+        {
+            uint32_t slot = index->entries[i].frameNumber - first_frame;
+            if(mlv_block_type(index->entries[i].blockType) == BT_VIDF && table[slot] == MLV_BIDX_NO_ENTRY) table[slot] = i;
+        }
+    }
+
+    memset(&header, 0, sizeof(mlv_bidx_hdr_t));
+    memcpy(header.magic, "BIDX", 4);
+    header.headerSize = sizeof(mlv_bidx_hdr_t);
+    header.version = 1;
+    header.entrySize = sizeof(mlv_bidx_entry_t);
+    header.fileGuid = file_hdr->fileGuid;
+    header.entryCount = index->count;
+    header.videoCount = video_count;
+    header.audioCount = audio_count;
+    header.firstFrame = (video_count) ? first_frame : 0;
+    header.frameTableCount = table_count;
+    header.fileCount = file_count;
+    header.entriesOffset = sizeof(mlv_bidx_hdr_t);
+    header.frameTableOffset = sizeof(mlv_bidx_hdr_t) + (uint64_t)index->count * sizeof(mlv_bidx_entry_t);
+
+    /* write to a temporary file first, readers never see a partial index */
+    size_t name_len = strlen(file_name) + 16;
+    index_name = malloc(name_len);
+    temp_name = malloc(name_len);
+    if(!index_name || !temp_name)
+    {
+        job_printf(job, "%s: Error: could not allocate memory\n", file_name);
         goto bailout;
     }
-    if(memcmp(mlv_hdr.blockType, "MLVI", 4) != 0 || mlv_hdr.blockSize != 52)
+    snprintf(index_name, name_len, "%s.bidx", file_name);
+    snprintf(temp_name, name_len, "%s.bidx.tmp", file_name);
+
+    FILE *f = fopen(temp_name, "wb");
+    if(!f)
     {
-        printf("%s: Error: not a valid MLV file\n", in_file_name);
+        job_printf(job, "%s: Error: could not open file\n", temp_name);
         goto bailout;
     }
-    
-    /* Check if frameCount != 0 */
-    file_set_pos(in_file, frame_count_offset - mlv_hdr_t_size, SEEK_CUR);
-    if(fread(&frame_count, 4, 1, in_file) != 1)
+
+    int ok = (fwrite(&header, sizeof(mlv_bidx_hdr_t), 1, f) == 1);
+    if(ok && index->count) ok = (fwrite(index->entries, sizeof(mlv_bidx_entry_t), index->count, f) == index->count);
+    if(ok && table_count) ok = (fwrite(table, sizeof(uint32_t), table_count, f) == table_count);
+    if(fclose(f) || !ok)
     {
-        printf("%s: Error: could not read from file\n", in_file_name);
+        job_printf(job, "%s: Error: failed writing to file\n", temp_name);
+        remove(temp_name);
         goto bailout;
     }
-    if( (frame_count && setf != 2) || (!frame_count && setf == 2) )
+
+#if defined(__WIN32)
+    remove(index_name);
+#endif
+    if(rename(temp_name, index_name))
     {
-        printf("%s: Already has frameCount set to %lu\n", in_file_name, frame_count);
+        job_printf(job, "%s: Error: failed writing to file\n", index_name);
+        remove(temp_name);
         goto bailout;
     }
-    file_set_pos(in_file, mlv_hdr.blockSize - frame_count_offset - 4, SEEK_CUR);
+    /* a progress line of the walk is still open */
+    job_printf(job, "%s%s: Saved block index w/%u VIDF and %u AUDF entries\n", (job->progress_time) ? "\n" : "", index_name, video_count, audio_count);
 
-    /* Start counting frames */
-    frame_count = 0;
-    while(fread(&mlv_hdr, mlv_hdr_t_size, 1, in_file) == 1)
+    free(table);
+    free(index_name);
+    free(temp_name);
+    return 0;
+
+bailout:
+
+    free(table);
+    free(index_name);
+    free(temp_name);
+    return 1;
+}
+
+/* uncompressed clips w/o audio are a few info blocks followed by VIDF blocks of equal size, so the frame count
+   follows from file size and the first VIDF stride. The result is confirmed by probing 'fast_probes' spread out
+   block boundaries for the expected VIDF header and frameNumber. On success the walker is left behind the last
+   full stride, 'frame_count' holds the frames before it and the skipped blocks are in the stats as if walked,
+   returns 0 if the full walk is needed */
+int estimate_frames(job_t *job, mlv_walker_t *walker, const mlv_file_hdr_t *file_hdr, uint32_t *frame_count)
+{
+    const uint8_t *block = NULL;
+    const mlv_vidf_hdr_t *vidf = NULL;
+    size_t avail = 0;
+    uint64_t file_size = 0, first_pos = 0, stride = 0, strides = 0;
+    uint64_t info_count[BT_COUNT] = { 0 }, info_bytes[BT_COUNT] = { 0 };
+    uint32_t frame_size = 0, first_frame = 0;
+    char *in_file_name = job->file_name;
+
+    if((file_hdr->videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) || file_hdr->audioClass) return 0;
+
+    /* find the first VIDF, take frame_size from RAWI on the way */
+    while((avail = mlv_walker_next(walker, &block)) >= sizeof(mlv_hdr_t))
+    {
+        const mlv_hdr_t *hdr = (const mlv_hdr_t *)block;
+        int block_type = mlv_block_type(hdr->blockType);
+        if(block_type == BT_VIDF) break;
+        if(hdr->blockSize < sizeof(mlv_hdr_t) || block_type == BT_NONE || block_type == BT_AUDF || block_type == BT_XREF) return 0;
+        /* buffered walker only holds the first bytes of a block, then the probes have to do */
+        if(block_type == BT_RAWI && avail >= sizeof(mlv_rawi_hdr_t))
+        {
+            memcpy(&frame_size, block + offsetof(mlv_rawi_hdr_t, frame_size), sizeof(uint32_t));
+        }
+        info_count[block_type]++;
+        info_bytes[block_type] += hdr->blockSize;
+        mlv_walker_skip(walker, hdr->blockSize);
+    }
+    if(avail < sizeof(mlv_vidf_hdr_t)) return 0;
+
+    vidf = (const mlv_vidf_hdr_t *)block;
+    first_pos = walker->pos;
+    stride = vidf->blockSize;
+    first_frame = vidf->frameNumber;
+    if(stride < sizeof(mlv_vidf_hdr_t)) return 0;
+    if(frame_size && stride - sizeof(mlv_vidf_hdr_t) - vidf->frameSpace != frame_size) return 0;
+
+    file_size = mlv_walker_file_size(walker);
+    if(file_size < first_pos) return 0;
+    strides = (file_size - first_pos) / stride;
+    if(!strides || strides > 0xFFFFFFFF) return 0;
+
+    /* probe first, last and evenly spread frames in between */
+    int probes = (strides < (uint64_t)fast_probes) ? (int)strides : fast_probes;
+    for(int i = 0; i < probes; i++)
+    {
+        uint64_t k = (probes > 1) ? (strides - 1) * i / (probes - 1) : 0;
+        walker->pos = first_pos + k * stride;
+        avail = mlv_walker_next(walker, &block);
+        vidf = (const mlv_vidf_hdr_t *)block;
+        if(avail < sizeof(mlv_vidf_hdr_t) || mlv_block_type(vidf->blockType) != BT_VIDF || vidf->blockSize != stride || vidf->frameNumber != first_frame + k)
+        {
+            job_printf(job, "%s: Probe at frame %" PRIu64 " disagrees with VIDF stride, walking all blocks\n", in_file_name, k);
+            return 0;
+        }
+    }
+
+    job_printf(job, "%s: Estimated %" PRIu64 " frames from VIDF stride %" PRIu64 ", verified by %d probes\n", in_file_name, strides, stride, probes);
+    *frame_count = strides;
+    walker->pos = first_pos + strides * stride;
+    for(int i = 0; i < BT_COUNT; i++)
+    {
+        job->stats.block_count[i] += info_count[i];
+        job->stats.block_bytes[i] += info_bytes[i];
+    }
+    job->stats.block_count[BT_VIDF] += strides;
+    job->stats.block_bytes[BT_VIDF] += strides * stride;
+    return 1;
+}
+
+/* bring an open progress line up to date before the walk ends or prints something */
+void progress_flush(job_t *job, uint32_t frame_count)
+{
+    if(job->progress_time && progress_interval)
+    {
+        printf("\r%s: Processing... frameCount = %u, frameNumber = %u", job->file_name, frame_count, job->progress_frame);
+    }
+}
+
+/* skip damaged data up to the next valid block chain instead of giving up, returns 0 if the
+   walk goes on at the walker position, 1 if there is nothing left to recover */
+int recover_blocks(job_t *job, mlv_walker_t *walker, uint64_t last_timestamp, recovery_t *recovery)
+{
+    uint64_t from = walker->pos, size = mlv_walker_file_size(walker);
+    uint64_t sync = mlv_walker_resync(walker, from + 1, size, last_timestamp);
+    uint64_t to = (sync == MLV_NO_SYNC) ? size : sync;
+
+    recovery->ranges++;
+    recovery->bytes += to - from;
+    job_printf(job, "\n%s: Skipped damaged range 0x%" PRIx64 "-0x%" PRIx64 " (%" PRIu64 " bytes)%s\n", job->file_name, from, to, to - from, (sync == MLV_NO_SYNC) ? " up to end of file" : "");
+    if(sync == MLV_NO_SYNC) return 1;
+
+    walker->pos = sync;
+    return 0;
+}
+
+/* walk blocks from the walker position until the first block starting at or behind 'end', add VIDF and AUDF blocks
+   to the counts and to 'index' if not NULL, damaged data is skipped if 'recovery' is not NULL, returns 0 on success */
+int scan_blocks(job_t *job, mlv_walker_t *walker, uint64_t end, const mlv_file_hdr_t *file_hdr, uint32_t *frame_count, uint32_t *audio_count, block_index_t *index, recovery_t *recovery)
+{
+    const uint8_t *block = NULL;
+    size_t avail = 0;
+    uint64_t file_size = (recover_mode) ? mlv_walker_file_size(walker) : 0, last_timestamp = 0;
+    char *in_file_name = job->file_name;
+
+    while(walker->pos < end && (avail = mlv_walker_next(walker, &block)) >= sizeof(mlv_hdr_t))
     {   
-        switch(check_block_type())
+        const mlv_hdr_t *hdr = (const mlv_hdr_t *)block;
+        int block_type = mlv_block_type(hdr->blockType);
+
+        /* in recovery mode a block also has to fit into the file */
+        if(hdr->blockSize < sizeof(mlv_hdr_t) || block_type == BT_NONE || (recover_mode && hdr->blockSize > file_size - walker->pos))
+        {
+            progress_flush(job, *frame_count);
+            if(recovery)
+            {
+                if(recover_blocks(job, walker, last_timestamp, recovery)) break;
+                continue;
+            }
+            job_printf(job, "\n%s: Looks like mlv file corrupted\n", in_file_name);
+            return 1;
+        }
+        job->stats.block_count[block_type]++;
+        job->stats.block_bytes[block_type] += hdr->blockSize;
+
+        switch(block_type)
         {
             case BT_VIDF:
-                frame_count++;
-                if(fread(&frame_number, 4, 1, in_file) !=1)
+                (*frame_count)++;
+                if(avail < sizeof(mlv_hdr_t) + 4)
                 {
-                    printf("%s: Error: could not read from file\n", in_file_name);
-                    goto bailout;
+                    progress_flush(job, *frame_count);
+                    job_printf(job, "\n%s: Error: could not read from file\n", in_file_name);
+                    return 1;
                 }
-                printf("\r%s: Processing... frameCount = %lu, frameNumber = %lu", in_file_name, frame_count, frame_number);
-                file_set_pos(in_file, mlv_hdr.blockSize - mlv_hdr_t_size - 4, SEEK_CUR);
+                if(index && !index_add(index, block, walker->pos, file_hdr->fileNum)) goto bailout_memory;
+                if(!job->report_buffered)
+                {
+                    /* terminal output costs more than the walk, only every 'progress_interval' ms */
+                    job->progress_frame = ((const mlv_vidf_hdr_t *)block)->frameNumber;
+                    uint64_t now = (progress_interval) ? time_now_ns() : 0;
+                    if(!progress_interval || now - job->progress_time >= (uint64_t)progress_interval * 1000000)
+                    {
+                        printf("\r%s: Processing... frameCount = %u, frameNumber = %u", in_file_name, *frame_count, job->progress_frame);
+                        job->progress_time = (now) ? now : 1;
+                    }
+                }
+                if(hdr->timestamp > last_timestamp) last_timestamp = hdr->timestamp;
+                mlv_walker_skip(walker, hdr->blockSize);
                 break;
             case BT_XREF:
-                printf("%s: Looks like XREF file. Skipping...\n", in_file_name);
-                goto bailout;
+                progress_flush(job, *frame_count);
+                job_printf(job, "\n%s: Looks like XREF file. Skipping...\n", in_file_name);
+                return 1;
             case BT_AUDF:
+                (*audio_count)++;
+                if(index && (avail < sizeof(mlv_hdr_t) + 4 || !index_add(index, block, walker->pos, file_hdr->fileNum))) goto bailout_memory;
+                if(hdr->timestamp > last_timestamp) last_timestamp = hdr->timestamp;
+                mlv_walker_skip(walker, hdr->blockSize);
+                break;
             case BT_NULL:
             case BT_RTCI:
             case BT_RAWI:
+            case BT_RAWC:
             case BT_WAVI:
             case BT_EXPO:
             case BT_LENS:
+            case BT_ELNS:
             case BT_IDNT:
             case BT_INFO:
+            case BT_DISO:
             case BT_WBAL:
             case BT_STYL:
             case BT_MARK:
             case BT_ELVL:
             case BT_DEBG:
+            case BT_VERS:
             case BT_BKUP:
             case BT_MLVI:
-                file_set_pos(in_file, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
+                mlv_walker_skip(walker, hdr->blockSize);
                 break;
             case BT_NONE:
             default:
-                printf("\n%s: Looks like mlv file corrupted\n", in_file_name);
-                goto bailout;
+                progress_flush(job, *frame_count);
+                job_printf(job, "\n%s: Looks like mlv file corrupted\n", in_file_name);
+                return 1;
+        }
+        //printf("\n%c%c%c%c FrameCount = %u BlockSize = %u", hdr->blockType[0], hdr->blockType[1], hdr->blockType[2], hdr->blockType[3], *frame_count, hdr->blockSize);
+    }
+    return 0;
+
+bailout_memory:
+
+    progress_flush(job, *frame_count);
+    job_printf(job, "\n%s: Error: could not index block at 0x%" PRIx64 "\n", in_file_name, walker->pos);
+    return 1;
+}
+
+void *region_scan(void *arg)
+{
+    region_t *region = arg;
+    mlv_walker_t *walker = &region->walker;
+    uint64_t from = region->start, cpu_ns = 0, major_faults = 0;
+    thread_usage(&cpu_ns, &major_faults);
+
+    /* region 0 starts at a known boundary, the others sync to the first block chain inside and
+       start over behind the sync point if the chain breaks, it was payload looking like blocks */
+    for(;;)
+    {
+        if(region->sync == MLV_NO_SYNC) region->sync = mlv_walker_resync(walker, from, region->end, 0);
+        if(region->sync == MLV_NO_SYNC) break;
+
+        walker->pos = region->sync;
+        region->frame_count = 0;
+        region->audio_count = 0;
+        region->index.count = 0;
+        memset(region->job.stats.block_count, 0, sizeof(region->job.stats.block_count));
+        memset(region->job.stats.block_bytes, 0, sizeof(region->job.stats.block_bytes));
+        region->job.report_len = 0;
+        if(region->job.report) region->job.report[0] = 0;
+        region->ret = scan_blocks(&region->job, walker, region->end, region->file_hdr, &region->frame_count, &region->audio_count, region->index_mode ? &region->index : NULL, NULL);
+        /* with --recover damage is left to the single walk from the seam */
+        if(!region->ret || region->anchored || recover_mode) break;
+
+        from = region->sync + 1;
+        region->sync = MLV_NO_SYNC;
+    }
+    region->stop = walker->pos;
+    stats_add_usage(&region->job.stats, cpu_ns, major_faults);
+    return NULL;
+}
+
+/* scan the mapped file from the walker position in 'count' regions in parallel and stitch the results. A region
+   is taken over only if its sync point is where the walk of the regions before it stopped, otherwise it is walked
+   again from there, returns 0 on success */
+int scan_regions(job_t *job, mlv_walker_t *walker, int count, const mlv_file_hdr_t *file_hdr, uint32_t *frame_count, uint32_t *audio_count, block_index_t *index, recovery_t *recovery)
+{
+    region_t *regions = calloc(count, sizeof(region_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    int *threaded = calloc(count, sizeof(int));
+    int ret = 1;
+
+    if(!regions || !threads || !threaded)
+    {
+        job_printf(job, "%s: Error: could not allocate memory\n", job->file_name);
+        goto bailout;
+    }
+
+    uint64_t first = walker->pos, size = walker->map_size;
+    for(int i = 0; i < count; i++)
+    {
+        region_t *region = &regions[i];
+        region->job.file_name = job->file_name;
+        region->job.report_buffered = 1;
+        region->walker = *walker;
+        region->file_hdr = file_hdr;
+        region->index_mode = (index != NULL);
+        region->start = first + (size - first) * i / count;
+        region->end = first + (size - first) * (i + 1) / count;
+        region->anchored = !i;
+        region->sync = (i) ? MLV_NO_SYNC : first;
+        threaded[i] = !pthread_create(&threads[i], NULL, region_scan, region);
+        if(!threaded[i]) region_scan(region);
+    }
+    for(int i = 0; i < count; i++)
+    {
+        if(threaded[i]) pthread_join(threads[i], NULL);
+    }
+
+    /* regions run inline were already timed by this thread */
+    for(int i = 0; i < count; i++)
+    {
+        if(threaded[i])
+        {
+            job->stats.cpu_ns += regions[i].job.stats.cpu_ns;
+            job->stats.major_faults += regions[i].job.stats.major_faults;
+        }
+    }
+
+    walker->pos = first;
+    for(int i = 0; i < count; i++)
+    {
+        region_t *region = &regions[i];
+        if(walker->pos >= region->end) continue;
+
+        /* false or missed sync, the seam decides */
+        if(region->sync != walker->pos || (recovery && region->ret))
+        {
+            if(region->sync != MLV_NO_SYNC && region->sync != walker->pos)
+            {
+                job_printf(job, "\n%s: Region %d synced at 0x%" PRIx64 " but blocks continue at 0x%" PRIx64 ", walking it again\n", job->file_name, i + 1, region->sync, walker->pos);
+            }
+            if(scan_blocks(job, walker, region->end, file_hdr, frame_count, audio_count, index, recovery)) goto bailout;
+            continue;
+        }
+
+        if(region->job.report) job_printf(job, "%s", region->job.report);
+        if(region->ret) goto bailout;
+        *frame_count += region->frame_count;
+        *audio_count += region->audio_count;
+        stats_add(&job->stats, &region->job.stats, 0);
+        if(index && !index_append(index, &region->index))
+        {
+            job_printf(job, "%s: Error: could not allocate memory\n", job->file_name);
+            goto bailout;
         }
-        //printf("\n%c%c%c%c FrameNumber = %lu FrameCount = %lu BlockSize = %lu", mlv_hdr.blockType[0], mlv_hdr.blockType[1],mlv_hdr.blockType[2],mlv_hdr.blockType[3], frame_number, frame_count, mlv_hdr.blockSize);
+        walker->pos = region->stop;
+    }
+    ret = 0;
+
+bailout:
+
+    for(int i = 0; regions && i < count; i++)
+    {
+        free(regions[i].index.entries);
+        free(regions[i].job.report);
+    }
+    free(regions);
+    free(threads);
+    free(threaded);
+    return ret;
+}
+
+/* walk all blocks after the file header and count VIDF and AUDF blocks, collect them into 'index' if not NULL, returns 0 on success */
+int count_blocks(job_t *job, FILE *in_file, const mlv_file_hdr_t *file_hdr, uint32_t *frame_count, uint32_t *audio_count, block_index_t *index)
+{
+    mlv_walker_t walker;
+    int ret = 0;
+
+    *frame_count = 0;
+    *audio_count = 0;
+    mlv_walker_init(&walker, in_file, file_hdr->blockSize);
+    if(async_depth && mlv_walker_set_async(&walker, async_depth))
+    {
+        job_printf(job, "%s: Asynchronous reads not available, walking synchronously\n", job->file_name);
+    }
+
+    /* the index needs every block, otherwise try to skip the walk, on success only the tail is walked below */
+    if(fast_probes && !index && !estimate_frames(job, &walker, file_hdr, frame_count))
+    {
+        walker.pos = file_hdr->blockSize;
+    }
+
+    /* regions need the whole file mapped and should be worth a thread each, a rotational disk is walked in one piece */
+    int regions = 0;
+    if(split_regions > 1 && walker.map && walker.map_size > walker.pos)
+    {
+        regions = (walker.map_size - walker.pos) / SPLIT_MIN_REGION;
+        if(regions > split_regions) regions = split_regions;
+        if(job->scan_limit > 0 && regions > job->scan_limit) regions = job->scan_limit;
+    }
+    else if(split_regions > 1 && walker.aio && mlv_walker_file_size(&walker) > walker.pos && (mlv_walker_file_size(&walker) - walker.pos) / SPLIT_MIN_REGION > 1)
+    {
+        job_printf(job, "%s: Asynchronous reads replace the mapping --split needs, walking without a split\n", job->file_name);
+    }
+
+    recovery_t recovery = { 0, 0 };
+    recovery_t *recover = (recover_mode) ? &recovery : NULL;
+    if(regions > 1) ret = scan_regions(job, &walker, regions, file_hdr, frame_count, audio_count, index, recover);
+    else ret = scan_blocks(job, &walker, UINT64_MAX, file_hdr, frame_count, audio_count, index, recover);
+
+    /* the last frames walked may not have made it into a progress line, a failed walk has updated it before its error */
+    if(!ret) progress_flush(job, *frame_count);
+
+    if(!ret && recovery.ranges)
+    {
+        job_printf(job, "\n%s: Recovered past %u damaged ranges, %" PRIu64 " bytes skipped, only intact blocks counted\n", job->file_name, recovery.ranges, recovery.bytes);
+    }
+
+    job->stats.file_bytes += mlv_walker_file_size(&walker);
+    job->stats.damaged_ranges += recovery.ranges;
+    job->stats.damaged_bytes += recovery.bytes;
+    mlv_walker_close(&walker);
+    job->stats.io.reads += walker.io.reads;
+    job->stats.io.read_bytes += walker.io.read_bytes;
+    job->stats.io.syscalls += walker.io.syscalls;
+    return ret;
+}
+
+/* count VIDF blocks of one file and optionally write frameCount, returns 0 on success */
+int process_file(job_t *job, short setf)
+{
+    struct utimbuf file_raw_times;
+    mlv_file_hdr_t file_hdr;
+    uint32_t frame_count = 0, audio_count = 0;
+    block_index_t index = { NULL, 0, 0 };
+    int already_set = 0;
+
+    /* Open file */    
+    char *in_file_name = job->file_name;
+    FILE* in_file = fopen(in_file_name, "r+b");
+    if(!in_file)
+    {
+        job_printf(job, "%s: Error: could not open file\n", in_file_name);
+        return 1;
+    }
+
+    /* Check if file is a valid MLV */
+    if(fread(&file_hdr, sizeof(mlv_file_hdr_t), 1, in_file) != 1)
+    {
+        job_printf(job, "%s: Error: could not read from file\n", in_file_name);
+        goto bailout;
+    }
+    if(mlv_block_type(file_hdr.fileMagic) != BT_MLVI || file_hdr.blockSize != sizeof(mlv_file_hdr_t))
+    {
+        job_printf(job, "%s: Error: not a valid MLV file\n", in_file_name);
+        goto bailout;
+    }
+    
+    /* Check if frameCount != 0, with --index the file is still scanned for the index only */
+    frame_count = file_hdr.videoFrameCount;
+    if( (frame_count && setf != 2) || (!frame_count && setf == 2) )
+    {
+        job_printf(job, "%s: Already has frameCount set to %u\n", in_file_name, frame_count);
+        if(!index_mode) goto bailout;
+        already_set = 1;
+    }
+
+    /* Start counting frames */
+    if(count_blocks(job, in_file, &file_hdr, &frame_count, &audio_count, (index_mode) ? &index : NULL))
+    {
+        goto bailout;
+    }
+
+    if(index_mode && index_save(job, &index, in_file_name, &file_hdr, file_hdr.fileCount))
+    {
+        goto bailout;
     }
 
-    if(!frame_count) 
+    /* the index message has ended the progress line already */
+    const char *line_end = (index_mode) ? "" : "\n";
+    if(already_set)
+    {
+        /* frameCount is left as it is */
+    }
+    else if(!frame_count) 
     {
-        printf("\n%s: Hmmm... strange mlv file w/o VIDF blocks ;)\n", in_file_name);
+        job_printf(job, "%s%s: Hmmm... strange mlv file w/o VIDF blocks ;)\n", line_end, in_file_name);
     }
     else
     {
         
         uint32_t fcnt = 0;
         if(setf == 2) fcnt = frame_count;
-        printf("\n%s: Looks like a valid MLV file w/frameCount set to %lu\n", in_file_name, fcnt);
+        job_printf(job, "%s%s: Looks like a valid MLV file w/frameCount set to %u\n", line_end, in_file_name, fcnt);
         if(setf > 0)
         {
             if(setf == 2) frame_count = 0;
             file_get_raw_times(&file_raw_times, in_file_name);
             
-            file_set_pos(in_file, frame_count_offset, SEEK_SET);
-            if(fwrite(&frame_count, 4, 1, in_file) != 1)
+            mlv_file_set_pos(in_file, offsetof(mlv_file_hdr_t, videoFrameCount), SEEK_SET);
+            if(fwrite(&frame_count, sizeof(uint32_t), 1, in_file) != 1)
             {
-                printf("%s: Error: failed writing to file\n", in_file_name);
+                job_printf(job, "%s: Error: failed writing to file\n", in_file_name);
                 goto bailout;
             }
-            printf("%s: Changed frameCount value to %lu\n", in_file_name, frame_count);            
+            job_printf(job, "%s: Changed frameCount value to %u\n", in_file_name, frame_count);            
             
             fclose(in_file);
+            free(index.entries);
             if(file_set_raw_times(&file_raw_times, in_file_name) == -1)
             {
-                printf("%s: Failed updating file time. No big deal :)\n", in_file_name);
+                job_printf(job, "%s: Failed updating file time. No big deal :)\n", in_file_name);
             }
             return 0;
         }
     }
     
     fclose(in_file);
+    free(index.entries);
     return 0;
 
 bailout:
 
     fclose(in_file);
+    free(index.entries);
     return 1;
 }
+
+void *chunk_scan(void *arg)
+{
+    chunk_t *chunk = arg;
+    uint64_t cpu_ns = 0, major_faults = 0;
+    thread_usage(&cpu_ns, &major_faults);
+    chunk->ret = count_blocks(&chunk->job, chunk->file, &chunk->file_hdr, &chunk->frame_count, &chunk->audio_count, (index_mode) ? &chunk->index : NULL);
+    stats_add_usage(&chunk->job.stats, cpu_ns, major_faults);
+    return NULL;
+}
+
+/* name of chunk 'num' of the clip, .MLV is chunk 0 then .M00, .M01 ... keeping the case of the main file extension */
+char *get_chunk_name(const char *main_name, int num)
+{
+    size_t len = strlen(main_name);
+    char *name = strdup(main_name);
+    if(!name || !num) return name;
+
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "%c%02d", name[len - 3], (num - 1) % 100);
+    memcpy(name + len - 3, suffix, 3);
+    return name;
+}
+
+/* counts frames of all chunks of a spanned clip in parallel and writes the combined
+   videoFrameCount, audioFrameCount and fileCount into every chunk header */
+int process_clip(job_t *job, short setf)
+{
+    chunk_t chunks[101];
+    int chunk_count = 0, ret = 1, already_set = 1;
+    uint32_t frame_count = 0, audio_count = 0;
+    char *in_file_name = job->file_name;
+
+    const char *ext = strrchr(in_file_name, '.');
+    if(!ext || strcasecmp(ext, ".mlv"))
+    {
+        job_printf(job, "%s: Error: not a main .MLV file of a spanned clip\n", in_file_name);
+        return 1;
+    }
+
+    /* Discover chunks, every one has to carry the GUID of the main file and its own number */
+    for(int num = 0; num < 101; num++)
+    {
+        chunk_t *chunk = &chunks[chunk_count];
+        memset(chunk, 0, sizeof(chunk_t));
+        chunk->job.report_buffered = 1;
+        chunk->job.file_name = get_chunk_name(in_file_name, num);
+        chunk->file = fopen(chunk->job.file_name, "r+b");
+        if(!chunk->file)
+        {
+            free(chunk->job.file_name);
+            if(!num)
+            {
+                job_printf(job, "%s: Error: could not open file\n", in_file_name);
+                goto bailout;
+            }
+            break;
+        }
+        chunk_count++;
+
+        if(fread(&chunk->file_hdr, sizeof(mlv_file_hdr_t), 1, chunk->file) != 1)
+        {
+            job_printf(job, "%s: Error: could not read from file\n", chunk->job.file_name);
+            goto bailout;
+        }
+        if(mlv_block_type(chunk->file_hdr.fileMagic) != BT_MLVI || chunk->file_hdr.blockSize != sizeof(mlv_file_hdr_t))
+        {
+            job_printf(job, "%s: Error: not a valid MLV file\n", chunk->job.file_name);
+            goto bailout;
+        }
+        if(chunk->file_hdr.fileGuid != chunks[0].file_hdr.fileGuid || chunk->file_hdr.fileNum != num)
+        {
+            job_printf(job, "%s: Error: chunk does not belong to '%s'\n", chunk->job.file_name, in_file_name);
+            goto bailout;
+        }
+    }
+
+    /* Check if all chunks already agree on a non zero frameCount */
+    frame_count = chunks[0].file_hdr.videoFrameCount;
+    for(int i = 0; i < chunk_count; i++)
+    {
+        if(chunks[i].file_hdr.videoFrameCount != frame_count ||
+           chunks[i].file_hdr.audioFrameCount != chunks[0].file_hdr.audioFrameCount ||
+           chunks[i].file_hdr.fileCount != chunk_count)
+        {
+            already_set = 0;
+        }
+    }
+    if( (frame_count && already_set && setf != 2) || (!frame_count && setf == 2) )
+    {
+        job_printf(job, "%s: Already has frameCount set to %u\n", in_file_name, frame_count);
+        if(!index_mode) goto bailout;
+        setf = 0;
+    }
+
+    /* Scan chunks in parallel, at most 'scan_limit' at a time */
+    pthread_t threads[101];
+    int threaded[101] = { 0 };
+    int wave = (job->scan_limit > 0) ? job->scan_limit : chunk_count;
+    for(int first = 0; first < chunk_count; first += wave)
+    {
+        int last = (first + wave < chunk_count) ? first + wave : chunk_count;
+        for(int i = first; i < last; i++)
+        {
+            threaded[i] = !pthread_create(&threads[i], NULL, chunk_scan, &chunks[i]);
+            if(!threaded[i]) chunk_scan(&chunks[i]);
+        }
+        for(int i = first; i < last; i++)
+        {
+            if(threaded[i]) pthread_join(threads[i], NULL);
+        }
+    }
+
+    /* chunks scanned inline were already timed by this thread */
+    for(int i = 0; i < chunk_count; i++)
+    {
+        stats_add(&job->stats, &chunks[i].job.stats, threaded[i]);
+    }
+
+    frame_count = 0;
+    for(int i = 0; i < chunk_count; i++)
+    {
+        if(chunks[i].job.report) job_printf(job, "%s", chunks[i].job.report);
+        if(chunks[i].ret) goto bailout;
+        frame_count += chunks[i].frame_count;
+        audio_count += chunks[i].audio_count;
+        job_printf(job, "%s: Chunk %d of %d, frameCount = %u, audioFrameCount = %u\n", chunks[i].job.file_name, i + 1, chunk_count, chunks[i].frame_count, chunks[i].audio_count);
+    }
+
+    if(index_mode)
+    {
+        for(int i = 1; i < chunk_count; i++)
+        {
+            if(!index_append(&chunks[0].index, &chunks[i].index))
+            {
+                job_printf(job, "%s: Error: could not allocate memory\n", in_file_name);
+                goto bailout;
+            }
+        }
+        if(index_save(job, &chunks[0].index, in_file_name, &chunks[0].file_hdr, chunk_count)) goto bailout;
+    }
+
+    if(!frame_count)
+    {
+        job_printf(job, "%s: Hmmm... strange mlv clip w/o VIDF blocks ;)\n", in_file_name);
+        ret = 0;
+        goto bailout;
+    }
+
+    job_printf(job, "%s: Looks like a valid spanned MLV clip w/%d chunks, frameCount = %u, audioFrameCount = %u\n", in_file_name, chunk_count, frame_count, audio_count);
+    if(setf > 0)
+    {
+        if(setf == 2) frame_count = audio_count = 0;
+
+        /* Write the combined result into every chunk header */
+        for(int i = 0; i < chunk_count; i++)
+        {
+            struct utimbuf file_raw_times;
+            file_get_raw_times(&file_raw_times, chunks[i].job.file_name);
+
+            chunks[i].file_hdr.videoFrameCount = frame_count;
+            chunks[i].file_hdr.audioFrameCount = audio_count;
+            if(setf == 1) chunks[i].file_hdr.fileCount = chunk_count;
+
+            mlv_file_set_pos(chunks[i].file, 0, SEEK_SET);
+            if(fwrite(&chunks[i].file_hdr, sizeof(mlv_file_hdr_t), 1, chunks[i].file) != 1)
+            {
+                job_printf(job, "%s: Error: failed writing to file\n", chunks[i].job.file_name);
+                goto bailout;
+            }
+            fclose(chunks[i].file);
+            chunks[i].file = NULL;
+            job_printf(job, "%s: Changed frameCount value to %u, audioFrameCount to %u, fileCount to %u\n", chunks[i].job.file_name, frame_count, audio_count, chunks[i].file_hdr.fileCount);
+
+            if(file_set_raw_times(&file_raw_times, chunks[i].job.file_name) == -1)
+            {
+                job_printf(job, "%s: Failed updating file time. No big deal :)\n", chunks[i].job.file_name);
+            }
+        }
+    }
+    ret = 0;
+
+bailout:
+
+    for(int i = 0; i < chunk_count; i++)
+    {
+        if(chunks[i].file) fclose(chunks[i].file);
+        free(chunks[i].index.entries);
+        free(chunks[i].job.file_name);
+        free(chunks[i].job.report);
+    }
+    return ret;
+}
+
+int process_job(job_t *job, short setf)
+{
+    uint64_t wall_ns = time_now_ns(), cpu_ns = 0, major_faults = 0;
+    thread_usage(&cpu_ns, &major_faults);
+    int ret = (spanned_mode) ? process_clip(job, setf) : process_file(job, setf);
+    stats_add_usage(&job->stats, cpu_ns, major_faults);
+    job->stats.wall_ns += time_now_ns() - wall_ns;
+    return ret;
+}
+
+void json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for(; *str; str++)
+    {
+        unsigned char c = *str;
+        if(c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if(c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/* members shared by file entries and the totals */
+void stats_write_members(FILE *f, const scan_stats_t *stats, uint64_t wall_ns, const char *indent)
+{
+    double wall = wall_ns / 1e9;
+    fprintf(f, "%s\"bytes\": %" PRIu64 ",\n", indent, stats->file_bytes);
+    fprintf(f, "%s\"wall_s\": %.6f,\n", indent, wall);
+    fprintf(f, "%s\"cpu_s\": %.6f,\n", indent, stats->cpu_ns / 1e9);
+    fprintf(f, "%s\"mb_per_s\": %.1f,\n", indent, (wall_ns) ? stats->file_bytes / 1e6 / wall : 0.0);
+    fprintf(f, "%s\"reads\": %" PRIu64 ",\n", indent, stats->io.reads);
+    fprintf(f, "%s\"read_bytes\": %" PRIu64 ",\n", indent, stats->io.read_bytes);
+    fprintf(f, "%s\"syscalls\": %" PRIu64 ",\n", indent, stats->io.syscalls);
+    fprintf(f, "%s\"major_faults\": %" PRIu64 ",\n", indent, stats->major_faults);
+    fprintf(f, "%s\"damaged_ranges\": %u,\n", indent, stats->damaged_ranges);
+    fprintf(f, "%s\"damaged_bytes\": %" PRIu64 ",\n", indent, stats->damaged_bytes);
+    fprintf(f, "%s\"blocks\": {", indent);
+    const char *sep = "";
+    for(int i = 0; i < BT_COUNT; i++)
+    {
+        if(!stats->block_count[i]) continue;
+        fprintf(f, "%s\n%s  \"%s\": { \"count\": %" PRIu64 ", \"bytes\": %" PRIu64 " }", sep, indent, mlv_block_type_name(i), stats->block_count[i], stats->block_bytes[i]);
+        sep = ",";
+    }
+    if(*sep) fprintf(f, "\n%s", indent);
+    fprintf(f, "}\n");
+}
+
+/* --stats JSON, one entry per job in command line order and the totals over 'wall_ns', returns 0 on success */
+int stats_write(const char *file_name, job_t *jobs, int job_count, uint64_t wall_ns)
+{
+    FILE *f = (file_name) ? fopen(file_name, "w") : stdout;
+    if(!f)
+    {
+        printf("%s: Error: could not open file\n", file_name);
+        return 1;
+    }
+
+    scan_stats_t total;
+    memset(&total, 0, sizeof(scan_stats_t));
+    fprintf(f, "%s{\n  \"files\": [", (file_name) ? "" : "\n");
+    for(int i = 0; i < job_count; i++)
+    {
+        fprintf(f, "%s\n    {\n      \"file\": ", (i) ? "," : "");
+        json_string(f, jobs[i].file_name);
+        fprintf(f, ",\n      \"ok\": %s,\n", (jobs[i].ret) ? "false" : "true");
+        stats_write_members(f, &jobs[i].stats, jobs[i].stats.wall_ns, "      ");
+        fprintf(f, "    }");
+        stats_add(&total, &jobs[i].stats, 1);
+    }
+    fprintf(f, "%s],\n  \"total\": {\n    \"files\": %d,\n", (job_count) ? "\n  " : "", job_count);
+    stats_write_members(f, &total, wall_ns, "    ");
+    fprintf(f, "  }\n}\n");
+
+    if(file_name && fclose(f))
+    {
+        printf("%s: Error: failed writing to file\n", file_name);
+        return 1;
+    }
+    return 0;
+}
+
+int get_cpu_count()
+{
+#if defined(__WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? count : 1;
+#endif
+}
+
+/* HDDs get one scanner at a time, parallel seeks only slow them down */
+int get_device_limit(dev_t dev, int per_device)
+{
+    if(per_device) return per_device;
+#if defined(__linux__)
+    char path[64];
+    int rotational = 0;
+    const char *fmt[] = { "/sys/dev/block/%u:%u/queue/rotational", "/sys/dev/block/%u:%u/../queue/rotational" };
+    for(int i = 0; i < 2; i++)
+    {
+        snprintf(path, sizeof(path), fmt[i], major(dev), minor(dev));
+        FILE *f = fopen(path, "r");
+        if(!f) continue;
+        if(fscanf(f, "%d", &rotational) != 1) rotational = 0;
+        fclose(f);
+        break;
+    }
+    if(rotational) return 1;
+#endif
+    return 0;
+}
+
+/* MLV chunks (.MLV and .M00 .. .M99), used to filter directory contents */
+int is_mlv_file_name(const char *file_name)
+{
+    const char *ext = strrchr(file_name, '.');
+    if(!ext) return 0;
+    if(!strcasecmp(ext, ".mlv")) return 1;
+    return (strlen(ext) == 4 && (ext[1] == 'm' || ext[1] == 'M') && ext[2] >= '0' && ext[2] <= '9' && ext[3] >= '0' && ext[3] <= '9');
+}
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int add_job(job_t **jobs, int *job_count, int *job_cap, const char *file_name, struct stat *attr)
+{
+    if(*job_count >= *job_cap)
+    {
+        int cap = (*job_cap) ? *job_cap * 2 : 64;
+        job_t *new_jobs = realloc(*jobs, sizeof(job_t) * cap);
+        if(!new_jobs) return 0;
+        *jobs = new_jobs;
+        *job_cap = cap;
+    }
+
+    job_t *job = &(*jobs)[(*job_count)++];
+    memset(job, 0, sizeof(job_t));
+    job->file_name = strdup(file_name);
+    job->file_size = attr->st_size;
+    job->dev = attr->st_dev;
+    return job->file_name != NULL;
+}
+
+/* expand a command line argument into jobs, directories are walked recursively in name order */
+int collect_jobs(job_t **jobs, int *job_count, int *job_cap, const char *path, int from_dir)
+{
+    struct stat attr;
+    if(stat(path, &attr) != 0)
+    {
+        printf("%s: Error: could not open file\n", path);
+        return 0;
+    }
+
+    if(!S_ISDIR(attr.st_mode))
+    {
+        if(from_dir && !is_mlv_file_name(path)) return 1;
+        /* chunks are picked up through their main file */
+        if(from_dir && spanned_mode && strcasecmp(strrchr(path, '.'), ".mlv")) return 1;
+        return add_job(jobs, job_count, job_cap, path, &attr);
+    }
+
+    DIR *dir = opendir(path);
+    if(!dir)
+    {
+        printf("%s: Error: could not open directory\n", path);
+        return 0;
+    }
+
+    char **names = NULL;
+    int name_count = 0, name_cap = 0, ret = 1;
+    struct dirent *entry;
+    while((entry = readdir(dir)))
+    {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        if(name_count >= name_cap)
+        {
+            name_cap = (name_cap) ? name_cap * 2 : 64;
+            char **new_names = realloc(names, sizeof(char *) * name_cap);
+            if(!new_names)
+            {
+                ret = 0;
+                break;
+            }
+            names = new_names;
+        }
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        names[name_count] = malloc(len);
+        if(!names[name_count])
+        {
+            ret = 0;
+            break;
+        }
+        snprintf(names[name_count++], len, "%s/%s", path, entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, name_count, sizeof(char *), compare_names);
+    for(int i = 0; i < name_count; i++)
+    {
+        if(ret) ret = collect_jobs(jobs, job_count, job_cap, names[i], 1);
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+device_t *pool_get_device(pool_t *pool, dev_t dev)
+{
+    for(int i = 0; i < pool->device_count; i++)
+    {
+        if(pool->devices[i].dev == dev) return &pool->devices[i];
+    }
+    return NULL;
+}
+
+int pool_device_free(pool_t *pool, int job_idx)
+{
+    device_t *device = pool_get_device(pool, pool->jobs[job_idx].dev);
+    return (!device->limit || device->active < device->limit);
+}
+
+/* take the first job with a free device slot from own deque front, otherwise steal from other deque backs,
+   called with pool lock held, returns -1 if no runnable job at the moment */
+int pool_take_job(pool_t *pool, int worker)
+{
+    int *deque = pool->deque + worker * pool->job_count;
+    for(int i = pool->deque_head[worker]; i < pool->deque_tail[worker]; i++)
+    {
+        if(pool_device_free(pool, deque[i]))
+        {
+            int job_idx = deque[i];
+            memmove(&deque[pool->deque_head[worker] + 1], &deque[pool->deque_head[worker]], (i - pool->deque_head[worker]) * sizeof(int));
+            pool->deque_head[worker]++;
+            return job_idx;
+        }
+    }
+
+    for(int n = 1; n < pool->worker_count; n++)
+    {
+        int victim = (worker + n) % pool->worker_count;
+        int *victim_deque = pool->deque + victim * pool->job_count;
+        for(int i = pool->deque_tail[victim] - 1; i >= pool->deque_head[victim]; i--)
+        {
+            if(pool_device_free(pool, victim_deque[i]))
+            {
+                int job_idx = victim_deque[i];
+                memmove(&victim_deque[i], &victim_deque[i + 1], (pool->deque_tail[victim] - i - 1) * sizeof(int));
+                pool->deque_tail[victim]--;
+                return job_idx;
+            }
+        }
+    }
+
+    return -1;
+}
+
+void *pool_worker(void *arg)
+{
+    worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending)
+    {
+        int job_idx = pool_take_job(pool, worker->id);
+        if(job_idx < 0)
+        {
+            pthread_cond_wait(&pool->slot_freed, &pool->lock);
+            continue;
+        }
+
+        job_t *job = &pool->jobs[job_idx];
+        device_t *device = pool_get_device(pool, job->dev);
+        device->active++;
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+
+        int ret = process_job(job, pool->setf);
+
+        pthread_mutex_lock(&pool->lock);
+        device->active--;
+        job->ret = ret;
+        job->done = 1;
+        pthread_cond_broadcast(&pool->slot_freed);
+        pthread_cond_broadcast(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int compare_job_size(const void *a, const void *b)
+{
+    const job_t *job_a = *(job_t * const *)a;
+    const job_t *job_b = *(job_t * const *)b;
+    if(job_a->file_size != job_b->file_size) return (job_a->file_size < job_b->file_size) ? 1 : -1;
+    return (job_a < job_b) ? -1 : (job_a > job_b);
+}
+
+/* largest files are scheduled first, results are printed in input order as soon as they are available */
+int run_batch(job_t *jobs, int job_count, short setf, int worker_count, int per_device)
+{
+    pool_t pool;
+    memset(&pool, 0, sizeof(pool_t));
+    pool.jobs = jobs;
+    pool.job_count = job_count;
+    pool.pending = job_count;
+    pool.setf = setf;
+    pool.worker_count = (worker_count > job_count) ? job_count : worker_count;
+    int ret = 1;
+
+    job_t **order = malloc(sizeof(job_t *) * job_count);
+    pool.deque = malloc(sizeof(int) * job_count * pool.worker_count);
+    pool.deque_head = calloc(pool.worker_count, sizeof(int));
+    pool.deque_tail = calloc(pool.worker_count, sizeof(int));
+    pool.devices = calloc(job_count, sizeof(device_t));
+    pthread_t *threads = malloc(sizeof(pthread_t) * pool.worker_count);
+    worker_t *workers = malloc(sizeof(worker_t) * pool.worker_count);
+    int *threaded = calloc(pool.worker_count, sizeof(int));
+    if(!order || !pool.deque || !pool.deque_head || !pool.deque_tail || !pool.devices || !threads || !workers || !threaded)
+    {
+        printf("Error: could not allocate memory\n");
+        goto bailout;
+    }
+
+    for(int i = 0; i < job_count; i++)
+    {
+        order[i] = &jobs[i];
+        jobs[i].report_buffered = 1;
+        if(!pool_get_device(&pool, jobs[i].dev))
+        {
+            pool.devices[pool.device_count].dev = jobs[i].dev;
+            pool.devices[pool.device_count].limit = get_device_limit(jobs[i].dev, per_device);
+            pool.device_count++;
+        }
+        jobs[i].scan_limit = pool_get_device(&pool, jobs[i].dev)->limit;
+    }
+
+    /* deal size sorted jobs round robin, so every deque front holds its largest job */
+    qsort(order, job_count, sizeof(job_t *), compare_job_size);
+    for(int i = 0; i < job_count; i++)
+    {
+        int worker = i % pool.worker_count;
+        pool.deque[worker * job_count + pool.deque_tail[worker]++] = order[i] - jobs;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.slot_freed, NULL);
+    pthread_cond_init(&pool.job_done, NULL);
+    int started = 0;
+    for(int i = 0; i < pool.worker_count; i++)
+    {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        threaded[i] = !pthread_create(&threads[i], NULL, pool_worker, &workers[i]);
+        started += threaded[i];
+    }
+
+    /* workers steal from all deques, without any thread this one does all jobs before printing */
+    if(!started) pool_worker(&workers[0]);
+
+    ret = 0;
+    for(int i = 0; i < job_count; i++)
+    {
+        pthread_mutex_lock(&pool.lock);
+        while(!jobs[i].done) pthread_cond_wait(&pool.job_done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if(jobs[i].report) fputs(jobs[i].report, stdout);
+        if(jobs[i].ret) ret = 1;
+    }
+
+    for(int i = 0; i < pool.worker_count; i++)
+    {
+        if(threaded[i]) pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool.job_done);
+    pthread_cond_destroy(&pool.slot_freed);
+    pthread_mutex_destroy(&pool.lock);
+
+bailout:
+
+    free(threaded);
+    free(workers);
+    free(threads);
+    free(pool.devices);
+    free(pool.deque_tail);
+    free(pool.deque_head);
+    free(pool.deque);
+    free(order);
+    return ret;
+}
+
+void show_usage(char *executable)
+{
+    printf(
+        "\n"
+        "usage:\n"
+        "\n"
+        " %s file.mlv [--set]\n"
+        " %s [options] <file.mlv|directory> [<file.mlv|directory> ...]\n"
+        "\n   --set    if specified actually writes frameCount to file"
+        "\n            otherwise just outputs the information\n"
+        "\n   --spanned              treat file.mlv as main file of a spanned clip, scan all"
+        "\n                          .M00..M99 chunks in parallel and write combined frame counts"
+        "\n                          and fileCount to every chunk header\n"
+        "\n   --index                save a block index of all VIDF/AUDF blocks as 'file.mlv.bidx'"
+        "\n                          during the scan, written even if frameCount is already set\n"
+        "\n   --fast[=<probes>]      uncompressed clips w/o audio: estimate frameCount from file size"
+        "\n                          and VIDF stride, verify it at <probes> spread out frames (default 16)"
+        "\n                          and fall back to the full walk if any of them disagrees\n"
+        "\n   --split[=<n>]          scan each file of 64 MB and more in up to <n> regions in parallel"
+        "\n                          (default is number of CPUs), each region syncs to the first block"
+        "\n                          chain inside it and seams are checked against the previous region\n"
+        "\n   --recover              skip damaged ranges up to the next valid chain of blocks instead"
+        "\n                          of giving up on a corrupted file, only intact blocks are counted\n"
+        "\n   --async[=<depth>]      read block headers ahead with up to <depth> reads in flight"
+        "\n                          (default 16), io_uring on Linux or a pool of reader threads,"
+        "\n                          for HDD arrays and network shares with a cold cache,"
+        "\n                          files are then walked without --split\n"
+        "\n   --progress <ms>        time between progress lines (default 200), 0 prints every frame\n"
+        "\n   --stats[=<file>]       print per file block counts and bytes by type, reads, system calls,"
+        "\n                          wall and CPU time and MB/s as JSON, or write it to <file>\n"
+        "\n   Batch mode options:"
+        "\n   -j|--jobs <n>          number of worker threads, default is number of CPUs"
+        "\n   --per-device <n>       max. files, chunks or --split regions scanned in parallel on one device"
+        "\n                          default is 1 for rotational disks and unlimited otherwise\n"
+        "\n   Extra testing option:"
+        "\n   --set0x00000000    sets zero frameCount to any mlv file\n",
+        executable, executable
+    );
+}
+
+int main(int argc, char** argv)
+{
+    short setf = 0;
+    int worker_count = 0;
+    int per_device = 0;
+    int opt = 0, index = 0;
+
+    struct option long_options[] = {
+        { "set", no_argument, NULL, 's' },
+        { "set0x00000000", no_argument, NULL, 'z' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "per-device", required_argument, NULL, 'd' },
+        { "spanned", no_argument, NULL, 'S' },
+        { "index", no_argument, NULL, 'i' },
+        { "fast", optional_argument, NULL, 'f' },
+        { "async", optional_argument, NULL, 'a' },
+        { "split", optional_argument, NULL, 'p' },
+        { "recover", no_argument, NULL, 'r' },
+        { "progress", required_argument, NULL, 'P' },
+        { "stats", optional_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while((opt = getopt_long(argc, argv, "j:", long_options, &index)) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                setf = 1;
+                break;
+
+            case 'z':
+                setf = 2;
+                break;
+
+            case 'j':
+                worker_count = atoi(optarg);
+                break;
+
+            case 'd':
+                per_device = atoi(optarg);
+                break;
+
+            case 'S':
+                spanned_mode = 1;
+                break;
+
+            case 'i':
+                index_mode = 1;
+                break;
+
+            case 'f':
+                fast_probes = (optarg) ? atoi(optarg) : FAST_PROBES_DEFAULT;
+                if(fast_probes < 2) fast_probes = 2;
+                break;
+
+            case 'a':
+                async_depth = (optarg) ? atoi(optarg) : ASYNC_DEPTH_DEFAULT;
+                if(async_depth < 2) async_depth = 2;
+                break;
+
+            case 'r':
+                recover_mode = 1;
+                break;
+
+            case 'P':
+                progress_interval = atoi(optarg);
+                if(progress_interval < 0) progress_interval = 0;
+                break;
+
+            case 'T':
+                stats_mode = 1;
+                stats_file = optarg;
+                break;
+
+            case 'p':
+                split_regions = (optarg) ? atoi(optarg) : get_cpu_count();
+                if(split_regions < 2) split_regions = 2;
+                break;
+
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    /* one plain file keeps the classic streaming output */
+    struct stat attr;
+    uint64_t wall_ns = time_now_ns();
+    if(argc - optind == 1 && stat(argv[optind], &attr) == 0 && !S_ISDIR(attr.st_mode))
+    {
+        job_t job;
+        memset(&job, 0, sizeof(job_t));
+        job.file_name = argv[optind];
+        job.scan_limit = get_device_limit(attr.st_dev, per_device);
+        job.ret = process_job(&job, setf);
+        if(stats_mode && stats_write(stats_file, &job, 1, time_now_ns() - wall_ns)) return 1;
+        return job.ret;
+    }
+
+    job_t *jobs = NULL;
+    int job_count = 0, job_cap = 0, ret = 0;
+    for(int i = optind; i < argc; i++)
+    {
+        if(!collect_jobs(&jobs, &job_count, &job_cap, argv[i], 0)) ret = 1;
+    }
+
+    if(job_count)
+    {
+        if(worker_count <= 0) worker_count = get_cpu_count();
+        if(run_batch(jobs, job_count, setf, worker_count, per_device)) ret = 1;
+    }
+    if(stats_mode && stats_write(stats_file, jobs, job_count, time_now_ns() - wall_ns)) ret = 1;
+
+    for(int i = 0; i < job_count; i++)
+    {
+        free(jobs[i].file_name);
+        free(jobs[i].report);
+    }
+    free(jobs);
+    return ret;
+}